@@ -19,6 +19,8 @@ namespace channeling {
   Channel::Channel(Hub::Hub * const hub, const std::string& config) :
     _reconnect_attempt(0),
     _hub_alive(hub->alive()),
+    _spill(nullptr),
+    _spill_max_age(0),
     _active(ATOMIC_FLAG_INIT),
     _thread(nullptr),
     _pipeRunning(ATOMIC_FLAG_INIT),
@@ -30,6 +32,17 @@ namespace channeling {
     _id(ChannelFactory::nextId())
   {
     DEBUG << _name << " : " << _id;
+    const std::string spill_path = _config.get("spill", "");
+    if (!spill_path.empty() && _direction != ChannelDirection::Input) {
+      const unsigned int spill_kb = _config.get("spill_kb", "1024");
+      const unsigned int max_age = _config.get("spill_max_age", "86400");
+      _spill_max_age = std::chrono::seconds(max_age);
+      try {
+        _spill = std::make_unique<SpillQueue>(spill_path, spill_kb * 1024);
+      } catch (const spill_error& e) {
+        ERROR << "Channel " << _name << " works without spill queue: " << e.what();
+      }
+    }
     _hub->addChannel(this);
   }
 
@@ -48,11 +61,96 @@ namespace channeling {
     DEBUG << "Incoming message " << message->data();
     std::async(std::launch::async, [&channel, msg = std::move(msg)]()
     {
-      channel.incoming(std::move(msg));
+      channel.deliver(std::move(msg));
     });
     return channel;
   }
 
+  void Channel::deliver(const message_ptr&& msg) {
+    if (!_spill) {
+      incoming(std::move(msg));
+      return;
+    }
+    std::lock_guard<std::mutex> lock(_spill_mutex);
+    /* Anything spilled goes first to keep the order */
+    if (_active && drainSpill()) {
+      try {
+        incoming(std::move(msg));
+        return;
+      } catch (const std::exception& e) {
+        WARNING << "Channel " << _name << " failed to send message, spilling: " << e.what();
+      }
+    }
+    spill(msg);
+  }
+
+  void Channel::spill(const message_ptr& msg) {
+    SpillQueue::Entry entry;
+    entry.timestamp = std::chrono::duration_cast<std::chrono::milliseconds>
+                        (std::chrono::system_clock::now().time_since_epoch()).count();
+    entry.origin = msg->_originId;
+    entry.type = static_cast<uint8_t>(msg->type());
+    switch (msg->type()) {
+    case MessageType::Text: {
+      const auto textmsg = TextMessage::fromMessage(msg);
+      entry.user = textmsg->user()->name();
+      entry.text = textmsg->data();
+      break;
+    }
+    case MessageType::Action: {
+      const auto actionmsg = ActionMessage::fromMessage(msg);
+      entry.user = actionmsg->user()->name();
+      entry.text = actionmsg->data();
+      break;
+    }
+    }
+    const size_t dropped = _spill->dropped();
+    if (!_spill->push(entry))
+      WARNING << "Message too large for spill queue of " << _name;
+    else if (_spill->dropped() != dropped)
+      WARNING << "Spill queue of " << _name << " is full, dropped " << _spill->dropped() - dropped << " oldest messages";
+  }
+
+  bool Channel::drainSpill() {
+    const auto oldest = std::chrono::duration_cast<std::chrono::milliseconds>
+                          ((std::chrono::system_clock::now() - _spill_max_age).time_since_epoch()).count();
+    size_t sent = 0;
+    size_t expired = 0;
+    SpillQueue::Entry entry;
+    while (_spill->front(entry)) {
+      if (entry.timestamp < oldest) {
+        _spill->pop();
+        ++expired;
+        continue;
+      }
+      auto user = std::make_shared<const User>(User(std::move(entry.user)));
+      message_ptr msg;
+      if (static_cast<MessageType>(entry.type) == MessageType::Action)
+        msg = std::make_shared<const ActionMessage>(entry.origin, std::move(user), entry.text);
+      else
+        msg = std::make_shared<const TextMessage>(entry.origin, std::move(user), entry.text);
+      try {
+        incoming(std::move(msg));
+      } catch (const std::exception& e) {
+        WARNING << "Channel " << _name << " failed while sending spilled messages: " << e.what();
+        return false;
+      }
+      _spill->pop();
+      ++sent;
+    }
+    if (sent || expired)
+      DEBUG << "Channel " << _name << " sent " << sent << " spilled messages, " << expired << " expired";
+    return true;
+  }
+
+  void Channel::flushSpill() {
+    if (!_spill)
+      return;
+    std::lock_guard<std::mutex> lock(_spill_mutex);
+    if (_active)
+      drainSpill();
+  }
+
   void Channel::startPolling() {
     if (_fd < 0) {
       DEBUG << "Channel " << _name << " fd < 0, reconnecting";
@@ -94,6 +192,7 @@ namespace channeling {
     if (_pipeRunning) {
       // Successfully reconnected
       _reconnect_attempt = 0;
+      flushSpill();
       return;
     }
 
@@ -4,11 +4,14 @@
 #include <vector>
 #include <map>
 #include <future>
+#include <mutex>
+#include <chrono>
 
 #include "message.hpp"
 #include "hub.hpp"
 #include "config.hpp"
 #include "logging.hpp"
+#include "spillqueue.hpp"
 
 namespace channeling {
   using namespace messaging;
@@ -71,6 +74,28 @@ namespace channeling {
     void reconnect();
 
     std::shared_ptr<std::atomic<bool> > _hub_alive; /**< The hub is alive and we can try reconnecting */
+
+    /* Store-and-forward for inactive output */
+    std::unique_ptr<SpillQueue> _spill;             /**< Messages waiting for the channel to come back */
+    std::mutex _spill_mutex;                        /**< Keeps delivery order between spill and new messages */
+    std::chrono::seconds _spill_max_age;            /**< Spilled messages older than this are dropped */
+
+    /**
+     * Deliver \c msg to incoming() or spill it if the channel is inactive
+     */
+    void deliver(const message_ptr&& msg);
+
+    /**
+     * Put \c msg into spill queue, _spill_mutex must be held
+     */
+    void spill(const message_ptr& msg);
+
+    /**
+     * Send spilled messages to incoming() in order, _spill_mutex must be held
+     *
+     * @retval false if channel failed and the rest is left in queue
+     */
+    bool drainSpill();
   protected:
     std::atomic_bool _active;                       /**< Channel is prepared and active */
 
@@ -158,6 +183,13 @@ namespace channeling {
      */
     virtual std::future<void> activate() = 0;
 
+    /**
+     * Send messages spilled while the channel was inactive
+     *
+     * Called by hub and reconnect() after successful activation.
+     */
+    void flushSpill();
+
     /**
      * Operator >> is used to push data into output channels
      *
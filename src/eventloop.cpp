@@ -0,0 +1,193 @@
+#include "eventloop.hpp"
+#include "logging.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+namespace eventloop {
+  constexpr int max_events = 64;
+
+  static inline void runSafe(const Task& task) {
+    try {
+      task();
+    } catch (const std::exception& e) {
+      ERROR << "Unhandled exception in event loop task: " << e.what();
+    }
+  }
+
+  EventLoop::EventLoop() :
+    _epoll(epoll_create1(EPOLL_CLOEXEC)),
+    _wakeup(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+    _running(ATOMIC_FLAG_INIT),
+    _thread(nullptr),
+    _next_timer(1)
+  {
+    if (_epoll < 0 || _wakeup < 0)
+      throw loop_error("Can't create event loop: " + std::string(strerror(errno)));
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = _wakeup;
+    if (epoll_ctl(_epoll, EPOLL_CTL_ADD, _wakeup, &ev) < 0)
+      throw loop_error("Can't watch wakeup descriptor");
+    _running = true;
+    _thread = std::make_unique<std::thread>(std::thread(&EventLoop::run, this));
+  }
+
+  EventLoop::~EventLoop() {
+    _running = false;
+    wake();
+    if (_thread) {
+      if (inLoop())
+        _thread->detach();
+      else
+        _thread->join();
+    }
+    close(_wakeup);
+    close(_epoll);
+  }
+
+  EventLoop& EventLoop::shared() {
+    static EventLoop instance;
+    return instance;
+  }
+
+  bool EventLoop::inLoop() const {
+    return _thread && _thread->get_id() == std::this_thread::get_id();
+  }
+
+  void EventLoop::wake() {
+    const uint64_t one = 1;
+    if (write(_wakeup, &one, sizeof(one)) < 0 && errno != EAGAIN)
+      ERROR << "Can't wake event loop up: " << strerror(errno);
+  }
+
+  void EventLoop::post(Task&& task) {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _tasks.push_back(std::move(task));
+    }
+    wake();
+  }
+
+  TimerId EventLoop::schedule(std::chrono::milliseconds delay, Task&& task) {
+    TimerId id;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      id = _next_timer++;
+      _timers.emplace(clock::now() + delay, std::make_pair(id, std::move(task)));
+    }
+    wake();
+    return id;
+  }
+
+  void EventLoop::cancel(TimerId id) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (auto it = _timers.begin(); it != _timers.end(); ++it)
+      if (it->second.first == id) {
+        _timers.erase(it);
+        return;
+      }
+  }
+
+  void EventLoop::watch(int fd, uint32_t events, Handler&& handler) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    const bool known = _handlers.find(fd) != _handlers.end();
+    if (epoll_ctl(_epoll, known ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) < 0)
+      throw loop_error("Can't watch descriptor: " + std::string(strerror(errno)));
+    _handlers[fd] = std::make_shared<Handler>(std::move(handler));
+  }
+
+  void EventLoop::modify(int fd, uint32_t events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(_epoll, EPOLL_CTL_MOD, fd, &ev) < 0)
+      throw loop_error("Can't modify descriptor events: " + std::string(strerror(errno)));
+  }
+
+  void EventLoop::unwatch(int fd) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_handlers.erase(fd))
+      epoll_ctl(_epoll, EPOLL_CTL_DEL, fd, nullptr);
+  }
+
+  int EventLoop::nextTimeout() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (!_tasks.empty())
+      return 0;
+    if (_timers.empty())
+      return -1;
+    const auto& left = std::chrono::duration_cast<std::chrono::milliseconds>
+                         (_timers.begin()->first - clock::now()).count();
+    /* Round up to avoid spinning before the timer expires */
+    return left < 0 ? 0 : static_cast<int>(left) + 1;
+  }
+
+  void EventLoop::runTimers() {
+    const auto now = clock::now();
+    while (true) {
+      Task task;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_timers.empty() || _timers.begin()->first > now)
+          return;
+        task = std::move(_timers.begin()->second.second);
+        _timers.erase(_timers.begin());
+      }
+      runSafe(task);
+    }
+  }
+
+  void EventLoop::runTasks() {
+    std::vector<Task> tasks;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      tasks.swap(_tasks);
+    }
+    for (auto& task : tasks)
+      runSafe(task);
+  }
+
+  void EventLoop::run() {
+    struct epoll_event events[max_events];
+    while (_running) {
+      const int count = epoll_wait(_epoll, events, max_events, nextTimeout());
+      if (count < 0 && errno != EINTR) {
+        ERROR << "epoll_wait() failed: " << strerror(errno);
+        break;
+      }
+      for (int i = 0; i < count; i++) {
+        const int fd = events[i].data.fd;
+        if (fd == _wakeup) {
+          uint64_t value;
+          while (read(_wakeup, &value, sizeof(value)) > 0) {}
+          continue;
+        }
+        std::shared_ptr<Handler> handler;
+        {
+          std::lock_guard<std::mutex> lock(_mutex);
+          const auto& found = _handlers.find(fd);
+          if (found == _handlers.end())
+            continue;
+          handler = found->second;
+        }
+        try {
+          (*handler)(events[i].events);
+        } catch (const std::exception& e) {
+          ERROR << "Unhandled exception in event handler: " << e.what();
+        }
+      }
+      runTimers();
+      runTasks();
+    }
+  }
+}
@@ -0,0 +1,109 @@
+#pragma once
+#include <map>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <stdexcept>
+
+namespace eventloop {
+  /**
+   * Event loop error
+   */
+  class loop_error: public std::runtime_error {
+  public:
+    loop_error(std::string const& message) :
+      std::runtime_error(message)
+    {};
+  };
+
+  typedef std::function<void()> Task;                     /**< Function to run on the loop thread */
+  typedef std::function<void(uint32_t events)> Handler;   /**< Descriptor event receiver, gets epoll events */
+  typedef uint64_t TimerId;                               /**< Scheduled task identifier */
+
+  /**
+   * Single-threaded epoll based event loop
+   *
+   * The loop owns one thread which waits for descriptor events and timers
+   * and runs the handlers. All the methods are thread-safe, handlers and
+   * tasks are always called from the loop thread, so the state they touch
+   * doesn't need any locking if it's not accessed from outside.
+   *
+   * Handlers must not block: descriptors should be non-blocking.
+   */
+  class EventLoop {
+    typedef std::chrono::steady_clock clock;
+
+    int _epoll;                                           /**< epoll instance */
+    int _wakeup;                                          /**< eventfd to interrupt epoll_wait() */
+    std::atomic_bool _running;                            /**< Loop thread should continue */
+    std::unique_ptr<std::thread> _thread;                 /**< Loop thread */
+
+    std::mutex _mutex;                                    /**< Lock for everything below */
+    std::vector<Task> _tasks;                             /**< Posted tasks */
+    std::multimap<clock::time_point, std::pair<TimerId, Task> > _timers; /**< Scheduled tasks */
+    std::map<int, std::shared_ptr<Handler> > _handlers;   /**< Watched descriptors */
+    TimerId _next_timer;                                  /**< Counter for timer ids */
+
+    void run();                                           /**< Thread function */
+    void wake();                                          /**< Interrupt epoll_wait() */
+    int nextTimeout();                                    /**< Milliseconds until next timer or -1 */
+    void runTimers();                                     /**< Run expired timers */
+    void runTasks();                                      /**< Run posted tasks */
+  public:
+    EventLoop();
+    ~EventLoop();
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    /**
+     * Loop shared by all the parts of the process
+     */
+    static EventLoop& shared();
+
+    /**
+     * Run \c task on the loop thread as soon as possible
+     */
+    void post(Task&& task);
+
+    /**
+     * Run \c task on the loop thread after \c delay
+     *
+     * \retval id to use with \c cancel()
+     */
+    TimerId schedule(std::chrono::milliseconds delay, Task&& task);
+
+    /**
+     * Remove scheduled task if it's not started yet
+     */
+    void cancel(TimerId id);
+
+    /**
+     * Start watching \c fd for \c events calling \c handler on them
+     *
+     * \param fd Descriptor, should be non-blocking
+     * \param events epoll events mask (EPOLLIN, EPOLLOUT...)
+     * \param handler Function to call with events occured
+     * \throws loop_error if the descriptor can't be watched
+     */
+    void watch(int fd, uint32_t events, Handler&& handler);
+
+    /**
+     * Change events mask for watched \c fd
+     */
+    void modify(int fd, uint32_t events);
+
+    /**
+     * Stop watching \c fd. Must be called before closing the descriptor.
+     */
+    void unwatch(int fd);
+
+    /**
+     * Check whether the caller runs on the loop thread
+     */
+    bool inLoop() const;
+  };
+}
@@ -14,12 +14,44 @@ namespace fileChannel {
     return std::async(std::launch::async,
                       [this]() {
       if (_direction == channeling::ChannelDirection::Input) {
-        _fd = openPipe("input");
-        startPolling();
+        const std::string tail = _config.get("tail", "");
+        if (tail.empty()) {
+          _fd = openPipe("input");
+          startPolling();
+        } else {
+          try {
+            const size_t max_line = static_cast<int>(_config.get("max_line", "65536"));
+            const bool from_end = static_cast<std::string>(_config.get("tail_from", "end")) != "start";
+            _tail = std::make_unique<FileTail>(tail, _config.get("tail_state", (_name + ".tail").c_str()), from_end, max_line,
+                                               [this](const std::string& line) {
+                                                 _hub->newMessage(parse(line.c_str()));
+                                               });
+          } catch (const std::exception& e) {
+            throw channeling::activate_error(_name, ERR_FILE_OPEN + ": " + e.what());
+          }
+        }
       } else if (_direction == channeling::ChannelDirection::Output) {
-        _file.clear();
-        _file.open("output", std::ios::out);
+        try {
+          const size_t flush_messages = static_cast<int>(_config.get("flush_messages", "64"));
+          const std::chrono::milliseconds flush_delay(static_cast<int>(_config.get("flush_ms", "200")));
+          const auto sync = parseSyncPolicy(_config.get("sync", "none"));
+          if (static_cast<std::string>(_config.get("format", "text")) == "journal") {
+            journal::WriterOptions options;
+            options.segment_size = static_cast<size_t>(static_cast<int>(_config.get("segment_mb", "64"))) << 20;
+            options.segment_age = std::chrono::hours(static_cast<int>(_config.get("segment_hours", "24")));
+            options.index_bytes = static_cast<size_t>(static_cast<int>(_config.get("index_kb", "64"))) << 10;
+            options.flush_messages = flush_messages;
+            options.flush_delay = flush_delay;
+            options.sync = sync;
+            _journal = std::make_unique<journal::JournalWriter>(_config.get("path", "journal"), options);
+          } else {
+            _writer = std::make_unique<FileWriter>(_config.get("path", "output"), flush_messages, flush_delay, sync);
+          }
+        } catch (const std::exception& e) {
+          throw channeling::activate_error(_name, ERR_FILE_OPEN + ": " + e.what());
+        }
       };
+      _active = true;
     });
   }
 
@@ -27,11 +59,17 @@ namespace fileChannel {
     DEBUG << "#file " << _name << " incoming message: ";
     if (msg->type() == messaging::MessageType::Text) {
       const auto textmsg = messaging::TextMessage::fromMessage(msg);
-      _file << textmsg->user()->name() << ": " << textmsg->data() << std::endl;
+      if (_journal)
+        _journal->append(msg->_originId, static_cast<uint8_t>(msg->type()), textmsg->user()->name(), textmsg->data());
+      if (_writer)
+        _writer->write(textmsg->user()->name() + ": " + textmsg->data() + "\n");
       DEBUG << "#file " << _name << " " << textmsg->data();
     } else if (msg->type() == messaging::MessageType::Action) {
       const auto actionmsg = messaging::ActionMessage::fromMessage(msg);
-      _file << actionmsg->user()->name() << "[ACTION]: " << actionmsg->data() << std::endl;
+      if (_journal)
+        _journal->append(msg->_originId, static_cast<uint8_t>(msg->type()), actionmsg->user()->name(), actionmsg->data());
+      if (_writer)
+        _writer->write(actionmsg->user()->name() + "[ACTION]: " + actionmsg->data() + "\n");
       DEBUG << "#file " << _name << " performes an action: " << actionmsg->data();
     } else {
       throw std::runtime_error("Unknown message type");
@@ -48,10 +86,9 @@ namespace fileChannel {
 
   FileChannel::~FileChannel() {
     stopPolling();
-    if (_file.is_open()) {
-      _file.flush();
-      _file.close();
-    }
+    _tail.reset();
+    _writer.reset();
+    _journal.reset();
   }
 
 /* OS interaction code begins here */
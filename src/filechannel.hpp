@@ -1,6 +1,8 @@
 #pragma once
 #include "channel.hpp"
-#include <fstream>
+#include "filewriter.hpp"
+#include "journal.hpp"
+#include "filetail.hpp"
 
 namespace fileChannel {
 
@@ -8,9 +10,28 @@ namespace fileChannel {
    * File channel
    *
    * May be useful for logging
+   *
+   * Input is read from "input" FIFO, or a regular file is followed when
+   * "tail" option is set, see \c FileTail. Options:
+   *   - tail: file to follow
+   *   - tail_state: file to keep read position in (<name>.tail)
+   *   - tail_from: "end" or "start", where to begin a file without saved
+   *     position (end)
+   *   - max_line: longer lines are split (65536)
+   *
+   * Output is written with group commit, see \c FileWriter. Options:
+   *   - format: "text" lines or binary "journal", see journal.hpp (text)
+   *   - path: output file or journal directory (output or journal)
+   *   - flush_messages: messages to buffer before writing (64)
+   *   - flush_ms: maximum time a message stays in buffer (200)
+   *   - sync: "none" or "commit" to fdatasync() after every write (none)
+   *   - segment_mb, segment_hours, index_kb: journal rotation and index
+   *     density (64, 24, 64)
    */
   class FileChannel: public channeling::Channel {
-    std::fstream _file;                             /**< File stream to save log */
+    std::unique_ptr<FileWriter> _writer;            /**< Text output writer */
+    std::unique_ptr<journal::JournalWriter> _journal; /**< Journal output writer */
+    std::unique_ptr<FileTail> _tail;                /**< Followed input file */
 
     /**
      * Opens input pipe
@@ -0,0 +1,332 @@
+#include "filetail.hpp"
+#include "fsutil.hpp"
+#include "logging.hpp"
+
+#include <future>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <cinttypes>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+
+namespace fileChannel {
+  constexpr size_t read_chunk = 64 << 10;                 /**< Single read() size */
+  constexpr size_t read_batch = 1 << 20;                  /**< Data read before letting other loop tasks run */
+  constexpr std::chrono::milliseconds save_delay(1000);   /**< Position is saved at most once in this time */
+  constexpr size_t check_bytes = 16;                      /**< Bytes before the offset compared to detect rewrite */
+
+  FileTail::FileTail(const std::string& path, const std::string& state, bool from_end, size_t max_line,
+                     Receiver&& receiver) :
+    _path(path),
+    _state(state),
+    _max_line(std::max<size_t>(max_line, 1)),
+    _receiver(std::move(receiver)),
+    _loop(eventloop::EventLoop::shared()),
+    _inotify(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)),
+    _dir_watch(-1),
+    _file_watch(-1),
+    _fd(-1),
+    _inode(0),
+    _offset(0),
+    _saved(true),
+    _save_timer(0),
+    _more_timer(0)
+  {
+    if (_inotify < 0)
+      throw std::runtime_error("Can't init inotify: " + std::string(strerror(errno)));
+    try {
+      if (_loop.inLoop()) {
+        start(from_end);
+      } else {
+        std::promise<void> started;
+        _loop.post([this, from_end, &started]() {
+          try {
+            start(from_end);
+            started.set_value();
+          } catch (...) {
+            started.set_exception(std::current_exception());
+          }
+        });
+        started.get_future().get();
+      }
+    } catch (...) {
+      ::close(_inotify);
+      throw;
+    }
+  }
+
+  FileTail::~FileTail() {
+    if (_loop.inLoop()) {
+      stop();
+    } else {
+      std::promise<void> stopped;
+      _loop.post([this, &stopped]() {
+        stop();
+        stopped.set_value();
+      });
+      stopped.get_future().wait();
+    }
+    if (_writing.valid())
+      _writing.wait();
+    if (!_final.empty())
+      write(_final);
+    ::close(_inotify);
+  }
+
+  void FileTail::start(bool from_end) {
+    const auto slash = _path.rfind('/');
+    const std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : _path.substr(0, slash);
+    /* Rotation creates or moves the file in its directory */
+    _dir_watch = inotify_add_watch(_inotify, dir.c_str(), IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE);
+    if (_dir_watch < 0)
+      throw std::runtime_error("Can't watch " + dir + ": " + strerror(errno));
+    _loop.watch(_inotify, EPOLLIN, [this](uint32_t) { onEvents(); });
+
+    off_t offset = from_end ? -1 : 0;
+    std::string saved;
+    try {
+      struct stat sb;
+      uintmax_t inode = 0;
+      intmax_t position = 0;
+      if (!_state.empty() && fsutil::readFile(_state, saved) &&
+          sscanf(saved.c_str(), "%" SCNuMAX " %" SCNdMAX, &inode, &position) == 2 &&
+          stat(_path.c_str(), &sb) == 0) {
+        if (sb.st_ino == inode) {
+          offset = position;
+          DEBUG << "Continue reading " << _path << " from " << offset;
+        } else {
+          /* Rotated while we were down, the old file is lost for us */
+          WARNING << "File " << _path << " was replaced, reading it from start";
+          offset = 0;
+        }
+      }
+    } catch (const fsutil::fs_error& e) {
+      WARNING << "Can't read position of " << _path << ": " << e.what();
+    }
+    openFile(offset);
+    check();
+  }
+
+  void FileTail::stop() {
+    if (_more_timer)
+      _loop.cancel(_more_timer);
+    _more_timer = 0;
+    if (_save_timer)
+      _loop.cancel(_save_timer);
+    _save_timer = 0;
+    /* The last position is written by destructor after the background write */
+    if (!_saved && !_state.empty() && _fd >= 0)
+      _final = position();
+    _saved = true;
+    if (_dir_watch >= 0) {
+      _loop.unwatch(_inotify);
+      inotify_rm_watch(_inotify, _dir_watch);
+    }
+    _dir_watch = -1;
+    closeFile();
+  }
+
+  void FileTail::onEvents() {
+    const auto slash = _path.rfind('/');
+    const std::string name = slash == std::string::npos ? _path : _path.substr(slash + 1);
+    alignas(struct inotify_event) char buffer[4096];
+    bool changed = false;
+    ssize_t size;
+    while ((size = ::read(_inotify, buffer, sizeof(buffer))) > 0) {
+      for (const char* ptr = buffer; ptr < buffer + size; ) {
+        const auto event = reinterpret_cast<const struct inotify_event *>(ptr);
+        if (event->wd == _file_watch || (event->mask & IN_Q_OVERFLOW) ||
+            (event->wd == _dir_watch && event->len > 0 && name == event->name))
+          changed = true;
+        ptr += sizeof(struct inotify_event) + event->len;
+      }
+    }
+    if (size < 0 && errno != EAGAIN && errno != EINTR)
+      ERROR << "inotify read failed for " << _path << ": " << strerror(errno);
+    if (changed && !_more_timer)
+      check();
+  }
+
+  void FileTail::check() {
+    struct stat sb;
+    if (_fd >= 0) {
+      if (truncated()) {
+        WARNING << "File " << _path << " is truncated, reading from start";
+        _offset = 0;
+        _partial.clear();
+        _last.clear();
+      }
+      if (readFile()) {
+        /* Let the other loop tasks run, rotation is checked after reading all */
+        _more_timer = _loop.schedule(std::chrono::milliseconds(0), [this]() {
+          _more_timer = 0;
+          check();
+        });
+        return;
+      }
+    }
+    if (stat(_path.c_str(), &sb) < 0 || (_fd >= 0 && sb.st_ino == _inode))
+      return;
+    if (_fd >= 0) {
+      /* Old file is read to the end, it won't grow anymore */
+      emit(_partial.data(), _partial.size());
+      _partial.clear();
+      DEBUG << "File " << _path << " is rotated";
+      closeFile();
+    }
+    openFile(0);
+    if (_fd >= 0)
+      check();
+  }
+
+  bool FileTail::truncated() {
+    struct stat sb;
+    if (fstat(_fd, &sb) < 0)
+      return false;
+    if (sb.st_size < _offset)
+      return true;
+    if (_last.empty())
+      return false;
+    /* Truncation and writing as much again may come in one wakeup */
+    char buffer[check_bytes];
+    const ssize_t size = pread(_fd, buffer, _last.size(), _offset - _last.size());
+    return size == static_cast<ssize_t>(_last.size()) && memcmp(buffer, _last.data(), size) != 0;
+  }
+
+  void FileTail::openFile(off_t offset) {
+    _fd = ::open(_path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (_fd < 0) {
+      if (errno != ENOENT)
+        ERROR << "Can't open " << _path << ": " << strerror(errno);
+      return;
+    }
+    struct stat sb;
+    if (fstat(_fd, &sb) < 0) {
+      ERROR << "Can't stat " << _path << ": " << strerror(errno);
+      closeFile();
+      return;
+    }
+    _inode = sb.st_ino;
+    _offset = offset < 0 ? sb.st_size : offset > sb.st_size ? 0 : offset;
+    _partial.clear();
+    _last.clear();
+    _file_watch = inotify_add_watch(_inotify, _path.c_str(), IN_MODIFY);
+    if (_file_watch < 0)
+      WARNING << "Can't watch " << _path << ", new lines come with rotation only: " << strerror(errno);
+    _saved = false;
+    scheduleSave();
+  }
+
+  void FileTail::closeFile() {
+    if (_file_watch >= 0)
+      inotify_rm_watch(_inotify, _file_watch);
+    _file_watch = -1;
+    if (_fd >= 0)
+      ::close(_fd);
+    _fd = -1;
+  }
+
+  bool FileTail::readFile() {
+    char buffer[read_chunk];
+    size_t total = 0;
+    while (total < read_batch) {
+      const ssize_t size = pread(_fd, buffer, sizeof(buffer), _offset);
+      if (size < 0 && errno == EINTR)
+        continue;
+      if (size < 0)
+        ERROR << "Can't read " << _path << ": " << strerror(errno);
+      if (size <= 0)
+        break;
+      _offset += size;
+      total += size;
+      if (static_cast<size_t>(size) >= check_bytes) {
+        _last.assign(buffer + size - check_bytes, check_bytes);
+      } else {
+        _last.append(buffer, size);
+        if (_last.size() > check_bytes)
+          _last.erase(0, _last.size() - check_bytes);
+      }
+      split(buffer, size);
+    }
+    if (total > 0) {
+      _saved = false;
+      scheduleSave();
+    }
+    return total >= read_batch;
+  }
+
+  void FileTail::split(const char* data, size_t size) {
+    const char* end = data + size;
+    while (data < end) {
+      const auto newline = static_cast<const char *>(memchr(data, '\n', end - data));
+      if (!newline) {
+        _partial.append(data, end - data);
+        if (_partial.size() >= _max_line) {
+          /* Keep the tail shorter than a part for the next read */
+          const size_t parts = _partial.size() / _max_line * _max_line;
+          emit(_partial.data(), parts);
+          _partial.erase(0, parts);
+        }
+        return;
+      }
+      if (_partial.empty()) {
+        emit(data, newline - data);
+      } else {
+        _partial.append(data, newline - data);
+        emit(_partial.data(), _partial.size());
+        _partial.clear();
+      }
+      data = newline + 1;
+    }
+  }
+
+  void FileTail::emit(const char* line, size_t size) {
+    if (size > 0 && line[size - 1] == '\r')
+      --size;
+    for (size_t part = 0; part < size; part += _max_line)
+      _receiver(std::string(line + part, std::min(_max_line, size - part)));
+  }
+
+  std::string FileTail::position() const {
+    /* Incomplete line is read again after restart */
+    return std::to_string(_inode) + " " + std::to_string(_offset - _partial.size()) + "\n";
+  }
+
+  void FileTail::write(const std::string& position) const {
+    try {
+      fsutil::atomicWrite(_state, position);
+    } catch (const fsutil::fs_error& e) {
+      WARNING << "Can't save position of " << _path << ": " << e.what();
+    }
+  }
+
+  void FileTail::save() {
+    _saved = true;
+    if (_state.empty() || _fd < 0)
+      return;
+    if (_writing.valid()) {
+      /* Don't pile the writes up if the disk is slow, the newer position comes later */
+      if (_writing.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        _saved = false;
+        scheduleSave();
+        return;
+      }
+      _writing.get();
+    }
+    /* fsync takes long on a busy disk, so it's kept off the loop */
+    _writing = std::async(std::launch::async, [this, position = position()]() { write(position); });
+  }
+
+  void FileTail::scheduleSave() {
+    if (_state.empty() || _save_timer)
+      return;
+    _save_timer = _loop.schedule(save_delay, [this]() {
+      _save_timer = 0;
+      save();
+    });
+  }
+}
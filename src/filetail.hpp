@@ -0,0 +1,82 @@
+#pragma once
+#include "eventloop.hpp"
+#include <string>
+#include <functional>
+#include <future>
+#include <sys/types.h>
+
+namespace fileChannel {
+  /**
+   * Follows a growing regular file like "tail -F"
+   *
+   * Works on the shared event loop: inotify wakes it up when the file or
+   * its directory changes, new data is read from the last offset and split
+   * into lines. An incomplete last line is kept until its end arrives.
+   *
+   * Rotation (the path now points to another file) is detected by inode:
+   * the rest of the old file is read and the new one is followed from its
+   * start. If the file becomes shorter than the offset or the last bytes
+   * read before the offset change, it's considered truncated and read
+   * from the start too. A file rewritten with the same bytes up to the
+   * offset is taken for a grown one, so are the files truncated while
+   * the program was down.
+   *
+   * The inode and the offset of the first unsent byte are saved to the
+   * state file in background, so after restart reading continues from
+   * the same line.
+   */
+  class FileTail {
+  public:
+    typedef std::function<void(const std::string& line)> Receiver; /**< Gets lines without line end, on the loop thread */
+
+  private:
+    const std::string _path;                              /**< Followed file */
+    const std::string _state;                             /**< File to keep position in, empty to not keep */
+    const size_t _max_line;                               /**< Longer lines are sent in parts */
+    const Receiver _receiver;                             /**< Line receiver */
+    eventloop::EventLoop& _loop;                          /**< Loop to work on */
+
+    int _inotify;                                         /**< inotify descriptor */
+    int _dir_watch;                                       /**< Watch for file directory */
+    int _file_watch;                                      /**< Watch for the file itself */
+    int _fd;                                              /**< Followed file descriptor or -1 */
+    ino_t _inode;                                         /**< Inode of \c _fd */
+    off_t _offset;                                        /**< Read position in \c _fd */
+    std::string _partial;                                 /**< Incomplete line, read before \c _offset */
+    std::string _last;                                    /**< Last bytes read before \c _offset */
+    bool _saved;                                          /**< Position is saved to \c _state */
+    eventloop::TimerId _save_timer;                       /**< Position saving task */
+    eventloop::TimerId _more_timer;                       /**< Continuation of long reading */
+    std::future<void> _writing;                           /**< Position being written in background */
+    std::string _final;                                   /**< Position to write on destruction */
+
+    void start(bool from_end);                            /**< Set up watches and open the file, loop thread */
+    void stop();                                          /**< Remove watches and save position, loop thread */
+    void onEvents();                                      /**< inotify handler */
+    void check();                                         /**< Read new data, detect rotation and truncation */
+    bool truncated();                                     /**< Check if the data before \c _offset is gone */
+    void openFile(off_t offset);                          /**< Follow \c _path from \c offset, -1 for the end */
+    void closeFile();                                     /**< Stop following current file */
+    bool readFile();                                      /**< Read a portion, true if there may be more */
+    void split(const char* data, size_t size);            /**< Pass complete lines to receiver */
+    void emit(const char* line, size_t size);             /**< Pass one line to receiver */
+    std::string position() const;                         /**< Position line for \c _state */
+    void write(const std::string& position) const;        /**< Atomically replace \c _state */
+    void save();                                          /**< Write position to \c _state in background */
+    void scheduleSave();                                  /**< Save position a bit later */
+  public:
+    /**
+     * Start following \c path
+     *
+     * \param state Position file, empty to not keep position
+     * \param from_end Start from the end of file if there's no saved
+     *                 position for it, otherwise from the start
+     * \param max_line Send incomplete line when it reaches this size
+     * \throws std::runtime_error if inotify can't be set up
+     */
+    FileTail(const std::string& path, const std::string& state, bool from_end, size_t max_line, Receiver&& receiver);
+    ~FileTail();
+    FileTail(const FileTail&) = delete;
+    FileTail& operator=(const FileTail&) = delete;
+  };
+}
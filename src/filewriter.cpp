@@ -0,0 +1,96 @@
+#include "filewriter.hpp"
+#include "logging.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace fileChannel {
+  SyncPolicy parseSyncPolicy(const std::string& name) {
+    if (name == "none")
+      return SyncPolicy::None;
+    if (name == "commit")
+      return SyncPolicy::Commit;
+    throw std::invalid_argument("Unknown sync policy " + name);
+  }
+
+  FileWriter::FileWriter(const std::string& path, size_t max_messages, std::chrono::milliseconds max_delay,
+                         SyncPolicy sync) :
+    _fd(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)),
+    _max_messages(max_messages > 0 ? max_messages : 1),
+    _max_delay(max_delay),
+    _sync(sync),
+    _pending(0),
+    _running(true)
+  {
+    if (_fd < 0)
+      throw std::runtime_error("Can't open " + path + ": " + strerror(errno));
+    _thread = std::thread(&FileWriter::run, this);
+  }
+
+  FileWriter::~FileWriter() {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _running = false;
+    }
+    _cv.notify_one();
+    _thread.join();
+    if (_sync != SyncPolicy::None && fsync(_fd) < 0)
+      ERROR << "Can't sync file: " << strerror(errno);
+    close(_fd);
+  }
+
+  void FileWriter::write(const std::string& line) {
+    bool wake;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      /* The thread sleeps until the first message and wakes up by timeout after it */
+      wake = _pending == 0;
+      if (wake)
+        _first = clock::now();
+      _buffer += line;
+      if (++_pending >= _max_messages)
+        wake = true;
+    }
+    if (wake)
+      _cv.notify_one();
+  }
+
+  void FileWriter::commit(const std::string& data) {
+    size_t written = 0;
+    while (written < data.size()) {
+      const auto result = ::write(_fd, data.data() + written, data.size() - written);
+      if (result < 0) {
+        if (errno == EINTR)
+          continue;
+        ERROR << "Can't write file, " << data.size() - written << " bytes lost: " << strerror(errno);
+        return;
+      }
+      written += result;
+    }
+    if (_sync == SyncPolicy::Commit && fdatasync(_fd) < 0)
+      ERROR << "Can't sync file: " << strerror(errno);
+  }
+
+  void FileWriter::run() {
+    /* Buffers are swapped, so both keep their capacity */
+    std::string data;
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true) {
+      if (_pending == 0) {
+        if (!_running)
+          break;
+        _cv.wait(lock, [this]() { return _pending > 0 || !_running; });
+        continue;
+      }
+      _cv.wait_until(lock, _first + _max_delay, [this]() { return _pending >= _max_messages || !_running; });
+      data.clear();
+      data.swap(_buffer);
+      _pending = 0;
+      lock.unlock();
+      commit(data);
+      lock.lock();
+    }
+  }
+}
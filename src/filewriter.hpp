@@ -0,0 +1,71 @@
+#pragma once
+#include <string>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <stdexcept>
+
+namespace fileChannel {
+  /**
+   * When the written data is synced to disk
+   */
+  enum class SyncPolicy {
+    None,                                                 /**< Leave it to the OS */
+    Commit                                                /**< fdatasync() after every group commit */
+  };
+
+  /**
+   * Parse policy name from config: "none" or "commit"
+   *
+   * \throws std::invalid_argument for unknown names
+   */
+  SyncPolicy parseSyncPolicy(const std::string& name);
+
+  /**
+   * Buffered file writer with group commit
+   *
+   * Lines are collected in memory and written by the writer thread with
+   * one write() call when \c max_messages are buffered or \c max_delay
+   * passed since the first of them, whichever comes first. The callers
+   * never wait for disk.
+   */
+  class FileWriter {
+    typedef std::chrono::steady_clock clock;
+
+    int _fd;                                              /**< File descriptor */
+    const size_t _max_messages;                           /**< Messages to trigger commit */
+    const std::chrono::milliseconds _max_delay;           /**< Maximum time a message waits in buffer */
+    const SyncPolicy _sync;                               /**< Durability policy */
+
+    std::mutex _mutex;                                    /**< Lock for everything below */
+    std::condition_variable _cv;                          /**< Signals the writer thread */
+    std::string _buffer;                                  /**< Data waiting for commit */
+    size_t _pending;                                      /**< Messages in \c _buffer */
+    clock::time_point _first;                             /**< Arrival of the first message in \c _buffer */
+    bool _running;                                        /**< Writer thread should continue */
+    std::thread _thread;                                  /**< Writer thread */
+
+    void run();                                           /**< Writer thread function */
+    void commit(const std::string& data);                 /**< Write \c data and sync it if needed */
+  public:
+    /**
+     * Open \c path truncating it and start the writer thread
+     *
+     * \throws std::runtime_error if the file can't be opened
+     */
+    FileWriter(const std::string& path, size_t max_messages, std::chrono::milliseconds max_delay, SyncPolicy sync);
+
+    /**
+     * Commit everything buffered, sync unless policy is None and close
+     */
+    ~FileWriter();
+    FileWriter(const FileWriter&) = delete;
+    FileWriter& operator=(const FileWriter&) = delete;
+
+    /**
+     * Queue \c line for writing, newline is not added
+     */
+    void write(const std::string& line);
+  };
+}
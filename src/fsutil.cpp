@@ -0,0 +1,82 @@
+#include "fsutil.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace fsutil {
+  static inline std::string error(const std::string& what, const std::string& path) {
+    return what + " " + path + ": " + strerror(errno);
+  }
+
+  /**
+   * Write the whole buffer retrying on partial writes
+   */
+  static bool writeAll(int fd, const char* data, size_t size) {
+    while (size > 0) {
+      const ssize_t res = write(fd, data, size);
+      if (res < 0) {
+        if (errno == EINTR)
+          continue;
+        return false;
+      }
+      data += res;
+      size -= res;
+    }
+    return true;
+  }
+
+  void atomicWrite(const std::string& path, const void* data, size_t size) {
+    const std::string tmp = path + ".tmp";
+    const int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+      throw fs_error(error("Can't create", tmp));
+    if (!writeAll(fd, static_cast<const char *>(data), size) || fsync(fd) < 0) {
+      const auto& message = error("Can't write", tmp);
+      close(fd);
+      unlink(tmp.c_str());
+      throw fs_error(message);
+    }
+    close(fd);
+    if (rename(tmp.c_str(), path.c_str()) < 0) {
+      const auto& message = error("Can't replace", path);
+      unlink(tmp.c_str());
+      throw fs_error(message);
+    }
+    /* Sync the directory so the rename itself survives a crash */
+    const auto& slash = path.rfind('/');
+    const std::string dir = slash == std::string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+    const int dirfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd >= 0) {
+      fsync(dirfd);
+      close(dirfd);
+    }
+  }
+
+  bool readFile(const std::string& path, std::string& data) {
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      if (errno == ENOENT)
+        return false;
+      throw fs_error(error("Can't open", path));
+    }
+    data.clear();
+    char buffer[4096];
+    while (true) {
+      const ssize_t res = read(fd, buffer, sizeof(buffer));
+      if (res < 0) {
+        if (errno == EINTR)
+          continue;
+        const auto& message = error("Can't read", path);
+        close(fd);
+        throw fs_error(message);
+      }
+      if (res == 0)
+        break;
+      data.append(buffer, res);
+    }
+    close(fd);
+    return true;
+  }
+}
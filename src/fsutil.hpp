@@ -0,0 +1,39 @@
+#pragma once
+#include <string>
+#include <stdexcept>
+
+namespace fsutil {
+  /**
+   * File system operation error
+   */
+  class fs_error: public std::runtime_error {
+  public:
+    fs_error(std::string const& message) :
+      std::runtime_error(message)
+    {};
+  };
+
+  /**
+   * Replace contents of \c path with \c data atomically
+   *
+   * The data is written to "path.tmp", synced to disk and renamed over
+   * \c path, then the directory is synced to persist the rename. Readers
+   * always see either the old or the new contents, never a partial file,
+   * even after a crash.
+   *
+   * \throws fs_error if something fails, \c path is untouched then
+   */
+  void atomicWrite(const std::string& path, const void* data, size_t size);
+  inline void atomicWrite(const std::string& path, const std::string& data) {
+    atomicWrite(path, data.data(), data.size());
+  }
+
+  /**
+   * Read the whole file
+   *
+   * \param[out] data File contents
+   * \retval false if the file doesn't exist
+   * \throws fs_error if the file exists but can't be read
+   */
+  bool readFile(const std::string& path, std::string& data);
+}
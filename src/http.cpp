@@ -3,49 +3,303 @@
 #include "net.hpp"
 #include "http.hpp"
 #include "logging.hpp"
+#include "eventloop.hpp"
 
+#include <cerrno>
 #include <cstring>
+#include <strings.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 namespace http {
 
-  static inline void ltrim(std::string& s) {
-    s.erase(s.begin(), std::find_if(s.begin(), s.end(),
-                                    std::not1(std::ptr_fun<int, int>(std::isspace))));
+  std::string HTTPResponse::operator[](const std::string& header) const {
+    const auto& value = _parser.header(header.c_str());
+    if (!value.first)
+      throw std::out_of_range("No header " + header);
+    return std::string(value.first, value.second);
   }
 
-  static inline void rtrim(std::string& s) {
-    s.erase(std::find_if(s.rbegin(), s.rend(),
-                         std::not1(std::ptr_fun<int, int>(std::isspace))).base(),
-            s.end());
+  const std::pair<const void * const, size_t> HTTPResponse::data() const {
+    return _parser.body();
   }
 
-  static inline void trim(std::string& s) {
-    ltrim(s);
-    rtrim(s);
+  std::pair<char *, size_t> HTTPResponse::mutableData() {
+    return _parser.mutableBody();
   }
 
-  static inline std::string trimmed(std::string s) {
-    trim(s);
-    return s;
+  /**
+   * Raw buffer to be written to the log without copying to a string
+   */
+  struct LogBuffer {
+    const void * const data;
+    const size_t size;
+  };
+
+  static std::ostream& operator<<(std::ostream& os, const LogBuffer& buf) {
+    return os.write(static_cast<const char *>(buf.data), buf.size);
   }
 
-  const std::string& HTTPResponse::operator[](const std::string& header) const {
-    std::string upcase_header;
-    std::transform(header.begin(), header.end(),
-                   std::back_inserter(upcase_header), ::toupper);
-    return _headers.at(upcase_header);
+  std::future<std::unique_ptr<HTTPResponse> >
+  PerformHTTPRequest(const std::string& url, const HTTPRequest& req) {
+    return PerformHTTPRequest(url, req, BodyConsumer());
   }
 
-  const std::pair<const void * const, size_t> HTTPResponse::data() const {
-    const char* _body = static_cast<const char *>(_buffer) + _header_size;
-    return std::make_pair(static_cast<const void *>(_body), _buffer_size - _header_size);
+  /**
+   * Single request running on the shared event loop
+   *
+   * Goes through connecting, TLS handshake, sending and receiving stages as
+   * the socket becomes ready. The loop handler keeps the object alive until
+   * the response is complete or an error occurs.
+   */
+  class AsyncRequest: public std::enable_shared_from_this<AsyncRequest> {
+    enum class Stage {
+      Connecting,                                  /**< Waiting for non-blocking connect() */
+      Handshaking,                                 /**< TLS handshake in progress */
+      Sending,                                     /**< Writing the request */
+      Receiving                                    /**< Reading the response */
+    };
+
+    eventloop::EventLoop& _loop;                   /**< Loop running the request */
+    const std::string _host;                       /**< "host:port" of the server */
+    const bool _https;                             /**< Use TLS */
+    const std::string _request_line;               /**< Request line with headers */
+    struct iovec _iov[2];                          /**< Data left to send */
+    int _iov_first;                                /**< First \c _iov item not sent completely */
+    int _iov_count;                                /**< Number of \c _iov items */
+    int _fd;                                       /**< Socket */
+    uint32_t _events;                              /**< Events the socket is watched for */
+    const std::chrono::milliseconds _timeout;      /**< Time for the whole request */
+    eventloop::TimerId _timer;                     /**< Deadline of the request, 0 if not set */
+    Stage _stage;                                  /**< Current stage */
+    std::unique_ptr<ConnectionManager> _conn;      /**< Connection after connect() is complete */
+#ifdef TLS_SUPPORT
+    networking::TLSConnection* _tls;               /**< TLS layer owned by \c _conn */
+    bool _queued;                                  /**< Request is put into TLS records */
+#endif
+    std::unique_ptr<HTTPResponse> _response;       /**< Response being received */
+    std::promise<std::unique_ptr<HTTPResponse> > _promise; /**< Result for the caller */
+    ResponseHandler _handler;                      /**< Result receiver used instead of \c _promise */
+
+    void process();                                /**< Advance through the stages */
+    void connected();                              /**< Check connect() result and set up connection */
+    bool handshake();                              /**< Continue TLS handshake, true if done */
+    bool send();                                   /**< Continue sending, true if done */
+    void wait(uint32_t events);                    /**< Wait for \c events on the socket */
+    void release();                                /**< Stop watching and close the socket */
+    void expire();                                 /**< Abort the request on deadline */
+    void succeed();                                /**< Deliver the response */
+    void fail(std::exception_ptr error);           /**< Deliver the error */
+  public:
+    AsyncRequest(const std::string& host, bool https, HTTPRequestType method, const std::string& request_line,
+                 const std::pair<const void * const, size_t>& body, std::chrono::milliseconds timeout,
+                 BodyConsumer&& consumer, ResponseHandler&& handler);
+
+    std::future<std::unique_ptr<HTTPResponse> > future() { return _promise.get_future(); };
+
+    /**
+     * Connect to the server and put the request to the loop
+     *
+     * Errors are reported through the future or the handler.
+     */
+    void start();
+  };
+
+  AsyncRequest::AsyncRequest(const std::string& host, bool https, HTTPRequestType method, const std::string& request_line,
+                             const std::pair<const void * const, size_t>& body, std::chrono::milliseconds timeout,
+                             BodyConsumer&& consumer, ResponseHandler&& handler) :
+    _loop(eventloop::EventLoop::shared()),
+    _host(host),
+    _https(https),
+    _request_line(request_line),
+    _iov_first(0),
+    _iov_count(body.second > 0 ? 2 : 1),
+    _fd(-1),
+    _events(EPOLLOUT),
+    _timeout(timeout),
+    _timer(0),
+    _stage(Stage::Connecting),
+#ifdef TLS_SUPPORT
+    _tls(nullptr),
+    _queued(false),
+#endif
+    _response(std::make_unique<HTTPResponse>(std::move(consumer), method)),
+    _handler(std::move(handler))
+  {
+    _iov[0].iov_base = const_cast<char *>(_request_line.data());
+    _iov[0].iov_len = _request_line.length();
+    _iov[1].iov_base = const_cast<void *>(body.first);
+    _iov[1].iov_len = body.second;
   }
 
-  std::future<std::unique_ptr<HTTPResponse> >
-  PerformHTTPRequest(const std::string& url, const HTTPRequest& req) {
+  void AsyncRequest::start() {
+    TRACE << "Sending " << _request_line << LogBuffer {_iov[1].iov_base, _iov[1].iov_len};
+    try {
+      _fd = networking::tcp_connect(_host, true);
+      auto self = shared_from_this();
+      /* Set before watching, so the handlers always see it */
+      _timer = _loop.schedule(_timeout, [self]() { self->expire(); });
+      _loop.watch(_fd, _events, [self](uint32_t) { self->process(); });
+    } catch (...) {
+      if (_timer)
+        _loop.cancel(_timer);
+      _timer = 0;
+      if (_fd >= 0)
+        close(_fd);
+      if (!_handler) {
+        _promise.set_exception(std::current_exception());
+        return;
+      }
+      /* The handler always runs on the loop, even for early errors */
+      auto self = shared_from_this();
+      auto error = std::current_exception();
+      _loop.post([self, error]() { self->fail(error); });
+    }
+  }
+
+  void AsyncRequest::process() {
+    try {
+      if (_stage == Stage::Connecting)
+        connected();
+      if (_stage == Stage::Handshaking && !handshake())
+        return;
+      if (_stage == Stage::Sending && !send())
+        return;
+      if (!_response->receiveFrom(*_conn)) {
+        wait(EPOLLIN);
+        return;
+      }
+    } catch (...) {
+      release();
+      fail(std::current_exception());
+      return;
+    }
+    release();
+    succeed();
+  }
+
+  void AsyncRequest::succeed() {
+    if (_handler)
+      _handler(std::move(_response), nullptr);
+    else
+      _promise.set_value(std::move(_response));
+  }
+
+  void AsyncRequest::fail(std::exception_ptr error) {
+    if (_handler)
+      _handler(nullptr, error);
+    else
+      _promise.set_exception(error);
+  }
+
+  void AsyncRequest::connected() {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(_fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0)
+      error = errno;
+    if (error)
+      throw networking::network_error("Can't connect to " + _host + ": " + strerror(error));
+    TRACE << "Connected to " << _host;
+#ifdef TLS_SUPPORT
+    if (_https) {
+      auto tls = std::make_unique<networking::TLSConnection>(_fd, _host);
+      _tls = tls.get();
+      _conn = std::make_unique<HTTPSConnectionManager>(std::move(tls));
+      _stage = Stage::Handshaking;
+      return;
+    }
+#endif
+    _conn = std::make_unique<HTTPConnectionManager>(_fd);
+    _stage = Stage::Sending;
+  }
+
+  bool AsyncRequest::handshake() {
+#ifdef TLS_SUPPORT
+    const int ret = _tls->handshake();
+    if (ret == GNUTLS_E_AGAIN) {
+      wait(_tls->direction() ? EPOLLOUT : EPOLLIN);
+      return false;
+    }
+    if (ret < 0)
+      throw networking::tls_error(ret, "Handshake failed");
+    DEBUG << "TLS handshake completed";
+#endif
+    _stage = Stage::Sending;
+    return true;
+  }
+
+  bool AsyncRequest::send() {
+#ifdef TLS_SUPPORT
+    if (_tls) {
+      if (!_queued) {
+        _tls->queue(_iov, _iov_count);
+        _queued = true;
+      }
+      if (!_tls->flush()) {
+        wait(EPOLLOUT);
+        return false;
+      }
+      _stage = Stage::Receiving;
+      return true;
+    }
+#endif
+    while (_iov_first < _iov_count) {
+      ssize_t res = _conn->sendv(_iov + _iov_first, _iov_count - _iov_first);
+      if (res < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+          throw http_error("Can't send the request: " + std::string(strerror(errno)));
+        wait(EPOLLOUT);
+        return false;
+      }
+      while (_iov_first < _iov_count && static_cast<size_t>(res) >= _iov[_iov_first].iov_len) {
+        res -= _iov[_iov_first].iov_len;
+        ++_iov_first;
+      }
+      if (_iov_first < _iov_count) {
+        _iov[_iov_first].iov_base = static_cast<char *>(_iov[_iov_first].iov_base) + res;
+        _iov[_iov_first].iov_len -= res;
+      }
+    }
+    _stage = Stage::Receiving;
+    return true;
+  }
+
+  void AsyncRequest::wait(uint32_t events) {
+    if (events == _events)
+      return;
+    _loop.modify(_fd, events);
+    _events = events;
+  }
+
+  void AsyncRequest::expire() {
+    _timer = 0;
+    WARNING << "HTTP request to " << _host << " timed out";
+    release();
+    fail(std::make_exception_ptr(http_error("Request to " + _host + " timed out")));
+  }
+
+  void AsyncRequest::release() {
+    if (_timer)
+      _loop.cancel(_timer);
+    _timer = 0;
+    _loop.unwatch(_fd);
+    const bool owned = _conn && !_https;
+    _conn.reset();
+    /* HTTPConnectionManager closes its descriptor, the TLS one doesn't */
+    if (!owned)
+      close(_fd);
+  }
+
+  /**
+   * Parse \c url and prepare the request to run on the loop
+   */
+  static std::shared_ptr<AsyncRequest>
+  makeRequest(const std::string& url, const HTTPRequest& req, BodyConsumer&& consumer, ResponseHandler&& handler) {
     bool https = false;
     const std::string::size_type proto_end = url.find("://");
     if (proto_end == std::string::npos)
@@ -63,7 +317,14 @@ namespace http {
 
     /* Now trying to detect if there is a port */
     const std::vector<char> c {':', '/'};
-    const auto server_end_c = std::find_first_of(std::next(url.cbegin(), proto_end + 3),
+    auto server_start = proto_end + 3;
+    if (url.compare(server_start, 1, "[") == 0) {
+      /* IPv6 address contains colons */
+      server_start = url.find(']', server_start);
+      if (server_start == std::string::npos)
+        throw url_error("Unclosed bracket in address");
+    }
+    const auto server_end_c = std::find_first_of(std::next(url.cbegin(), server_start),
                                                  url.cend(),
                                                  c.begin(), c.end());
     const auto server_end = std::distance(url.cbegin(), server_end_c);
@@ -82,164 +343,368 @@ namespace http {
     DEBUG << "Opening " << std::string(https ? "secure" : "insecure")
           << " connection to " << server << " on port " << port;
 
-    std::string request_line = req.getHTTPLine();
-    const auto request_body = req.body();
-    TRACE << "Requesting: " << request_line;
-
-    if (!https) {
-      return std::async(std::launch::async, [server, port, request_line, request_body]() {
-        const int fd = networking::tcp_connect(server + ":" + port);
-        auto&& conn_mgr = std::make_unique<HTTPConnectionManager>(fd);
-        {
-          auto buf = new char[request_body.second + 1];
-          int res = snprintf(buf, request_body.second + 1, "%.*s",
-                             static_cast<int>(request_body.second),
-                             static_cast<const char *>(request_body.first));
-          TRACE << "Sending " << request_line << buf;
-          delete[] buf;
-        }
-        conn_mgr->send(request_line.c_str(), request_line.length());
-        if (request_body.second > 0)
-          conn_mgr->send(request_body.first, request_body.second);
-        auto&& response = std::make_unique<HTTPResponse>(std::move(conn_mgr));
-        return std::move(response);
-      });
-    }
-#ifdef TLS_SUPPORT
-    else {
-      return std::async(std::launch::async, [server, port, request_line, request_body]() {
-        auto&& conn = networking::tls_connect(server + ":" + port);
-        auto&& conn_mgr = std::make_unique<HTTPSConnectionManager>(std::move(conn));
-        {
-          auto buf = new char[request_body.second + 1];
-          int res = snprintf(buf, request_body.second + 1, "%.*s",
-                             static_cast<int>(request_body.second),
-                             static_cast<const char *>(request_body.first));
-          TRACE << "Sending " << request_line << buf;
-          delete[] buf;
-        }
-        conn_mgr->send(request_line.c_str(), request_line.length());
-        if (request_body.second > 0)
-          conn_mgr->send(request_body.first, request_body.second);
-        auto&& response = std::make_unique<HTTPResponse>(std::move(conn_mgr));
-        return std::move(response);
-      });
-    }
-#else
-    throw http_error("Unsupported protocol provided");
+#ifndef TLS_SUPPORT
+    if (https)
+      throw http_error("Unsupported protocol provided");
 #endif
+
+    return std::make_shared<AsyncRequest>(server + ":" + port, https, req._type, req.getHTTPLine(),
+                                          req.body(), req.timeout(), std::move(consumer), std::move(handler));
   }
 
-  constexpr auto MAX_BUF = 4096;
-  constexpr auto receive_timeout = std::chrono::milliseconds(5);
+  std::future<std::unique_ptr<HTTPResponse> >
+  PerformHTTPRequest(const std::string& url, const HTTPRequest& req, BodyConsumer&& consumer) {
+    auto request = makeRequest(url, req, std::move(consumer), ResponseHandler());
+    auto result = request->future();
+    request->start();
+    return result;
+  }
+
+  void PerformHTTPRequest(const std::string& url, const HTTPRequest& req, ResponseHandler&& handler) {
+    makeRequest(url, req, BodyConsumer(), std::move(handler))->start();
+  }
+
+  constexpr size_t MAX_BUF = 4096;
+  constexpr size_t MAX_HEADER = 64 * 1024;
 
   HTTPResponse::HTTPResponse(std::unique_ptr<ConnectionManager>&& mgr) :
+    _connection_manager(std::move(mgr))
+  {
+    receive();
+  }
+
+  HTTPResponse::HTTPResponse(BodyConsumer&& consumer, HTTPRequestType method) :
+    _parser(std::move(consumer), method)
+  {}
+
+  HTTPResponse::HTTPResponse(std::unique_ptr<ConnectionManager>&& mgr, BodyConsumer&& consumer) :
     _connection_manager(std::move(mgr)),
+    _parser(std::move(consumer))
+  {
+    receive();
+  }
+
+  void HTTPResponse::receive() {
+    while (!receiveFrom(*_connection_manager)) {}
+  }
+
+  bool HTTPResponse::receiveFrom(ConnectionManager& conn) {
+    while (!_parser.done()) {
+      const auto& space = _parser.prepare();
+      ssize_t res = 0;
+      try {
+        res = conn.recv(space.first, space.second);
+      }
+      catch (networking::tls_error e) {
+        if (e.code != 0) throw networking::tls_error(e);
+        res = 0; // Just end of data in TLS connection
+      }
+      if (res < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+          return false;
+        throw http_error("Error while receiving the response");
+      }
+      if (res == 0) {
+        _parser.finish();
+        break;
+      }
+      _parser.commit(res);
+    }
+    /* Error is reported with the whole response, the body often explains it */
+    if (_parser.code() >= 400) {
+      const auto& body = _parser.body();
+      throw http_error("Server return HTTP error " + std::to_string(_parser.code()), _parser.code(),
+                       std::string(static_cast<const char *>(body.first), body.second));
+    }
+    return true;
+  }
+
+  HTTPResponse::~HTTPResponse() {}
+
+  ResponseParser::ResponseParser() :
+    _buffer(static_cast<char *>(malloc(MAX_BUF + 1))),
+    _size(0),
+    _capacity(MAX_BUF + 1),
+    _parsed(0),
+    _body_start(0),
+    _body_end(0),
+    _remaining(0),
+    _state(State::StatusLine),
     _code(0),
-    _buffer(malloc(MAX_BUF)),
-    _buffer_size(0),
-    _header_size(0) {
-    memset(_buffer, 0, MAX_BUF);
-    _buffer_size = _connection_manager->recv(_buffer, MAX_BUF - 1);
-    /** TODO : check res < 0 */
-    parseHttp();
-    recvBody();
+    _head(false)
+  {
+    if (!_buffer)
+      throw std::bad_alloc();
+    _buffer[0] = 0;
+    _headers.reserve(16);
+  }
+
+  ResponseParser::ResponseParser(BodyConsumer&& consumer, HTTPRequestType method) :
+    ResponseParser(method)
+  {
+    _consumer = std::move(consumer);
+  }
+
+  ResponseParser::ResponseParser(HTTPRequestType method) :
+    ResponseParser()
+  {
+    _head = method == HTTPRequestType::HEAD;
   }
 
-  HTTPResponse::~HTTPResponse() {
+  ResponseParser::~ResponseParser() {
     free(_buffer);
   }
 
-  void HTTPResponse::parseHttp() {
-    _resp = std::make_unique<std::istringstream>(static_cast<char *>(_buffer));
-    std::string header;
-    std::string::size_type index;
-
-    // Parse HTTP response code
-    std::getline(*_resp, header);
-    index = header.find(' ', 0);
-    const std::string http_proto = header.substr(0, index);
-    /* Checking HTTP version */
-    {
-      const auto& http_keyword = http_proto.substr(0, http_proto.find("/"));
-      if (http_keyword != "HTTP")
-        throw http_error("Response is not HTTP");
-      const auto& http_ver =
-        http_proto.substr(http_keyword.length() + 1,
-                          http_proto.length() - http_keyword.length());
-      TRACE << "HTTP: " << http_keyword << " " << http_ver;
-      if (std::stof(http_ver) > 1.1f)
-        throw http_error("Unsupported version of HTTP");
+  std::pair<void *, size_t> ResponseParser::prepare() {
+    /* One byte is always kept for terminating zero */
+    if (_capacity < _size + MAX_BUF + 1) {
+      const size_t capacity = std::max(_capacity * 2, _size + MAX_BUF + 1);
+      const auto buffer = static_cast<char *>(realloc(_buffer, capacity));
+      if (!buffer)
+        throw std::bad_alloc();
+      _buffer = buffer;
+      _capacity = capacity;
     }
-    index = header.find(' ', index + 1);
-    const uint32_t http_code = std::stoi(header.substr(http_proto.length() + 1, index));
-    const std::string http_text = header.substr(index + 1, header.length());
-    TRACE << "The response of proto " << http_proto << " is " << http_code << " with text " << http_text;
-    _code = http_code;
-    if (http_code >= 400) {
-      throw http_error("Server return HTTP error " + std::to_string(http_code), http_code);
+    return std::make_pair(static_cast<void *>(_buffer + _size), _capacity - _size - 1);
+  }
+
+  bool ResponseParser::feed(const void * const data, size_t count) {
+    const char* src = static_cast<const char *>(data);
+    while (count > 0) {
+      const auto& space = prepare();
+      const size_t portion = std::min(count, space.second);
+      memcpy(space.first, src, portion);
+      if (commit(portion))
+        return true;
+      src += portion;
+      count -= portion;
     }
-    // Parse HTTP Headers
-    while (std::getline(*_resp, header) && header != "\r") {
-      index = header.find(':', 0);
-      if(index != std::string::npos) {
-        std::string key = header.substr(0, index);
-        TRACE << "Found key " << key;
-        std::transform(key.begin(), key.end(), key.begin(), ::toupper);
-        _headers.insert(std::make_pair(trimmed(key), trimmed(header.substr(index + 1))));
-      }
+    return done();
+  }
+
+  bool ResponseParser::nextLine(size_t& end) {
+    const char* found = static_cast<const char *>(memchr(_buffer + _parsed, '\n', _size - _parsed));
+    if (!found) {
+      if (_size - _parsed > MAX_HEADER)
+        throw http_error("Response line is too long");
+      return false;
     }
+    end = found - _buffer;
+    if (end > _parsed && _buffer[end - 1] == '\r')
+      --end;
+    return true;
   }
 
-  void HTTPResponse::recvBody() {
-    _header_size = _resp->tellg();
-    if (_headers.find("CONTENT-LENGTH") != _headers.end()) {
-      const size_t response_size = std::stoi(_headers["CONTENT-LENGTH"]);
-      DEBUG << "Content-Length provided with " << response_size << " bytes.";
-      if (MAX_BUF - _header_size < response_size) {
-        _buffer = realloc(_buffer, MAX_BUF + response_size + 1);
-        memset(static_cast<char *>(_buffer) + _buffer_size, 0, response_size + 1);
+  bool ResponseParser::commit(size_t count) {
+    _size += count;
+    size_t end = 0;
+    while (_parsed < _size && _state != State::Done) {
+      const size_t line_start = _parsed;
+      if (_state == State::Body || _state == State::ChunkData || _state == State::UntilClose) {
+        consumeBody();
+        continue;
       }
-      char* buf = static_cast<char *>(_buffer);
-      while (_buffer_size < _header_size + response_size) {
-        TRACE << "[" << _buffer_size << "/" << _header_size + response_size << "] downloaded";
-        try {
-          auto res = _connection_manager->recv(buf + _buffer_size, response_size);
-          _buffer_size += res;
-        }
-        catch (networking::tls_error e) {
-          if (e.code == 0) break; // Just end of data in TLS connection
-          else throw networking::tls_error(e);
+      /* Line-based states */
+      if (!nextLine(end))
+        break;
+      const size_t next = static_cast<const char *>(memchr(_buffer + end, '\n', _size - end)) - _buffer + 1;
+      switch (_state) {
+      case State::StatusLine:
+        parseStatus(end);
+        _state = State::Headers;
+        break;
+      case State::Headers:
+        if (end == line_start) {
+          _parsed = next;
+          startBody();
+          continue;
         }
+        parseHeader(end);
+        break;
+      case State::ChunkSize: {
+        char* size_end = nullptr;
+        const size_t chunk_size = strtoul(_buffer + line_start, &size_end, 16);
+        if (size_end == _buffer + line_start)
+          throw http_error("Malformed chunk size");
+        TRACE << "Chunk of " << chunk_size << " bytes";
+        _remaining = chunk_size;
+        _state = chunk_size ? State::ChunkData : State::Trailers;
+        break;
       }
-    } else {
-      DEBUG << "Content-Length not provided, reading the socket until timeout";
-      size_t current_size = MAX_BUF;
-      size_t res = 0;
-      size_t pending;
-      auto last_read = std::chrono::high_resolution_clock::now();
-      auto timeout =
-        [](auto start) {
-          const auto now = std::chrono::high_resolution_clock::now();
-          const std::chrono::duration<double> diff = now - start;
-          return diff > receive_timeout;
-        };
-      while ((pending = _connection_manager->pending()) || !timeout(last_read)) {
-        if (current_size < _buffer_size + pending + 1) {
-          current_size += MAX_BUF;
-          _buffer = realloc(_buffer, current_size);
-          memset(static_cast<char *>(_buffer) + _buffer_size, 0, MAX_BUF);
-          pending = MAX_BUF;
-        }
-        char* buf = static_cast<char *>(_buffer);
-        res = _connection_manager->recv(buf + _buffer_size, pending);
-        _buffer_size += res;
-        if (res) {
-          TRACE << "[" << current_size << "/" << _buffer_size + pending << "] downloaded";
-          last_read = std::chrono::high_resolution_clock::now();
-        }
+      case State::ChunkDataEnd:
+        if (end != line_start)
+          throw http_error("Malformed chunk end");
+        _state = State::ChunkSize;
+        break;
+      case State::Trailers:
+        if (end == line_start)
+          complete();
+        break;
+      default:
+        break;
       }
+      _parsed = next;
+    }
+    compact();
+    return done();
+  }
+
+  void ResponseParser::compact() {
+    if (!_consumer || !headersDone() || _parsed == _body_start)
+      return;
+    memmove(_buffer + _body_start, _buffer + _parsed, _size - _parsed);
+    _size -= _parsed - _body_start;
+    _parsed = _body_start;
+  }
+
+  void ResponseParser::parseStatus(size_t end) {
+    static const char http_keyword[] = "HTTP/";
+    const char* line = _buffer + _parsed;
+    const size_t length = end - _parsed;
+    if (length < sizeof(http_keyword) - 1 || strncmp(line, http_keyword, sizeof(http_keyword) - 1))
+      throw http_error("Response is not HTTP");
+    const char* ver = line + sizeof(http_keyword) - 1;
+    char* ver_end = nullptr;
+    const auto major = strtoul(ver, &ver_end, 10);
+    const auto minor = (*ver_end == '.') ? strtoul(ver_end + 1, &ver_end, 10) : 0;
+    if (major > 1 || (major == 1 && minor > 1))
+      throw http_error("Unsupported version of HTTP");
+    char* code_end = nullptr;
+    _code = strtol(ver_end, &code_end, 10);
+    if (code_end == ver_end || code_end > line + length)
+      throw http_error("Malformed HTTP status line");
+    TRACE << "The response of HTTP/" << major << "." << minor << " is " << _code;
+  }
+
+  void ResponseParser::parseHeader(size_t end) {
+    const char* line = _buffer + _parsed;
+    const char* colon = static_cast<const char *>(memchr(line, ':', end - _parsed));
+    if (!colon)
+      return;
+    size_t name_end = colon - _buffer;
+    size_t value = name_end + 1;
+    size_t value_end = end;
+    while (name_end > _parsed && isspace(static_cast<unsigned char>(_buffer[name_end - 1]))) --name_end;
+    while (value < value_end && isspace(static_cast<unsigned char>(_buffer[value]))) ++value;
+    while (value_end > value && isspace(static_cast<unsigned char>(_buffer[value_end - 1]))) --value_end;
+    _headers.push_back(HeaderView {_parsed, name_end - _parsed, value, value_end - value});
+  }
+
+  void ResponseParser::startBody() {
+    if (_code >= 100 && _code < 200 && _code != 101) {
+      /* Interim response, the real one follows */
+      DEBUG << "Skipping interim response " << _code;
+      _headers.clear();
+      _state = State::StatusLine;
+      return;
+    }
+    _body_start = _body_end = _parsed;
+    const auto& encoding = header("Transfer-Encoding");
+    const auto& length = header("Content-Length");
+    if (_head || _code == 101 || _code == 204 || _code == 304) {
+      DEBUG << "Response " << _code << " has no body";
+      complete();
+    } else if (encoding.first && std::search(encoding.first, encoding.first + encoding.second,
+                                             "chunked", "chunked" + 7) != encoding.first + encoding.second) {
+      DEBUG << "Chunked body provided";
+      _state = State::ChunkSize;
+    } else if (length.first) {
+      _remaining = strtoul(length.first, nullptr, 10);
+      DEBUG << "Content-Length provided with " << _remaining << " bytes.";
+      _state = State::Body;
+      if (!_remaining)
+        complete();
+    } else {
+      DEBUG << "Content-Length not provided, reading the socket until it's closed";
+      _state = State::UntilClose;
+    }
+  }
+
+  void ResponseParser::consumeBody() {
+    size_t portion = _size - _parsed;
+    if (_state != State::UntilClose)
+      portion = std::min(portion, _remaining);
+    if (_consumer) {
+      if (portion)
+        _consumer(_buffer + _parsed, portion);
+    } else {
+      /* Chunk payloads are moved to the end of already decoded body */
+      if (_body_end != _parsed)
+        memmove(_buffer + _body_end, _buffer + _parsed, portion);
+      _body_end += portion;
+    }
+    _parsed += portion;
+    if (_state == State::UntilClose)
+      return;
+    _remaining -= portion;
+    if (_remaining == 0) {
+      if (_state == State::Body)
+        complete();
+      else
+        _state = State::ChunkDataEnd;
+    }
+  }
+
+  void ResponseParser::complete() {
+    _state = State::Done;
+    _buffer[_body_end] = 0;
+  }
+
+  void ResponseParser::finish() {
+    if (_state == State::UntilClose)
+      complete();
+    else if (_state != State::Done)
+      throw http_error("Connection closed before the response was complete");
+  }
+
+  std::pair<const char *, size_t> ResponseParser::header(const char* name) const {
+    const size_t length = strlen(name);
+    for (const auto& h : _headers)
+      if (h.name_length == length && !strncasecmp(_buffer + h.name, name, length))
+        return std::make_pair(_buffer + h.value, h.value_length);
+    return std::make_pair(nullptr, 0);
+  }
+
+  std::pair<const void * const, size_t> ResponseParser::body() const {
+    return std::make_pair(static_cast<const void *>(_buffer + _body_start), _body_end - _body_start);
+  }
+
+  std::pair<char *, size_t> ResponseParser::mutableBody() {
+    return std::make_pair(_buffer + _body_start, _body_end - _body_start);
+  }
+
+  RequestParser::RequestParser() :
+    _method_length(0),
+    _uri(0),
+    _uri_length(0)
+  {}
+
+  void RequestParser::parseStatus(size_t end) {
+    static const char http_keyword[] = " HTTP/1.";
+    const char* line = _buffer + _parsed;
+    const size_t length = end - _parsed;
+    const char* method_end = static_cast<const char *>(memchr(line, ' ', length));
+    if (!method_end || method_end == line)
+      throw http_error("Malformed HTTP request line");
+    const char* uri = method_end + 1;
+    const char* uri_end = static_cast<const char *>(memchr(uri, ' ', line + length - uri));
+    if (!uri_end || uri_end == uri ||
+        static_cast<size_t>(line + length - uri_end) < sizeof(http_keyword) - 1 ||
+        strncmp(uri_end, http_keyword, sizeof(http_keyword) - 1))
+      throw http_error("Malformed HTTP request line");
+    _method_length = method_end - line;
+    _uri = uri - _buffer;
+    _uri_length = uri_end - uri;
+    TRACE << "Request " << method() << " " << this->uri();
+  }
+
+  void RequestParser::startBody() {
+    if (!header("Transfer-Encoding").first && !header("Content-Length").first) {
+      _body_start = _body_end = _parsed;
+      complete();
+      return;
     }
+    ResponseParser::startBody();
   }
 
   HTTPConnectionManager::~HTTPConnectionManager() {
@@ -254,6 +719,50 @@ namespace http {
     return write(_fd, buffer, count);
   }
 
+  ssize_t ConnectionManager::sendv(const struct iovec* iov, int count) {
+    ssize_t total = 0;
+    for (int i = 0; i < count; i++) {
+      const ssize_t res = send(iov[i].iov_base, iov[i].iov_len);
+      if (res < 0)
+        return res;
+      total += res;
+    }
+    return total;
+  }
+
+  ssize_t HTTPConnectionManager::sendv(const struct iovec* iov, int count) {
+    constexpr int max_iov = 8;
+    if (count > max_iov)
+      return ConnectionManager::sendv(iov, count);
+    struct iovec rest[max_iov];
+    std::copy(iov, iov + count, rest);
+    struct iovec* current = rest;
+    ssize_t total = 0;
+    /* writev() may send only a part of data, so continue from where it stopped */
+    while (count > 0) {
+      ssize_t res = writev(_fd, current, count);
+      if (res < 0) {
+        if (errno == EINTR)
+          continue;
+        /* Non-blocking socket is full: report what is already sent */
+        if ((errno == EAGAIN || errno == EWOULDBLOCK) && total > 0)
+          return total;
+        return res;
+      }
+      total += res;
+      while (count > 0 && static_cast<size_t>(res) >= current->iov_len) {
+        res -= current->iov_len;
+        ++current;
+        --count;
+      }
+      if (count > 0) {
+        current->iov_base = static_cast<char *>(current->iov_base) + res;
+        current->iov_len -= res;
+      }
+    }
+    return total;
+  }
+
   ssize_t HTTPConnectionManager::pending() {
     int bytes = 0;
     ioctl(_fd, FIONREAD, &bytes);
@@ -274,6 +783,10 @@ namespace http {
     return _conn->send(buffer, count);
   }
 
+  ssize_t HTTPSConnectionManager::sendv(const struct iovec* iov, int count) {
+    return _conn->sendv(iov, count);
+  }
+
   ssize_t HTTPSConnectionManager::pending() {
     return _conn->pending_bytes();
   }
@@ -283,6 +796,8 @@ namespace http {
                            const std::string   & host,
                            const std::string   & url) :
     _body_size(0),
+    _body_capacity(0),
+    _timeout(std::chrono::seconds(default_timeout)),
     _type(type),
     _host(host),
     _uri(url)
@@ -308,20 +823,35 @@ namespace http {
   }
 
   const std::string HTTPRequest::getHTTPLine() const {
-    const static std::string http_suffix {"HTTP/1.1"};
-    const static std::string newline {"\r\n"};
-    const std::string req =
-      [this](){
-        switch (_type) {
-        case HTTPRequestType::GET:  return "GET";
-        case HTTPRequestType::HEAD: return "HEAD";
-        case HTTPRequestType::POST: return "POST";
-        default: throw http_error("Can't construct request");
-        }
-      } ();
-    std::string request_line = req + " " + _uri + " " + http_suffix + newline;
-    for (auto h : _headers)
-      request_line.append(h.first + ": " + h.second + newline);
+    static const char http_suffix[] = " HTTP/1.1\r\n";
+    static const char newline[] = "\r\n";
+    static const char separator[] = ": ";
+    static const char content_length[] = "Content-Length";
+    const char* req = nullptr;
+    switch (_type) {
+    case HTTPRequestType::GET:  req = "GET "; break;
+    case HTTPRequestType::HEAD: req = "HEAD "; break;
+    case HTTPRequestType::POST: req = "POST "; break;
+    default: throw http_error("Can't construct request");
+    }
+
+    bool has_length = false;
+    size_t size = strlen(req) + _uri.length() + sizeof(http_suffix) - 1 + sizeof(newline) - 1;
+    for (const auto& h : _headers) {
+      size += h.first.length() + sizeof(separator) - 1 + h.second.length() + sizeof(newline) - 1;
+      has_length |= (h.first == content_length);
+    }
+    const std::string length = (_body_size > 0 && !has_length) ? std::to_string(_body_size) : "";
+    if (!length.empty())
+      size += sizeof(content_length) - 1 + sizeof(separator) - 1 + length.length() + sizeof(newline) - 1;
+
+    std::string request_line;
+    request_line.reserve(size);
+    request_line.append(req).append(_uri).append(http_suffix);
+    for (const auto& h : _headers)
+      request_line.append(h.first).append(separator).append(h.second).append(newline);
+    if (!length.empty())
+      request_line.append(content_length).append(separator).append(length).append(newline);
     request_line.append(newline);
     return request_line;
   }
@@ -329,10 +859,185 @@ namespace http {
   void HTTPRequest::setBody(std::unique_ptr<char[]>&& body, size_t body_size) {
     _body = std::move(body);
     _body_size = body_size;
+    _body_capacity = body_size;
+  }
+
+  void HTTPRequest::appendBody(char c) {
+    if (_body_size == _body_capacity) {
+      _body_capacity = std::max<size_t>(_body_capacity * 2, 256);
+      std::unique_ptr<char[]> body(new char[_body_capacity]);
+      if (_body_size)
+        memcpy(body.get(), _body.get(), _body_size);
+      _body = std::move(body);
+    }
+    _body[_body_size++] = c;
   }
 
   std::pair<const void * const, size_t> HTTPRequest::body() const {
     const void * const ptr = static_cast<void *>(_body.get());
     return std::make_pair(ptr, _body_size);
   }
+
+  /**
+   * Connection of HTTPServer
+   */
+  struct HTTPServer::Client {
+    RequestParser parser;                          /**< Request being received */
+    size_t received;                               /**< Bytes received */
+    eventloop::TimerId timer;                      /**< Timeout for the request */
+  };
+
+  constexpr size_t HTTPServer::max_request;
+  constexpr int HTTPServer::client_timeout;
+  constexpr int HTTPRequest::default_timeout;
+
+  HTTPServer::HTTPServer(int port, RequestHandler&& handler, const std::string& address) :
+    _loop(eventloop::EventLoop::shared()),
+    _handler(std::move(handler)),
+    _fd(socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)),
+    _port(port)
+  {
+    if (_fd < 0)
+      throw http_error("Can't create server socket");
+    const int on = 1;
+    setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    socklen_t length = sizeof(addr);
+    if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1 ||
+        bind(_fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0 ||
+        listen(_fd, SOMAXCONN) < 0 ||
+        getsockname(_fd, reinterpret_cast<struct sockaddr *>(&addr), &length) < 0) {
+      const std::string error = strerror(errno);
+      close(_fd);
+      throw http_error("Can't listen on " + address + ":" + std::to_string(port) + ": " + error);
+    }
+    _port = ntohs(addr.sin_port);
+    _loop.watch(_fd, EPOLLIN, [this](uint32_t) { accept(); });
+    DEBUG << "HTTP server is listening on " << address << ":" << _port;
+  }
+
+  HTTPServer::~HTTPServer() {
+    if (_loop.inLoop()) {
+      stop();
+      return;
+    }
+    /* Handlers use the server, so it's only safe to stop on the loop */
+    std::promise<void> stopped;
+    _loop.post([this, &stopped]() {
+      stop();
+      stopped.set_value();
+    });
+    stopped.get_future().wait();
+  }
+
+  void HTTPServer::stop() {
+    _loop.unwatch(_fd);
+    close(_fd);
+    while (!_clients.empty())
+      drop(_clients.begin()->first);
+  }
+
+  void HTTPServer::accept() {
+    while (true) {
+      const int fd = accept4(_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+          ERROR << "Can't accept HTTP connection: " << strerror(errno);
+        if (errno == EINTR)
+          continue;
+        return;
+      }
+      auto client = std::make_shared<Client>();
+      client->received = 0;
+      std::weak_ptr<Client> weak = client;
+      client->timer = _loop.schedule(std::chrono::seconds(client_timeout), [this, fd, weak]() {
+          /* The descriptor may be already reused by another client */
+          const auto& found = _clients.find(fd);
+          if (found != _clients.end() && found->second == weak.lock()) {
+            DEBUG << "HTTP client timed out";
+            drop(fd);
+          }
+        });
+      _clients[fd] = client;
+      _loop.watch(fd, EPOLLIN, [this, fd](uint32_t) { receive(fd); });
+    }
+  }
+
+  void HTTPServer::receive(int fd) {
+    const auto& found = _clients.find(fd);
+    if (found == _clients.end())
+      return;
+    auto client = found->second;
+    while (true) {
+      const auto& space = client->parser.prepare();
+      const ssize_t res = read(fd, space.first, space.second);
+      if (res < 0) {
+        if (errno == EINTR)
+          continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+          drop(fd);
+        return;
+      }
+      if (res == 0) {
+        drop(fd);
+        return;
+      }
+      client->received += res;
+      if (client->received > max_request) {
+        reply(fd, 413);
+        return;
+      }
+      bool complete = false;
+      try {
+        complete = client->parser.commit(res);
+      } catch (const http_error& e) {
+        DEBUG << "Malformed HTTP request: " << e.what();
+        reply(fd, 400);
+        return;
+      }
+      if (complete) {
+        int code = 500;
+        try {
+          code = _handler(client->parser);
+        } catch (const std::exception& e) {
+          ERROR << "HTTP request handler failed: " << e.what();
+        }
+        reply(fd, code);
+        return;
+      }
+    }
+  }
+
+  static const char* reason(int code) {
+    switch (code) {
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 413: return "Payload Too Large";
+    default: return code < 400 ? "OK" : "Error";
+    }
+  }
+
+  void HTTPServer::reply(int fd, int code) {
+    const std::string answer = "HTTP/1.1 " + std::to_string(code) + " " + reason(code) +
+                               "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    /* The answer is tiny and fits into the empty socket buffer */
+    if (write(fd, answer.data(), answer.length()) != static_cast<ssize_t>(answer.length()))
+      DEBUG << "Can't send HTTP answer completely";
+    drop(fd);
+  }
+
+  void HTTPServer::drop(int fd) {
+    const auto& found = _clients.find(fd);
+    if (found == _clients.end())
+      return;
+    _loop.cancel(found->second->timer);
+    _clients.erase(found);
+    _loop.unwatch(fd);
+    close(fd);
+  }
 }
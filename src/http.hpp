@@ -4,6 +4,9 @@
 #include <future>
 #include <functional>
 #include <list>
+#include <vector>
+#include <sys/uio.h>
+#include "eventloop.hpp"
 #if defined(_UNIT_TEST_BUILD)
 #include <gtest/gtest_prod.h>
 #endif
@@ -21,9 +24,11 @@ namespace http {
   class http_error: public std::runtime_error {
   public:
     const int code;
-    http_error(std::string const& message, int code=-1) :
+    const std::string body;                        /**< Body of error response from server */
+    http_error(std::string const& message, int code=-1, std::string const& body="") :
       std::runtime_error(message),
-      code(code)
+      code(code),
+      body(body)
     {};
   };
 
@@ -55,11 +60,26 @@ namespace http {
     std::list<std::pair<const std::string, const std::string> > _headers;
     std::unique_ptr<char[]> _body;
     size_t _body_size;
+    size_t _body_capacity;
+    std::chrono::milliseconds _timeout;    /**< Time for the whole request */
+
+    /**
+     * Append a character to the body growing it if needed
+     */
+    void appendBody(char c);
   public:
     const HTTPRequestType _type;           /**< Request type */
     const std::string _host;               /**< Host to insert into Host: header */
     const std::string _uri;                /**< Endpoint on the \c _host */
-    const std::string getHTTPLine() const; /**< Get resulting request */
+
+    /**
+     * Get resulting request line with headers
+     *
+     * The line is built in a buffer of precomputed size. Content-Length
+     * header is added automatically if there is a body and no such header
+     * was set.
+     */
+    const std::string getHTTPLine() const;
 
     /**
      * Add custom HTTP header
@@ -74,6 +94,37 @@ namespace http {
      */
     void setBody(std::unique_ptr<char[]>&& body, size_t body_size);
     std::pair<const void * const, size_t> body() const;
+
+    /**
+     * Limit the time from connecting to the complete response
+     *
+     * The request fails with \c http_error when it's over. Long polls
+     * should set it above their server-side timeout.
+     */
+    void setTimeout(std::chrono::milliseconds timeout) { _timeout = timeout; };
+    std::chrono::milliseconds timeout() const { return _timeout; };
+    static constexpr int default_timeout = 60;     /**< Seconds for a request unless \c setTimeout() is used */
+
+    /**
+     * Output stream appending to the request body
+     *
+     * Conforms to rapidjson OutputStream concept, so the JSON may be
+     * written right into the request:
+     * @code{.cpp}
+     * auto stream = req.bodyStream();
+     * rapidjson::Writer<http::HTTPRequest::BodyStream> writer(stream);
+     * @endcode
+     */
+    class BodyStream {
+      HTTPRequest& _request;
+    public:
+      typedef char Ch;
+      explicit BodyStream(HTTPRequest& request) : _request(request) {};
+      void Put(Ch c) { _request.appendBody(c); };
+      void Flush() {};
+    };
+    BodyStream bodyStream() { return BodyStream(*this); };
+
     HTTPRequest(const HTTPRequestType type, const std::string& host,
                 const std::string& uri="/");
     ~HTTPRequest() {};
@@ -101,6 +152,15 @@ namespace http {
      */
     virtual ssize_t send(const void * const buffer, size_t count) = 0;
 
+    /**
+     * Write \c count buffers from \c iov to managed socket at once
+     *
+     * Default implementation calls \c send() for every buffer.
+     *
+     * \retval number of bytes sent.
+     */
+    virtual ssize_t sendv(const struct iovec* iov, int count);
+
     /**
      * Check if there is something in socket buffer
      *
@@ -125,6 +185,7 @@ namespace http {
     ~HTTPConnectionManager(); /**< Closes the fd */
     ssize_t recv(void* buffer, size_t count) override;
     ssize_t send(const void * const buffer, size_t count) override;
+    ssize_t sendv(const struct iovec* iov, int count) override;
     ssize_t pending() override;
   };
 
@@ -147,10 +208,183 @@ namespace http {
     ~HTTPSConnectionManager();
     ssize_t recv(void* buffer, size_t count) override;
     ssize_t send(const void * const buffer, size_t count) override;
+    ssize_t sendv(const struct iovec* iov, int count) override;
     ssize_t pending() override;
   };
 #endif
 
+  /**
+   * Receiver of the response body portions
+   *
+   * Called with every piece of the decoded body in order of arrival. The
+   * data is only valid during the call.
+   */
+  typedef std::function<void(const void * const, size_t)> BodyConsumer;
+
+  /**
+   * Incremental HTTP response parser
+   *
+   * The parser owns the receive buffer: a connection writes the data right
+   * to the space given by \c prepare() and reports the number of bytes with
+   * \c commit(). Parsing resumes from the place where the previous portion
+   * ended, so the data may come in pieces of any size (e.g. from a
+   * non-blocking socket).
+   *
+   * Headers are kept as offsets inside the buffer and the body is decoded
+   * in place, so no additional copies are made.
+   */
+  class ResponseParser {
+  public:
+    /**
+     * Parser state
+     */
+    enum class State {
+      StatusLine,                                  /**< Waiting for "HTTP/1.1 200 OK" */
+      Headers,                                     /**< Reading headers until the empty line */
+      Body,                                        /**< Reading Content-Length bytes */
+      ChunkSize,                                   /**< Waiting for chunk size line */
+      ChunkData,                                   /**< Reading chunk payload */
+      ChunkDataEnd,                                /**< Waiting for CRLF after chunk payload */
+      Trailers,                                    /**< Reading trailers after the last chunk */
+      UntilClose,                                  /**< Body is terminated with connection close */
+      Done                                         /**< Response is complete */
+    };
+  protected:
+    /**
+     * Header name and value positions inside the \c _buffer
+     */
+    struct HeaderView {
+      size_t name;
+      size_t name_length;
+      size_t value;
+      size_t value_length;
+    };
+
+    char* _buffer;                                 /**< Raw data received */
+    size_t _size;                                  /**< Bytes stored in \c _buffer */
+    size_t _capacity;                              /**< Allocated size of \c _buffer */
+    size_t _parsed;                                /**< Raw data before this offset is processed */
+    size_t _body_start;                            /**< Where the body starts in \c _buffer */
+    size_t _body_end;                              /**< End of decoded body in \c _buffer */
+    size_t _remaining;                             /**< Bytes left in current chunk or body */
+    State _state;                                  /**< Current state */
+    int _code;                                     /**< HTTP return code */
+    std::vector<HeaderView> _headers;              /**< Headers found */
+    BodyConsumer _consumer;                        /**< Streaming receiver of the body (optional) */
+    bool _head;                                    /**< Response to HEAD request, it never has a body */
+
+    /**
+     * Find next line starting from \c _parsed
+     *
+     * \param[out] end Offset of line end without CR LF
+     * \retval false if the line is not complete yet
+     */
+    bool nextLine(size_t& end);
+    virtual void parseStatus(size_t end);          /**< Parse line from \c _parsed to \c end as status */
+    void parseHeader(size_t end);                  /**< Parse line from \c _parsed to \c end as header */
+    virtual void startBody();                      /**< Decide how the body is terminated */
+    void consumeBody();                            /**< Take available body bytes */
+    void complete();                               /**< Switch to \c State::Done */
+    void compact();                                /**< Drop the body already passed to \c _consumer */
+  public:
+    ResponseParser();
+
+    /**
+     * Create a streaming parser
+     *
+     * The body is passed to \c consumer as it arrives and isn't stored, so
+     * the buffer only keeps the headers and one portion of data.
+     */
+    explicit ResponseParser(BodyConsumer&& consumer, HTTPRequestType method = HTTPRequestType::GET);
+
+    /**
+     * Create a parser for the response to \c method request
+     *
+     * Response to HEAD has no body whatever its headers say (RFC 7230
+     * section 3.3.3).
+     */
+    explicit ResponseParser(HTTPRequestType method);
+    virtual ~ResponseParser();
+    ResponseParser(const ResponseParser&) = delete;
+    ResponseParser& operator=(const ResponseParser&) = delete;
+
+    /**
+     * Get the place for the next portion of data
+     *
+     * \retval \c std::pair<buffer, size> with free space for at least
+     *         \c MAX_BUF bytes.
+     */
+    std::pair<void *, size_t> prepare();
+
+    /**
+     * Parse \c count bytes written to the space got from \c prepare()
+     *
+     * \retval true if the response is complete.
+     * \throws http_error if the response is malformed.
+     */
+    bool commit(size_t count);
+
+    /**
+     * Copy \c count bytes from \c data and parse them
+     *
+     * \retval true if the response is complete.
+     */
+    bool feed(const void * const data, size_t count);
+
+    /**
+     * Report that connection is closed by peer
+     *
+     * \throws http_error if response is not complete and can't be completed
+     *         by closing the connection.
+     */
+    void finish();
+
+    State state() const { return _state; };
+    bool done() const { return _state == State::Done; };
+    bool headersDone() const { return _state != State::StatusLine && _state != State::Headers; };
+    int code() const { return _code; };
+
+    /**
+     * Case insensitive header lookup
+     *
+     * \retval \c std::pair<value, length> or \c {nullptr, 0} if there is no
+     *         such header.
+     */
+    std::pair<const char *, size_t> header(const char* name) const;
+
+    /**
+     * Decoded body. Only complete when \c done(), it's followed by '\0'.
+     * Always empty for streaming parser.
+     */
+    std::pair<const void * const, size_t> body() const;
+
+    /**
+     * Decoded body for processing in place (e.g. in-situ parsing)
+     */
+    std::pair<char *, size_t> mutableBody();
+  };
+
+  /**
+   * Incremental HTTP request parser
+   *
+   * Works just like \c ResponseParser, but expects the request line
+   * ("POST /uri HTTP/1.1") instead of status. Request without
+   * Content-Length or Transfer-Encoding has no body.
+   */
+  class RequestParser: public ResponseParser {
+    size_t _method_length;                         /**< Method length, it starts the buffer */
+    size_t _uri;                                   /**< URI offset in the buffer */
+    size_t _uri_length;                            /**< URI length */
+  protected:
+    void parseStatus(size_t end) override;
+    void startBody() override;
+  public:
+    RequestParser();
+
+    std::string method() const { return std::string(_buffer, _method_length); };
+    std::string uri() const { return std::string(_buffer + _uri, _uri_length); };
+  };
+
   /**
    * HTTP response data
    */
@@ -159,25 +393,43 @@ namespace http {
      * HTTPConnectionManager or HTTPSConnectionManager
      */
     const std::unique_ptr<ConnectionManager> _connection_manager;
-    int _code;                                     /**< HTTP return code */
-    std::map<std::string, std::string> _headers;   /**< HTTP headers */
-    void* _buffer;                                 /**< Raw data received */
-    size_t _buffer_size;                           /**< Guaranteed size of \c _buffer */
-    size_t _header_size;                           /**< Last char of header, where the body starts in _buffer */
-    std::unique_ptr<std::istringstream> _resp;     /**< Internal conversion object */
-
-    void parseHttp();                              /**< Parse headers filling \c _headers */
-    void recvBody();                            /**< Download the rest of answer */
+    ResponseParser _parser;                        /**< Incremental parser with data */
+    void receive();                                /**< Read the whole response from connection */
   public:
     HTTPResponse(std::unique_ptr<ConnectionManager>&&);
+
+    /**
+     * Create an empty response to be filled with \c receiveFrom()
+     */
+    explicit HTTPResponse(BodyConsumer&& consumer = BodyConsumer(), HTTPRequestType method = HTTPRequestType::GET);
+
+    /**
+     * Read the response passing the body to \c consumer instead of storing it
+     */
+    HTTPResponse(std::unique_ptr<ConnectionManager>&&, BodyConsumer&& consumer);
     ~HTTPResponse();
+
+    /**
+     * Read everything available from \c conn
+     *
+     * Stops when the socket has no more data (\c EAGAIN), so may be used
+     * with non-blocking connections.
+     *
+     * \retval true if the response is complete.
+     * \throws http_error if the response is malformed or server returned
+     *         an error code. The error is thrown when the response is
+     *         complete and carries its body.
+     */
+    bool receiveFrom(ConnectionManager& conn);
+
     /**
      * Get HTTP header
      *
-     * \retval header or empty string if no such header exists.
+     * \retval header value.
+     * \throws std::out_of_range if no such header exists.
      */
-    const std::string& operator[](const std::string& header) const;
-    int code() const {return _code;};
+    std::string operator[](const std::string& header) const;
+    int code() const {return _parser.code();};
 
     /**
      * Get data received from sever
@@ -185,6 +437,13 @@ namespace http {
      * \retval \c std::pair<buffer, size> with answer.
      */
     const std::pair<const void * const, size_t> data() const;
+
+    /**
+     * Get data received from server for processing in place
+     *
+     * E.g. for in-situ parsing which overwrites the buffer.
+     */
+    std::pair<char *, size_t> mutableData();
 #if defined(_UNIT_TEST_BUILD)
   private:
     FRIEND_TEST(HTTPResponse, Creation);
@@ -194,8 +453,14 @@ namespace http {
   /**
    * Run single HTTP (HTTPS) request
    *
+   * The request is run on the shared \c eventloop::EventLoop with
+   * non-blocking socket, so any number of requests may be in flight without
+   * a thread for every one. Only the name resolution is done in the
+   * calling thread.
+   *
    * \param url The full url (e.g. https://google.com:443/index.html)
-   * \param req The HTTPRequest to make
+   * \param req The HTTPRequest to make. Its body must stay alive until the
+   *            future is ready.
    *
    * \retval the HTTPResponse with answer.
    */
@@ -203,4 +468,88 @@ namespace http {
   PerformHTTPRequest(const std::string& url,
                      const HTTPRequest& req);
 
+  /**
+   * Run single HTTP (HTTPS) request streaming the response body
+   *
+   * \param url The full url (e.g. https://google.com:443/index.html)
+   * \param req The HTTPRequest to make
+   * \param consumer Function to receive the body pieces. It's called from
+   *                 the event loop thread before the future is ready, so
+   *                 it must not block.
+   *
+   * \retval the HTTPResponse with code and headers, its data() is empty.
+   */
+  std::future<std::unique_ptr<HTTPResponse> >
+  PerformHTTPRequest(const std::string& url,
+                     const HTTPRequest& req,
+                     BodyConsumer&& consumer);
+
+  /**
+   * Receiver of the request result
+   *
+   * Gets either the response or the error (e.g. \c http_error) and is
+   * called from the event loop thread, so it must not block.
+   */
+  typedef std::function<void(std::unique_ptr<HTTPResponse>&& response, std::exception_ptr error)> ResponseHandler;
+
+  /**
+   * Run single HTTP (HTTPS) request passing the result to \c handler
+   *
+   * \param url The full url (e.g. https://google.com:443/index.html)
+   * \param req The HTTPRequest to make. Its body must stay alive until
+   *            \c handler is called.
+   * \param handler Function to call when the request is complete
+   */
+  void PerformHTTPRequest(const std::string& url,
+                          const HTTPRequest& req,
+                          ResponseHandler&& handler);
+
+  /**
+   * Minimal HTTP server running on the shared event loop
+   *
+   * Every connection serves a single request and is closed after the
+   * answer. Intended to receive webhook calls, so the answer has no body.
+   * TLS is not supported: put the server behind a terminating proxy.
+   */
+  class HTTPServer {
+  public:
+    /**
+     * Request receiver, called on the event loop thread
+     *
+     * \retval HTTP code to answer with
+     */
+    typedef std::function<int(RequestParser& request)> RequestHandler;
+  private:
+    struct Client;
+
+    eventloop::EventLoop& _loop;                   /**< Loop serving the connections */
+    const RequestHandler _handler;                 /**< Receiver of complete requests */
+    int _fd;                                       /**< Listening socket */
+    int _port;                                     /**< Port the socket is bound to */
+    std::map<int, std::shared_ptr<Client> > _clients; /**< Connections by descriptor, used on loop thread only */
+
+    void accept();                                 /**< Take new connections */
+    void receive(int fd);                          /**< Read request data from \c fd */
+    void reply(int fd, int code);                  /**< Send answer and close connection */
+    void drop(int fd);                             /**< Close connection */
+    void stop();                                   /**< Close everything, runs on the loop */
+  public:
+    static constexpr size_t max_request = 1024 * 1024; /**< Maximum request size in bytes */
+    static constexpr int client_timeout = 30;      /**< Seconds to wait for a complete request */
+
+    /**
+     * Start listening
+     *
+     * \param port TCP port, 0 to select any free one
+     * \param handler Function to process the requests
+     * \param address Local address to bind to
+     * \throws http_error if the socket can't be opened
+     */
+    HTTPServer(int port, RequestHandler&& handler, const std::string& address = "0.0.0.0");
+    ~HTTPServer();
+    HTTPServer(const HTTPServer&) = delete;
+    HTTPServer& operator=(const HTTPServer&) = delete;
+
+    int port() const { return _port; };            /**< Port the server listens on */
+  };
 }
@@ -120,6 +120,9 @@ namespace Hub {
       throw std::runtime_error("Failed to activate hub " + _name);
     }
 
+    for (auto& out : _outputChannels)
+      out->flushSpill();
+
     for (auto& in : _inputChannels)
       activators.push_back(in->activate());
 
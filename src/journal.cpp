@@ -0,0 +1,233 @@
+#include "journal.hpp"
+#include "logging.hpp"
+
+#include <vector>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <cinttypes>
+#include <cctype>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace journal {
+  static inline void put(std::string& out, std::uint64_t value, size_t bytes) {
+    for (size_t i = 0; i < bytes; ++i)
+      out += static_cast<char>((value >> (8 * i)) & 0xff);
+  }
+
+  static inline std::uint64_t get(const char* in, size_t bytes) {
+    std::uint64_t value = 0;
+    for (size_t i = 0; i < bytes; ++i)
+      value |= static_cast<std::uint64_t>(static_cast<unsigned char>(in[i])) << (8 * i);
+    return value;
+  }
+
+  static std::string segmentName(const std::string& dir, std::int64_t timestamp, const char* suffix) {
+    char name[32];
+    /* Zero padded, so names sort as timestamps */
+    snprintf(name, sizeof(name), "%020" PRId64 "%s", timestamp, suffix);
+    return dir + "/" + name;
+  }
+
+  JournalWriter::JournalWriter(const std::string& dir, const WriterOptions& options) :
+    _dir(dir),
+    _options(options),
+    _started(0),
+    _last(0),
+    _size(0),
+    _indexed(0)
+  {
+    if (mkdir(_dir.c_str(), 0755) < 0 && errno != EEXIST)
+      throw journal_error("Can't create journal directory " + _dir + ": " + strerror(errno));
+  }
+
+  void JournalWriter::rotate(std::int64_t timestamp) {
+    /* Old writers commit and close their files here */
+    _index.reset();
+    _segment.reset();
+    _started = timestamp;
+    try {
+      _segment = std::make_unique<fileChannel::FileWriter>(segmentName(_dir, _started, ".seg"),
+                                                           _options.flush_messages, _options.flush_delay, _options.sync);
+      _index = std::make_unique<fileChannel::FileWriter>(segmentName(_dir, _started, ".idx"),
+                                                         _options.flush_messages, _options.flush_delay, _options.sync);
+    } catch (const std::runtime_error& e) {
+      throw journal_error(e.what());
+    }
+    _segment->write(std::string(segment_magic, header_size));
+    _size = header_size;
+    _indexed = 0;
+    DEBUG << "New journal segment " << _started;
+  }
+
+  void JournalWriter::append(std::uint16_t origin, std::uint8_t type, const std::string& user, const std::string& text) {
+    const auto now = std::chrono::duration_cast<std::chrono::milliseconds>
+                       (std::chrono::system_clock::now().time_since_epoch()).count();
+    append(now, origin, type, user, text);
+  }
+
+  void JournalWriter::append(std::int64_t timestamp, std::uint16_t origin, std::uint8_t type,
+                             const std::string& user, const std::string& text) {
+    const size_t user_size = std::min<size_t>(user.size(), UINT16_MAX);
+    std::string record;
+    record.reserve(4 + record_fixed + user_size + text.size());
+    put(record, record_fixed + user_size + text.size(), 4);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    /* Readers rely on the order to stop scanning */
+    timestamp = std::max(timestamp, _last);
+    _last = timestamp;
+    put(record, timestamp, 8);
+    put(record, origin, 2);
+    put(record, type, 1);
+    put(record, user_size, 2);
+    record.append(user, 0, user_size);
+    record += text;
+
+    const bool full = _size > header_size && _size + record.size() > _options.segment_size;
+    const bool old = timestamp - _started >= std::chrono::duration_cast<std::chrono::milliseconds>(_options.segment_age).count();
+    /* Segment is named by its first timestamp and readers skip segments by
+       the name of the next one, so a millisecond is never split */
+    if (!_segment || ((full || old) && timestamp > _started))
+      rotate(timestamp);
+    if (_indexed == 0 || _size - _indexed >= _options.index_bytes) {
+      std::string entry;
+      put(entry, timestamp, 8);
+      put(entry, _size, 8);
+      _index->write(entry);
+      _indexed = _size;
+    }
+    _segment->write(record);
+    _size += record.size();
+  }
+
+  /**
+   * Read-only file mapping
+   */
+  class MappedFile {
+    const char* _data;                                    /**< Mapped contents */
+    size_t _size;                                         /**< File size */
+  public:
+    /**
+     * \param required Throw if the file doesn't exist
+     */
+    MappedFile(const std::string& path, bool required) :
+      _data(nullptr),
+      _size(0)
+    {
+      const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0) {
+        if (required)
+          throw journal_error("Can't open " + path + ": " + strerror(errno));
+        return;
+      }
+      struct stat sb;
+      memset(&sb, 0, sizeof(sb));
+      if (fstat(fd, &sb) == 0 && sb.st_size > 0) {
+        void* data = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+          _data = static_cast<const char *>(data);
+          _size = sb.st_size;
+          /* Segments are read from the found position to the end */
+          madvise(data, _size, MADV_SEQUENTIAL);
+        }
+      }
+      close(fd);
+      if (!_data && required && sb.st_size > 0)
+        throw journal_error("Can't map " + path + ": " + strerror(errno));
+    }
+    ~MappedFile() {
+      if (_data)
+        munmap(const_cast<char *>(_data), _size);
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return _data; };
+    size_t size() const { return _size; };
+  };
+
+  JournalReader::JournalReader(const std::string& dir) :
+    _dir(dir)
+  {}
+
+  size_t JournalReader::read(std::int64_t from, std::int64_t to,
+                             const std::function<bool(const Record&)>& receiver) const {
+    std::vector<std::int64_t> segments;
+    DIR* dir = opendir(_dir.c_str());
+    if (!dir)
+      throw journal_error("Can't open journal directory " + _dir + ": " + strerror(errno));
+    while (const auto entry = readdir(dir)) {
+      const std::string name(entry->d_name);
+      if (name.size() > 4 && isdigit(name[0]) && name.compare(name.size() - 4, 4, ".seg") == 0)
+        segments.push_back(std::stoll(name));
+    }
+    closedir(dir);
+    std::sort(segments.begin(), segments.end());
+
+    size_t count = 0;
+    for (size_t i = 0; i < segments.size(); ++i) {
+      /* Segment ends where the next one starts */
+      if (segments[i] >= to)
+        break;
+      if (i + 1 < segments.size() && segments[i + 1] <= from)
+        continue;
+
+      const MappedFile segment(segmentName(_dir, segments[i], ".seg"), true);
+      if (segment.size() < header_size || memcmp(segment.data(), segment_magic, header_size) != 0)
+        throw journal_error("Wrong journal segment " + std::to_string(segments[i]));
+
+      /* Start from the last indexed record before the window */
+      size_t offset = header_size;
+      const MappedFile index(segmentName(_dir, segments[i], ".idx"), false);
+      const size_t entries = index.size() / index_entry;
+      size_t low = 0;
+      size_t high = entries;
+      while (low < high) {
+        const size_t middle = (low + high) / 2;
+        /* Records before an entry stamped exactly "from" may have the same time */
+        if (static_cast<std::int64_t>(get(index.data() + middle * index_entry, 8)) < from)
+          low = middle + 1;
+        else
+          high = middle;
+      }
+      if (low > 0) {
+        const auto found = get(index.data() + (low - 1) * index_entry + 8, 8);
+        if (found >= header_size && found < segment.size())
+          offset = found;
+      }
+
+      const char* data = segment.data();
+      while (offset + 4 + record_fixed <= segment.size()) {
+        const size_t size = get(data + offset, 4);
+        if (size < record_fixed || offset + 4 + size > segment.size())
+          break;
+        const char* record = data + offset + 4;
+        offset += 4 + size;
+        const std::int64_t timestamp = get(record, 8);
+        if (timestamp < from)
+          continue;
+        if (timestamp >= to)
+          return count;
+        const size_t user_size = get(record + 11, 2);
+        if (record_fixed + user_size > size)
+          throw journal_error("Broken record in journal segment " + std::to_string(segments[i]));
+        const Record result {timestamp,
+                             static_cast<std::uint16_t>(get(record + 8, 2)),
+                             static_cast<std::uint8_t>(get(record + 10, 1)),
+                             record + record_fixed,
+                             user_size,
+                             record + record_fixed + user_size,
+                             size - record_fixed - user_size};
+        ++count;
+        if (!receiver(result))
+          return count;
+      }
+    }
+    return count;
+  }
+}
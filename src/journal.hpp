@@ -0,0 +1,129 @@
+#pragma once
+#include "filewriter.hpp"
+#include <string>
+#include <memory>
+#include <functional>
+#include <chrono>
+#include <mutex>
+#include <stdexcept>
+#include <cstdint>
+
+/**
+ * Append-only message journal
+ *
+ * The journal is a directory of segments named by the timestamp of their
+ * first record: "<ms since epoch>.seg". Every segment starts with
+ * \c segment_magic followed by records:
+ *
+ *   u32 size       bytes of the record after this field
+ *   i64 timestamp  milliseconds since epoch
+ *   u16 origin     channel id
+ *   u8  type       messaging::MessageType
+ *   u16 user_size  length of user name
+ *   user name, then text up to the end of the record
+ *
+ * All the numbers are little endian. Timestamps never decrease within the
+ * journal. Each segment has a sparse index "<ms since epoch>.idx" of
+ * (i64 timestamp, u64 offset) pairs pointing to some of its records, so
+ * a time window is found without scanning the whole segment.
+ */
+namespace journal {
+  /**
+   * Journal error
+   */
+  class journal_error: public std::runtime_error {
+  public:
+    journal_error(std::string const& message) :
+      std::runtime_error(message)
+    {};
+  };
+
+  constexpr char segment_magic[] = "CSJRNL01";            /**< Segment header */
+  constexpr size_t header_size = sizeof(segment_magic) - 1; /**< Segment header size */
+  constexpr size_t record_fixed = 13;                     /**< Record size after size field without strings */
+  constexpr size_t index_entry = 16;                      /**< Size of index entry */
+
+  /**
+   * Record read from the journal
+   *
+   * Strings point right into the mapped segment and are only valid inside
+   * the reader callback.
+   */
+  struct Record {
+    std::int64_t timestamp;                               /**< Milliseconds since epoch */
+    std::uint16_t origin;                                 /**< Channel id */
+    std::uint8_t type;                                    /**< messaging::MessageType */
+    const char* user;                                     /**< User name */
+    size_t user_size;                                     /**< Length of \c user */
+    const char* text;                                     /**< Message text */
+    size_t text_size;                                     /**< Length of \c text */
+  };
+
+  /**
+   * Journal writer settings
+   */
+  struct WriterOptions {
+    size_t segment_size = 64 << 20;                       /**< Start new segment after this size, one millisecond is never split */
+    std::chrono::seconds segment_age = std::chrono::hours(24); /**< Start new segment after this time */
+    size_t index_bytes = 64 << 10;                        /**< Index a record every this many bytes */
+    size_t flush_messages = 64;                           /**< Group commit size, see FileWriter */
+    std::chrono::milliseconds flush_delay = std::chrono::milliseconds(200); /**< Group commit delay */
+    fileChannel::SyncPolicy sync = fileChannel::SyncPolicy::None; /**< Durability policy */
+  };
+
+  /**
+   * Writes records into rotated segments with group commit
+   */
+  class JournalWriter {
+    const std::string _dir;                               /**< Journal directory */
+    const WriterOptions _options;                         /**< Settings */
+
+    std::mutex _mutex;                                    /**< Lock for everything below */
+    std::unique_ptr<fileChannel::FileWriter> _segment;    /**< Current segment */
+    std::unique_ptr<fileChannel::FileWriter> _index;      /**< Index of the current segment */
+    std::int64_t _started;                                /**< Timestamp of the current segment */
+    std::int64_t _last;                                   /**< Timestamp of the last record */
+    std::uint64_t _size;                                  /**< Size of the current segment */
+    std::uint64_t _indexed;                               /**< Offset of the last indexed record */
+
+    void rotate(std::int64_t timestamp);                  /**< Start new segment */
+  public:
+    /**
+     * \throws journal_error if the directory can't be created
+     */
+    JournalWriter(const std::string& dir, const WriterOptions& options);
+
+    /**
+     * Append a record timestamped with the current time
+     */
+    void append(std::uint16_t origin, std::uint8_t type, const std::string& user, const std::string& text);
+
+    /**
+     * Append a record with \c timestamp, it's moved forward to keep the
+     * journal ordered if needed
+     */
+    void append(std::int64_t timestamp, std::uint16_t origin, std::uint8_t type,
+                const std::string& user, const std::string& text);
+  };
+
+  /**
+   * Reads records from the journal mapping segments into memory
+   */
+  class JournalReader {
+    const std::string _dir;                               /**< Journal directory */
+  public:
+    explicit JournalReader(const std::string& dir);
+
+    /**
+     * Pass records with \c from <= timestamp < \c to to \c receiver in
+     * order of writing
+     *
+     * A record cut by a crash at the end of a segment is skipped. Reading
+     * stops early when \c receiver returns false.
+     *
+     * \retval number of records passed
+     * \throws journal_error if a segment can't be read
+     */
+    size_t read(std::int64_t from, std::int64_t to, const std::function<bool(const Record&)>& receiver) const;
+  };
+}
@@ -0,0 +1,39 @@
+#include <iostream>
+#include <cstring>
+#include "logging.hpp"
+#include "fsutil.hpp"
+
+/**
+ * Print binary logs written by logging::LogSinkBinary as text
+ */
+int main(int argc, char* argv[])
+{
+  bool sites = false;
+  int first = 1;
+  if (argc > 1 && !strcmp(argv[1], "-s")) {
+    sites = true;
+    ++first;
+  }
+  if (first >= argc) {
+    std::cerr << "Please use " << argv[0] << " [-s] log..." << std::endl
+              << "  -s  prefix messages with source file and line" << std::endl;
+    return 1;
+  }
+
+  int result = 0;
+  for (int i = first; i < argc; ++i) {
+    std::string data;
+    try {
+      if (!fsutil::readFile(argv[i], data)) {
+        std::cerr << argv[i] << ": no such file" << std::endl;
+        result = 1;
+        continue;
+      }
+      logging::decodeBinaryLog(data, std::cout, sites);
+    } catch (const std::runtime_error& e) {
+      std::cerr << argv[i] << ": " << e.what() << std::endl;
+      result = 1;
+    }
+  }
+  return result;
+}
@@ -1,64 +1,235 @@
 #include "logging.hpp"
 
-#include <queue>
+#include <algorithm>
 #include <mutex>
 #include <condition_variable>
 #include <iostream>
 #include <future>
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace logging {
+  std::atomic<Severity> LoggerImpl::_severity(Severity::trace);
+  std::atomic_bool LoggerImpl::_binary(false);
 
-  void LoggerImpl::log(const LogMessage&& msg) {
-    if (msg._severity > _severity)
-      return;
-    // Prepare the message
-    const static unsigned int timeout = 25;
-    const static unsigned int max_repeats = 5;
-    {
-      std::unique_lock<std::mutex> mlock(_mutex, std::defer_lock);
-      if (mlock.try_lock()) {
-        _messages.push(std::move(msg));
-        _log_repeat = 1;
+  constexpr size_t max_free_rings = 64;                   /**< Drained rings kept for new threads */
+
+  /**
+   * All the call sites by id
+   */
+  static std::vector<const LogSite *>& siteRegistry(std::unique_lock<std::mutex>& lock) {
+    static std::mutex mutex;
+    static std::vector<const LogSite *> sites {nullptr};
+    lock = std::unique_lock<std::mutex>(mutex);
+    return sites;
+  }
+
+  static uint32_t registerSite(const LogSite* site) {
+    std::unique_lock<std::mutex> lock;
+    auto& sites = siteRegistry(lock);
+    sites.push_back(site);
+    return sites.size() - 1;
+  }
+
+  LogSite::LogSite(const char* file, unsigned int line, Severity severity) :
+    file(file),
+    line(line),
+    severity(severity),
+    id(registerSite(this))
+  {}
+
+  const LogSite* LogSite::find(uint32_t id) {
+    std::unique_lock<std::mutex> lock;
+    const auto& sites = siteRegistry(lock);
+    return id < sites.size() ? sites[id] : nullptr;
+  }
+
+  static size_t ringCapacity(size_t size) {
+    size_t capacity = 2;
+    while (capacity < size)
+      capacity <<= 1;
+    return capacity;
+  }
+
+  LogRing::LogRing(size_t size) :
+    _entries(ringCapacity(size)),
+    _mask(ringCapacity(size) - 1),
+    _head(0),
+    _tail(0),
+    _closed(false)
+  {}
+
+  bool LogRing::push(Entry& entry) {
+    const size_t tail = _tail.load(std::memory_order_relaxed);
+    if (tail - _head.load(std::memory_order_acquire) > _mask)
+      return false;
+    _entries[tail & _mask] = std::move(entry);
+    _tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool LogRing::pop(Entry& entry) {
+    const size_t head = _head.load(std::memory_order_relaxed);
+    if (head == _tail.load(std::memory_order_acquire))
+      return false;
+    entry = std::move(_entries[head & _mask]);
+    _head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  LogRing& LoggerImpl::ring() {
+    /* The ring outlives its thread until the writer empties it */
+    struct Holder {
+      std::shared_ptr<LogRing> ring;
+      ~Holder() { if (ring) ring->close(); }
+    };
+    thread_local Holder holder;
+    if (!holder.ring) {
+      const size_t capacity = ringCapacity(_ring_size);
+      std::lock_guard<std::mutex> lock(_rings_mutex);
+      /* Channels start a thread per message, so take a ring of a finished one */
+      while (!_free.empty() && _free.back()->capacity() != capacity)
+        _free.pop_back();
+      if (_free.empty()) {
+        holder.ring = std::make_shared<LogRing>(capacity);
+        ++_allocated;
       } else {
-        if (_log_repeat > max_repeats)
-          throw std::runtime_error("Maximum number of log attempts reached");
-        std::thread(
-          [this, msg {std::move(msg)}]() {
-          const auto& rep = this->_log_repeat;
-          std::this_thread::sleep_for(std::chrono::milliseconds(timeout * rep * rep));
-          this->log(std::move(msg));
-        }).detach();
-        ++_log_repeat;
+        holder.ring = std::move(_free.back());
+        _free.pop_back();
+        holder.ring->reopen();
       }
+      _rings.push_back(holder.ring);
     }
-    // Notifying doesn't require mutex lock
-    _cond.notify_one();
+    return *holder.ring;
   }
 
-  Severity LoggerImpl::setSeverity(Severity s) {
-    const Severity old = _severity;
-    _severity = s;
-    return old;
+  void LoggerImpl::wake() {
+    /* Pairs with the fence in writeOut(): either we see the writer waiting
+       or it sees our message. Only a waiting writer costs the exchange. */
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_waiting.load(std::memory_order_relaxed) && _waiting.exchange(false)) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _cond.notify_one();
+    }
   }
 
-  void LoggerImpl::writeOut() {
-    while (_running && !_sink.expired()) {
-      if (const auto& out = _sink.lock()) {
-        std::unique_lock<std::mutex> mlock(_mutex);
+  void LoggerImpl::log(const std::chrono::high_resolution_clock::time_point timestamp, Severity s, std::string&& message,
+                       bool binary) {
+    if (s > _severity)
+      return;
+    LogRing::Entry entry {timestamp, s, std::move(message), binary};
+    auto& own = ring();
+    while (!own.push(entry)) {
+      if (_overflow == Overflow::Drop || !_draining) {
+        ++_dropped;
+        return;
+      }
+      wake();
+      /* Sleep until the writer takes the messages, the timeout covers a missed signal */
+      std::unique_lock<std::mutex> lock(_space_mutex);
+      ++_blocked;
+      _space.wait_for(lock, std::chrono::milliseconds(10), [&own]() { return !own.full(); });
+      --_blocked;
+    }
+    wake();
+  }
 
-        while (_messages.empty() && _running)
-          _cond.wait(mlock);
+  Severity LoggerImpl::setSeverity(Severity s) {
+    return _severity.exchange(s);
+  }
 
-        if (!_running)
-          continue;
+  void LoggerImpl::collect(std::vector<LogRing::Entry>& batch) {
+    LogRing::Entry entry;
+    std::lock_guard<std::mutex> lock(_rings_mutex);
+    for (auto it = _rings.begin(); it != _rings.end(); ) {
+      /* Checked before reading, so the last messages of a thread aren't lost */
+      const bool closed = (*it)->closed();
+      while ((*it)->pop(entry))
+        batch.push_back(std::move(entry));
+      if (closed) {
+        /* Nobody writes a closed ring, it's empty now */
+        if (_free.size() < max_free_rings)
+          _free.push_back(std::move(*it));
+        it = _rings.erase(it);
+      }
+      else
+        ++it;
+    }
+    std::stable_sort(batch.begin(), batch.end(), [](const LogRing::Entry& a, const LogRing::Entry& b) {
+        return a.timestamp < b.timestamp;
+      });
+  }
+
+  void LoggerImpl::writeOut() {
+    std::vector<LogRing::Entry> batch;
+    size_t reported = 0;
+    while (true) {
+      std::shared_ptr<LogSink> out;
+      {
+        std::lock_guard<std::mutex> lock(_sink_mutex);
+        out = _sink.lock();
+      }
+      _draining = out != nullptr;
+      if (out) {
+        collect(batch);
+        if (_blocked) {
+          std::lock_guard<std::mutex> lock(_space_mutex);
+          _space.notify_all();
+        }
+        const bool binary = out->binary();
+        for (auto& entry : batch) {
+          if (entry.binary && !binary) {
+            /* Recorded before the sink was switched */
+            std::string text;
+            try {
+              text = binary::render(entry.message.data() + sizeof(uint32_t), entry.message.size() - sizeof(uint32_t));
+            } catch (const std::runtime_error& e) {
+              text = e.what();
+            }
+            if (entry.severity == Severity::trace) {
+              uint32_t id;
+              memcpy(&id, entry.message.data(), sizeof(id));
+              if (const LogSite* site = LogSite::find(id))
+                text = site->file + (":" + std::to_string(site->line) + " ") + text;
+            }
+            out->write(LogMessage(entry.timestamp, entry.severity, std::move(text)));
+          } else {
+            out->write(LogMessage(entry.timestamp, entry.severity, std::move(entry.message), entry.binary));
+          }
+        }
+        const size_t dropped = _dropped;
+        if (dropped != reported) {
+          out->write(LogMessage(std::chrono::high_resolution_clock::now(), Severity::warning,
+                                std::to_string(dropped - reported) + " log messages dropped"));
+          reported = dropped;
+        }
+        out->flush();
+      }
+      if (!_running)
+        break;
+      if (!batch.empty()) {
+        batch.clear();
+        continue;
+      }
 
-        auto item = std::move(_messages.front());
-        _messages.pop();
-        if (mlock.owns_lock())
-          mlock.unlock();
-        out->write(std::move(item));
+      std::unique_lock<std::mutex> lock(_mutex);
+      _waiting = true;
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      bool pending = false;
+      if (out) {
+        std::lock_guard<std::mutex> rings(_rings_mutex);
+        for (const auto& ring : _rings)
+          pending |= !ring->empty();
       }
+      /* Without sink there's nothing to do until setOutput() */
+      if (!pending && _running)
+        _cond.wait_for(lock, std::chrono::milliseconds(500));
+      _waiting = false;
     }
+    _draining = false;
   }
 
   LoggerImpl& LoggerImpl::get() {
@@ -69,14 +240,33 @@ namespace logging {
     return instance;
   }
 
+  LoggerImpl::~LoggerImpl() {
+    if (_writer) {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _running = false;
+        _cond.notify_one();
+      }
+      _writer->join();
+    }
+  }
+
   void LoggerImpl::setOutput(const std::shared_ptr<LogSink>& output) {
-    _sink = output;
-    if (!_writer)
+    {
+      std::lock_guard<std::mutex> lock(_sink_mutex);
+      _sink = output;
+    }
+    _binary = output && output->binary();
+    if (!_writer) {
       _writer = std::make_unique<std::thread>
                   (std::thread(&LoggerImpl::writeOut, this));
+    } else {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _cond.notify_one();
+    }
   }
 
-  std::string LogSinkPrinter::formatMessage(const LogMessage&& msg) const {
+  std::string LogSinkPrinter::formatMessage(const LogMessage& msg) {
     std::stringstream result;
     const auto& ms = std::chrono::duration_cast<std::chrono::milliseconds>
                        (msg._timestamp.time_since_epoch());
@@ -93,6 +283,194 @@ namespace logging {
   }
 
   void LogSinkPrinter::write(const LogMessage&& msg) {
-    std::cerr << formatMessage(std::move(msg)) << std::endl;
+    std::cerr << formatMessage(msg) << std::endl;
+  }
+
+  namespace binary {
+    /**
+     * Data ends in the middle of a record
+     */
+    struct cut_error: public std::runtime_error {
+      cut_error() : std::runtime_error("Binary log record is cut") {};
+    };
+
+    /**
+     * Bounds checked reader of a record
+     */
+    class Reader {
+      const char* _data;
+      const char* const _end;
+    public:
+      Reader(const char* data, size_t size) : _data(data), _end(data + size) {};
+
+      bool empty() const { return _data == _end; };
+
+      template <typename T>
+      T get() {
+        T value;
+        if (static_cast<size_t>(_end - _data) < sizeof(T))
+          throw cut_error();
+        memcpy(&value, _data, sizeof(T));
+        _data += sizeof(T);
+        return value;
+      }
+
+      std::string getString(size_t size) {
+        if (static_cast<size_t>(_end - _data) < size)
+          throw cut_error();
+        std::string value(_data, size);
+        _data += size;
+        return value;
+      }
+    };
+
+    std::string render(const char* data, size_t size) {
+      /* Same formatting as the text mode stream */
+      std::ostringstream text;
+      Reader reader(data, size);
+      while (!reader.empty()) {
+        const auto tag = reader.get<uint8_t>();
+        switch (tag) {
+        case Int:
+          text << reader.get<int64_t>();
+          break;
+        case UInt:
+          text << reader.get<uint64_t>();
+          break;
+        case Double:
+          text << reader.get<double>();
+          break;
+        case Char:
+          text << reader.get<char>();
+          break;
+        case Bool:
+          text << static_cast<bool>(reader.get<uint8_t>());
+          break;
+        case String:
+          text << reader.getString(reader.get<uint32_t>());
+          break;
+        default:
+          throw std::runtime_error("Unknown binary log argument type " + std::to_string(tag));
+        }
+      }
+      return text.str();
+    }
+  }
+
+  LogSinkBinary::LogSinkBinary(const std::string& path) :
+    _fd(open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)),
+    _buffer(binary_log_magic, sizeof(binary_log_magic) - 1)
+  {
+    if (_fd < 0)
+      throw std::runtime_error("Can't open binary log " + path + ": " + strerror(errno));
+  }
+
+  LogSinkBinary::~LogSinkBinary() {
+    flush();
+    close(_fd);
+  }
+
+  void LogSinkBinary::write(const LogMessage&& msg) {
+    uint32_t id = 0;
+    const char* args = msg._message.data();
+    size_t size = msg._message.size();
+    std::string text;
+    if (msg._binary && size >= sizeof(id)) {
+      memcpy(&id, args, sizeof(id));
+      args += sizeof(id);
+      size -= sizeof(id);
+    } else {
+      /* Text messages go as a single string argument of site 0 */
+      binary::putString(text, args, size);
+      args = text.data();
+      size = text.size();
+    }
+
+    if (id >= _described.size())
+      _described.resize(id + 1);
+    if (id && !_described[id]) {
+      const LogSite* site = LogSite::find(id);
+      const uint16_t length = site ? std::min<size_t>(strlen(site->file), UINT16_MAX) : 0;
+      const uint32_t line = site ? site->line : 0;
+      _buffer += 'S';
+      _buffer.append(reinterpret_cast<const char *>(&id), sizeof(id));
+      _buffer.append(reinterpret_cast<const char *>(&line), sizeof(line));
+      _buffer.append(reinterpret_cast<const char *>(&length), sizeof(length));
+      if (site)
+        _buffer.append(site->file, length);
+      _described[id] = true;
+    }
+
+    const int64_t timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(msg._timestamp.time_since_epoch()).count();
+    const uint8_t severity = msg._severity;
+    const uint32_t length = size;
+    _buffer += 'M';
+    _buffer.append(reinterpret_cast<const char *>(&id), sizeof(id));
+    _buffer.append(reinterpret_cast<const char *>(&timestamp), sizeof(timestamp));
+    _buffer.append(reinterpret_cast<const char *>(&severity), sizeof(severity));
+    _buffer.append(reinterpret_cast<const char *>(&length), sizeof(length));
+    _buffer.append(args, size);
+    if (_buffer.size() >= 64 << 10)
+      flush();
+  }
+
+  void LogSinkBinary::flush() {
+    size_t written = 0;
+    while (written < _buffer.size()) {
+      const ssize_t result = ::write(_fd, _buffer.data() + written, _buffer.size() - written);
+      if (result < 0 && errno == EINTR)
+        continue;
+      if (result < 0) {
+        std::cerr << "Can't write binary log: " << strerror(errno) << std::endl;
+        break;
+      }
+      written += result;
+    }
+    _buffer.clear();
+  }
+
+  size_t decodeBinaryLog(const std::string& data, std::ostream& out, bool sites) {
+    const size_t magic_size = sizeof(binary_log_magic) - 1;
+    std::vector<std::string> names;
+    size_t count = 0;
+    binary::Reader reader(data.data(), data.size());
+    try {
+      while (!reader.empty()) {
+        const auto type = reader.get<char>();
+        if (type == binary_log_magic[0]) {
+          /* New writer, ids start over */
+          if (reader.getString(magic_size - 1) != binary_log_magic + 1)
+            throw std::runtime_error("Wrong binary log header");
+          names.clear();
+        } else if (type == 'S') {
+          const auto id = reader.get<uint32_t>();
+          const auto line = reader.get<uint32_t>();
+          const auto file = reader.getString(reader.get<uint16_t>());
+          if (id >= names.size())
+            names.resize(id + 1);
+          names[id] = file + ":" + std::to_string(line) + " ";
+        } else if (type == 'M') {
+          const auto id = reader.get<uint32_t>();
+          const auto timestamp = reader.get<int64_t>();
+          const auto severity = reader.get<uint8_t>();
+          const auto args = reader.getString(reader.get<uint32_t>());
+          if (severity > Severity::trace)
+            throw std::runtime_error("Wrong severity in binary log");
+          std::string text = binary::render(args.data(), args.size());
+          /* Trace messages carry the site in text mode too */
+          if ((sites || severity == Severity::trace) && id && id < names.size())
+            text = names[id] + text;
+          const std::chrono::high_resolution_clock::time_point time(std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>
+                                                                       (std::chrono::nanoseconds(timestamp)));
+          out << LogSinkPrinter::formatMessage(LogMessage(time, static_cast<Severity>(severity), std::move(text))) << "\n";
+          ++count;
+        } else {
+          throw std::runtime_error("Unknown binary log record " + std::to_string(type));
+        }
+      }
+    } catch (const binary::cut_error&) {
+      /* The last record may be cut by a crash */
+    }
+    return count;
   }
 }
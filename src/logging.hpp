@@ -1,6 +1,8 @@
 #pragma once
 #include <iostream>
-#include <queue>
+#include <vector>
+#include <memory>
+#include <string>
 #include <mutex>
 #include <condition_variable>
 #include <chrono>
@@ -8,14 +10,26 @@
 #include <atomic>
 #include <sstream>
 #include <iomanip>
+#include <cstdint>
+#include <type_traits>
 
-#define LOG(lvl)    logging::LogWriter<lvl>
-#define TRACE   LOG(logging::Severity::trace)() << __FILE__ << ":" << __LINE__ << " "
-#define DEBUG   LOG(logging::Severity::debug)()
-#define INFO    LOG(logging::Severity::info)()
-#define WARNING LOG(logging::Severity::warning)()
-#define ERROR   LOG(logging::Severity::error)()
-#define FATAL   LOG(logging::Severity::fatal)()
+/* Call site description registered once, its id is the format id of binary records */
+#define LOG_SITE(lvl) ([]() -> const logging::LogSite& { \
+      static const logging::LogSite site(__FILE__, __LINE__, lvl); \
+      return site; }())
+/* Disabled levels don't build the message nor evaluate the arguments */
+#define LOG(lvl)    !logging::LoggerImpl::enabled<lvl>() ? (void) 0 : logging::LogVoidify() & logging::LogWriter<lvl>(LOG_SITE(lvl))
+#define TRACE   LOG(logging::Severity::trace)
+#define DEBUG   LOG(logging::Severity::debug)
+#define INFO    LOG(logging::Severity::info)
+#define WARNING LOG(logging::Severity::warning)
+#define ERROR   LOG(logging::Severity::error)
+#define FATAL   LOG(logging::Severity::fatal)
+
+/* Least severe level compiled in, lower ones are removed by optimizer */
+#ifndef LOG_MIN_SEVERITY
+#define LOG_MIN_SEVERITY trace
+#endif
 
 #define DEFAULT_LOGGING \
   auto default_sink = std::make_shared<logging::LogSinkPrinter>(); \
@@ -37,6 +51,130 @@ namespace logging {
   const std::string severity_lines[] = {"FATAL", "ERROR", "WARNING",
                                         "INFO", "DEBUG", "TRACE"};
 
+  constexpr Severity compiled_severity = Severity::LOG_MIN_SEVERITY; /**< Set with LOG_MIN_SEVERITY at build time */
+
+  /**
+   * Call site of a logging macro
+   *
+   * Created once per site by LOG_SITE(). Binary records refer to the site
+   * by id, so file and line are written to the log only once.
+   */
+  struct LogSite {
+    const char* const file;                /**< Source file */
+    const unsigned int line;               /**< Source line */
+    const Severity severity;               /**< Macro severity */
+    const uint32_t id;                     /**< Unique in process, 0 is reserved for text messages */
+
+    LogSite(const char* file, unsigned int line, Severity severity);
+
+    /**
+     * Find registered site
+     *
+     * \retval nullptr if there is no such site
+     */
+    static const LogSite* find(uint32_t id);
+  };
+
+  /**
+   * Raw argument encoding for binary records
+   *
+   * A binary record is the u32 site id followed by arguments, each is a
+   * type tag and the value in native byte order. Strings are u32 length
+   * and bytes. Formatting is done only when the record is rendered.
+   */
+  namespace binary {
+    enum Tag : uint8_t {
+      Int = 'i',                           /**< int64_t */
+      UInt = 'u',                          /**< uint64_t */
+      Double = 'd',                        /**< double */
+      Char = 'c',                          /**< char */
+      Bool = 'b',                          /**< uint8_t */
+      String = 's'                         /**< u32 length and bytes */
+    };
+
+    template <typename T>
+    inline void put(std::string& out, Tag tag, T value) {
+      out += static_cast<char>(tag);
+      out.append(reinterpret_cast<const char *>(&value), sizeof(T));
+    }
+
+    inline void putString(std::string& out, const char* data, size_t size) {
+      const uint32_t length = size;
+      put(out, String, length);
+      out.append(data, size);
+    }
+
+    /**
+     * Types without raw encoding are formatted right away
+     */
+    template <typename T, typename Enable = void>
+    struct Encoder {
+      static void encode(std::string& out, const T& value) {
+        std::ostringstream text;
+        text << value;
+        const std::string& result = text.str();
+        putString(out, result.data(), result.size());
+      }
+    };
+
+    template <typename T>
+    struct Encoder<T, typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value>::type> {
+      static void encode(std::string& out, T value) { put(out, Int, static_cast<int64_t>(value)); }
+    };
+
+    template <typename T>
+    struct Encoder<T, typename std::enable_if<std::is_integral<T>::value && std::is_unsigned<T>::value>::type> {
+      static void encode(std::string& out, T value) { put(out, UInt, static_cast<uint64_t>(value)); }
+    };
+
+    template <typename T>
+    struct Encoder<T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+      static void encode(std::string& out, T value) { put(out, Double, static_cast<double>(value)); }
+    };
+
+    template <> struct Encoder<bool> {
+      static void encode(std::string& out, bool value) { put(out, Bool, static_cast<uint8_t>(value)); }
+    };
+
+    /* Characters are printed as characters by streams */
+    template <> struct Encoder<char> {
+      static void encode(std::string& out, char value) { put(out, Char, value); }
+    };
+    template <> struct Encoder<signed char> {
+      static void encode(std::string& out, signed char value) { put(out, Char, static_cast<char>(value)); }
+    };
+    template <> struct Encoder<unsigned char> {
+      static void encode(std::string& out, unsigned char value) { put(out, Char, static_cast<char>(value)); }
+    };
+
+    template <> struct Encoder<std::string> {
+      static void encode(std::string& out, const std::string& value) { putString(out, value.data(), value.size()); }
+    };
+    template <> struct Encoder<const char *> {
+      static void encode(std::string& out, const char* value) {
+        if (value)
+          putString(out, value, std::char_traits<char>::length(value));
+        else
+          putString(out, "(null)", 6);
+      }
+    };
+    template <> struct Encoder<char *>: Encoder<const char *> {};
+    template <size_t N> struct Encoder<char[N]> {
+      static void encode(std::string& out, const char* value) {
+        const char* end = std::char_traits<char>::find(value, N, '\0');
+        putString(out, value, end ? end - value : N);
+      }
+    };
+
+    /**
+     * Render arguments of a binary record as text message
+     *
+     * \param data Arguments after the site id
+     * \throws std::runtime_error if the arguments are broken
+     */
+    std::string render(const char* data, size_t size);
+  }
+
   /**
    * Single log message
    */
@@ -44,75 +182,246 @@ namespace logging {
     const std::chrono::high_resolution_clock::time_point _timestamp;
     const Severity _severity;
     const std::string _message;
+    const bool _binary;                    /**< \c _message is a binary record, see binary::render() */
     LogMessage(const std::chrono::high_resolution_clock::time_point t,
                const Severity					    s,
                const std::string				  & m) :
       _timestamp(t),
       _severity(s),
-      _message(m) {};
+      _message(m),
+      _binary(false) {};
+    LogMessage(const std::chrono::high_resolution_clock::time_point t,
+               const Severity s,
+               std::string&& m,
+               bool binary = false) :
+      _timestamp(t),
+      _severity(s),
+      _message(std::move(m)),
+      _binary(binary) {};
   };
 
   /**
    * Default sink class. Every sink should be derived from it.
    */
   struct LogSink {
+    virtual ~LogSink() {};
+
     /**
      * Make the actual output to the sink
+     *
+     * Binary messages are passed to binary sinks only.
      */
     virtual void write(const LogMessage&& msg) = 0;
+
+    /**
+     * Called after a batch of messages is written
+     */
+    virtual void flush() {};
+
+    /**
+     * Sink accepts binary records, so producers don't format messages
+     */
+    virtual bool binary() const { return false; };
   };
 
   /**
    * Sink that prints the log to std::cerr
    */
   class LogSinkPrinter: public LogSink {
+  public:
     /**
      * Formats message as [TIME] [SEVERITY] Message
      */
-    std::string formatMessage(const LogMessage&& msg) const;
+    static std::string formatMessage(const LogMessage& msg);
+
+    void write(const LogMessage&& msg) override;
+  };
+
+  /**
+   * Sink that writes binary records to a file
+   *
+   * The file is a sequence of:
+   *   - header "CSBLOG01", written on every open, site ids are valid up
+   *     to the next header
+   *   - 'S' site: u32 id, u32 line, u16 file name length, file name;
+   *     written before the first message of the site
+   *   - 'M' message: u32 site id, i64 nanoseconds since epoch,
+   *     u8 severity, u32 size, arguments, see logging::binary
+   *
+   * Numbers are in native byte order. Use decodeBinaryLog() or the
+   * chatsync-logdecode tool to read it.
+   */
+  class LogSinkBinary: public LogSink {
+    int _fd;                               /**< Log file */
+    std::string _buffer;                   /**< Data waiting for flush() */
+    std::vector<bool> _described;          /**< Sites already written to this file */
   public:
+    /**
+     * Open \c path for appending
+     *
+     * \throws std::runtime_error if the file can't be opened
+     */
+    explicit LogSinkBinary(const std::string& path);
+    ~LogSinkBinary();
+
     void write(const LogMessage&& msg) override;
+    void flush() override;
+    bool binary() const override { return true; };
+  };
+
+  constexpr char binary_log_magic[] = "CSBLOG01";  /**< Binary log header */
+
+  /**
+   * Render binary log \c data written by LogSinkBinary as text lines
+   *
+   * A record cut at the end is ignored.
+   *
+   * \param sites Prefix messages with file:line of their site, trace
+   *              messages always have it as in text logs
+   * \retval number of messages
+   * \throws std::runtime_error if the data is broken
+   */
+  size_t decodeBinaryLog(const std::string& data, std::ostream& out, bool sites);
+
+  /**
+   * What to do with a message when the thread's ring is full
+   */
+  enum class Overflow {
+    Drop,                                  /**< Throw the message away and count it */
+    Block                                  /**< Wait for the writer to free space */
+  };
+
+  /**
+   * Single producer single consumer ring of log messages
+   *
+   * Every logging thread owns one ring and is the only producer, the
+   * writer thread is the only consumer. Neither side locks.
+   */
+  class LogRing {
+  public:
+    /**
+     * Message waiting in the ring
+     */
+    struct Entry {
+      std::chrono::high_resolution_clock::time_point timestamp;
+      Severity severity;
+      std::string message;
+      bool binary;                         /**< \c message is a binary record */
+    };
+  private:
+    std::vector<Entry> _entries;           /**< Slots, size is a power of two */
+    const size_t _mask;                    /**< Slot index mask */
+    std::atomic<size_t> _head;             /**< Next slot to read, written by consumer */
+    char _pad[64];                         /**< Keeps producer and consumer counters in different cache lines */
+    std::atomic<size_t> _tail;             /**< Next slot to write, written by producer */
+    std::atomic_bool _closed;              /**< Producer thread is finished */
+  public:
+    /**
+     * \param size Number of slots, rounded up to a power of two
+     */
+    explicit LogRing(size_t size);
+
+    /**
+     * Producer side, moves \c entry in if there is space
+     *
+     * \retval false if the ring is full, \c entry is untouched then
+     */
+    bool push(Entry& entry);
+
+    /**
+     * Consumer side
+     *
+     * \retval false if the ring is empty
+     */
+    bool pop(Entry& entry);
+
+    bool empty() const { return _head.load(std::memory_order_acquire) == _tail.load(std::memory_order_acquire); };
+    bool full() const { return _tail.load(std::memory_order_acquire) - _head.load(std::memory_order_acquire) > _mask; };
+    void close() { _closed = true; };
+    bool closed() const { return _closed; };
+    void reopen() { _closed = false; };    /**< Hand the drained ring to a new thread */
+    size_t capacity() const { return _mask + 1; };
   };
 
   /**
    * Implementation of the logger singleton.
    *
-   * The logger will gather the messages inside LoggerImpl::_messages until
-   * the LoggerImpl::setOutput() is called and the sink is set. After start
-   * the logs will be redirected to sink while it's functional.
+   * Each thread puts its messages into its own LogRing, created on the
+   * first message, so logging never locks or starts threads. The writer
+   * thread started by LoggerImpl::setOutput() collects messages from all
+   * the rings, orders them by time and sends to the sink.
    *
-   * If the sink becomes unavailable the log messages are collected inside
-   * the LoggerImpl::_messages again and may possibly lead to large memory
-   * usage.
+   * Until the sink is set, or while it's unavailable, the messages stay in
+   * the rings. When a ring is full the message is dropped or the thread
+   * waits for the writer according to the overflow policy. Without a
+   * sink messages are always dropped. The number of dropped
+   * messages is reported to the sink.
    */
   class LoggerImpl {
-    std::queue<LogMessage> _messages;      /**< Message queue */
-    std::mutex _mutex;                     /**< Message queue lock */
+    std::mutex _rings_mutex;               /**< Lock for _rings */
+    std::vector<std::shared_ptr<LogRing> > _rings; /**< Rings of all logging threads */
+    std::vector<std::shared_ptr<LogRing> > _free; /**< Drained rings of finished threads, guarded by _rings_mutex */
+    std::atomic<size_t> _allocated;        /**< Rings created since start */
+    std::atomic<size_t> _ring_size;        /**< Size of rings for new threads */
+    std::atomic<Overflow> _overflow;       /**< Full ring policy */
+    std::atomic<size_t> _dropped;          /**< Messages dropped since start */
+
+    std::mutex _mutex;                     /**< Lock for writer waiting */
     std::condition_variable _cond;         /**< The var to signal new messages */
+    std::atomic_bool _waiting;             /**< Writer waits for messages */
+    std::mutex _space_mutex;               /**< Lock for threads waiting for ring space */
+    std::condition_variable _space;        /**< The var to signal freed ring slots */
+    std::atomic<size_t> _blocked;          /**< Threads waiting for ring space */
     std::unique_ptr<std::thread> _writer;  /**< Thread for outing */
     std::atomic_bool _running;             /**< Writing logs is active */
-    unsigned int _log_repeat;              /**< Repeats for writing logs */
+    std::atomic_bool _draining;            /**< Writer has a sink and empties the rings */
+    std::mutex _sink_mutex;                /**< Lock for _sink */
     std::weak_ptr<LogSink> _sink;          /**< Place to send messages */
-    Severity _severity;                    /**< Minimal severity */
+    static std::atomic<Severity> _severity; /**< Minimal severity */
+    static std::atomic_bool _binary;       /**< Sink takes binary records */
+
+    LogRing& ring();                       /**< Ring of the calling thread */
+    void wake();                           /**< Wake the writer if it waits */
+
+    /**
+     * Move messages from all rings into \c batch ordered by time
+     */
+    void collect(std::vector<LogRing::Entry>& batch);
 
     /**
      * The main thread function for the output.
      *
-     * Pops out the messages from the thread and calls LoggerImpl::_sink->write()
+     * Collects the messages from the rings and calls LoggerImpl::_sink->write()
      */
     void writeOut();
   public:
     static LoggerImpl& get();              /**< Access point to the singleton */
 
+    /**
+     * Check whether messages of severity \c s are logged, before building them
+     */
+    template <Severity s>
+    static bool enabled() {
+      return s <= compiled_severity && s <= _severity.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Check whether messages should be recorded in binary form
+     */
+    static bool binary() { return _binary.load(std::memory_order_relaxed); };
+
     LoggerImpl(LoggerImpl const&) = delete;
     LoggerImpl(LoggerImpl&&) = delete;
     LoggerImpl& operator=(LoggerImpl const&) = delete;
     LoggerImpl& operator=(LoggerImpl&&) = delete;
 
     /**
-     * Just pushs the \c msg to the \c _messages queue
+     * Put the message into the calling thread's ring
+     *
+     * \param binary \c message is a binary record
      */
-    void log(const LogMessage&& msg);
+    void log(const std::chrono::high_resolution_clock::time_point timestamp, Severity s, std::string&& message,
+             bool binary = false);
 
     /**
      * Switch on output and start logging.
@@ -128,25 +437,40 @@ namespace logging {
      * \retval Previous severity
      */
     Severity setSeverity(Severity s);
+
+    /**
+     * Set policy for full rings, Drop by default
+     */
+    void setOverflow(Overflow policy) { _overflow = policy; };
+
+    /**
+     * Set ring size for threads which haven't logged yet, 1024 by default
+     */
+    void setRingSize(size_t size) { _ring_size = size; };
+
+    /**
+     * Number of messages dropped since start
+     */
+    size_t dropped() const { return _dropped; };
+
+    /**
+     * Number of rings created since start, finished threads pass theirs on
+     */
+    size_t allocated() const { return _allocated; };
   protected:
     LoggerImpl() :
-      _messages(),
-      _mutex(),
-      _cond(),
+      _allocated(0),
+      _ring_size(1024),
+      _overflow(Overflow::Drop),
+      _dropped(0),
+      _waiting(false),
+      _blocked(0),
       _writer(nullptr),
       _running(ATOMIC_FLAG_INIT),
-      _log_repeat(1),
-      _severity(logging::Severity::trace)
+      _draining(false)
     {}
 
-    ~LoggerImpl() {
-      if (_writer) {
-        while (!_messages.empty() && !_sink.expired()) { _cond.notify_one(); }
-        _running = false;
-        _writer->detach();
-        _cond.notify_one();
-      }
-    }
+    ~LoggerImpl();
   };
 
   /**
@@ -156,16 +480,47 @@ namespace logging {
    * constructed for a while after then and the actual sending to the logger
    * happens on the object destroy. So the logging gets latency but won't make
    * freezes during the program run.
+   *
+   * When the sink is binary, the arguments are recorded raw and formatted
+   * only when the log is read, the text stream isn't even constructed.
+   * Stream manipulators don't affect the following arguments then.
+   *
+   * Trace messages start with the file and line of the site. Binary
+   * records only refer to the site, the text is added when they're read.
    */
   template <Severity s>
   class LogWriter {
-    std::stringstream _message;
+    typedef std::stringstream Text;
     const std::chrono::high_resolution_clock::time_point _timestamp;
+    const bool _binary;                    /**< Record raw arguments */
+    std::string _record;                   /**< Binary record */
+    typename std::aligned_storage<sizeof(Text), alignof(Text)>::type _text; /**< Text message, built in text mode only */
+
+    Text& text() { return *reinterpret_cast<Text *>(&_text); };
   public:
-    LogWriter() : _timestamp(std::chrono::high_resolution_clock::now()) {};
+    explicit LogWriter(const LogSite& site) :
+      _timestamp(std::chrono::high_resolution_clock::now()),
+      _binary(LoggerImpl::binary())
+    {
+      if (_binary) {
+        _record.reserve(64);
+        _record.append(reinterpret_cast<const char *>(&site.id), sizeof(site.id));
+      } else {
+        new (&_text) Text();
+        if (s == Severity::trace)
+          text() << site.file << ":" << site.line << " ";
+      }
+    };
     ~LogWriter() {
-      LoggerImpl::get().log(LogMessage(_timestamp, s, _message.str()));
+      if (_binary) {
+        LoggerImpl::get().log(_timestamp, s, std::move(_record), true);
+      } else {
+        LoggerImpl::get().log(_timestamp, s, text().str());
+        text().~Text();
+      }
     };
+    LogWriter(const LogWriter&) = delete;
+    LogWriter& operator=(const LogWriter&) = delete;
 
     /**
      * The main logging function. Every log object should be pushed there
@@ -173,9 +528,23 @@ namespace logging {
      */
     template <typename T>
     LogWriter& operator<< (const T& log_object) {
-      _message << log_object;
+      if (_binary)
+        binary::Encoder<typename std::remove_cv<T>::type>::encode(_record, log_object);
+      else
+        text() << log_object;
       return *this;
     }
   };
 
+  /**
+   * Turns the LogWriter chain into void for the disabled branch of LOG()
+   *
+   * The operator& binds weaker than operator<< so the whole chain is
+   * evaluated first.
+   */
+  struct LogVoidify {
+    template <Severity s>
+    void operator& (const LogWriter<s>&) const {}
+  };
+
 }
@@ -34,6 +34,7 @@ int main(int argc, char* argv[])
   std::string filename = argv[1];
 
   DEFAULT_LOGGING
+  std::shared_ptr<logging::LogSink> binary_sink;
   std::list<std::shared_ptr<Hub::Hub> > hublist;
   std::ifstream config_stream;
   config_stream.open(filename);
@@ -56,6 +57,16 @@ int main(int argc, char* argv[])
         config::ConfigParser generalOptions(buffer);
         tick_timeout = generalOptions.get("tick_timeout", "1200000");
         DEBUG << "Tick timeout set to: " << tick_timeout;
+        /* Threads which already logged keep their rings */
+        logging::LoggerImpl::get().setRingSize(static_cast<int>(generalOptions.get("log_ring", "1024")));
+        if (static_cast<std::string>(generalOptions.get("log_overflow", "drop")) == "block")
+          logging::LoggerImpl::get().setOverflow(logging::Overflow::Block);
+        /* Read with chatsync-logdecode */
+        const std::string log_binary = generalOptions.get("log_binary", "");
+        if (!log_binary.empty()) {
+          binary_sink = std::make_shared<logging::LogSinkBinary>(log_binary);
+          logging::LoggerImpl::get().setOutput(binary_sink);
+        }
       }
       if (config::strutil::cistrcmp(optionMatches[1], "hub")) {
         std::string buffer = "data://";
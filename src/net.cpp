@@ -1,4 +1,5 @@
 #include "net.hpp"
+#include <cerrno>
 
 /** This namespace contains network-related inline functions intended to embed
     into clients */
@@ -38,13 +39,42 @@ namespace networking {
     return std::make_pair(server, ipv6);
   }
 
-  int tcp_connect(const std::string& host) {
+  static inline bool connect_failed(int ret, bool nonblocking) {
+    return ret < 0 && !(nonblocking && errno == EINPROGRESS);
+  }
+
+  std::pair<std::string, std::string> split_host(const std::string& host) {
+    std::string::size_type name_end = 0;
+    std::string name;
+    if (!host.empty() && host[0] == '[') {
+      name_end = host.find(']');
+      if (name_end == std::string::npos)
+        throw network_error("Unclosed bracket in address " + host);
+      name = host.substr(1, name_end - 1);
+      ++name_end;
+    } else {
+      name_end = host.find(':');
+      name = host.substr(0, name_end);
+    }
+    if (name_end >= host.length() || host[name_end] != ':' || name_end + 1 == host.length())
+      throw network_error("Please provide server address in host:port format");
+    return std::make_pair(name, host.substr(name_end + 1));
+  }
+
+  bool is_ip_literal(const std::string& host) {
+    unsigned char address[sizeof(struct os::in6_addr)];
+    return os::inet_pton(AF_INET, host.c_str(), address) == 1 ||
+      os::inet_pton(AF_INET6, host.c_str(), address) == 1;
+  }
+
+  int tcp_connect(const std::string& host, bool nonblocking) {
     int fd = -1;
     int port = -1;
     std::string url;
     try {
-      port = std::stoi(host.substr(host.find(':', 0) + 1, host.length()));
-      url = host.substr(0, host.find(':', 0));
+      const auto& parts = split_host(host);
+      url = parts.first;
+      port = std::stoi(parts.second);
     } catch (std::out_of_range& ex) {
       throw network_error("Please provide server address in host:port format");
     } catch (std::invalid_argument& ex) {
@@ -62,6 +92,8 @@ namespace networking {
       fd = socket(AF_INET, os::SOCK_STREAM, 0);
       if (fd < 0)
         throw network_error("Can't create socket");
+      if (nonblocking)
+        os::fcntl(fd, F_SETFL, os::fcntl(fd, F_GETFL) | O_NONBLOCK);
 
       os::memset(&serv_addr, 0, sizeof(struct os::sockaddr_in));
       serv_addr.sin_family = AF_INET;
@@ -75,14 +107,18 @@ namespace networking {
 #endif
         serv_addr.sin_port = htons(port);
       }
-      if (connect(fd, (struct os::sockaddr *) &serv_addr, sizeof(serv_addr)) < 0)
+      if (connect_failed(connect(fd, (struct os::sockaddr *) &serv_addr, sizeof(serv_addr)), nonblocking)) {
+        os::close(fd);
         throw network_error("Can't connect to server");
+      }
     } else {
       struct os::sockaddr_in6 serv_addr;
 
       fd = socket(AF_INET6, os::SOCK_STREAM, 0);
       if (fd < 0)
         throw network_error("Can't create ipv6 socket");
+      if (nonblocking)
+        os::fcntl(fd, F_SETFL, os::fcntl(fd, F_GETFL) | O_NONBLOCK);
       os::memset(&serv_addr, 0, sizeof(struct os::sockaddr_in6));
       serv_addr.sin6_family = AF_INET6;
       os::memcpy((char *) &serv_addr.sin6_addr,
@@ -96,25 +132,99 @@ namespace networking {
         serv_addr.sin6_port = htons(port);
         os::inet_pton(AF_INET6, url.c_str(), &serv_addr.sin6_addr);
       }
-      if (os::connect(fd, (struct os::sockaddr *) &serv_addr, sizeof(serv_addr)) < 0)
+      if (connect_failed(os::connect(fd, (struct os::sockaddr *) &serv_addr, sizeof(serv_addr)), nonblocking)) {
+        os::close(fd);
         throw network_error("Can't connect to server using ipv6");
+      }
     }
     return fd;
   }
 
 #ifdef TLS_SUPPORT
-  TLSConnection::TLSConnection(int tcp_fd) {
+  TLSSessionCache& TLSSessionCache::get() {
+    static TLSSessionCache instance;
+    return instance;
+  }
+
+  bool TLSSessionCache::load(const std::string& host, gnutls::session& session) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    const auto& cached = _sessions.find(host);
+    if (cached == _sessions.end())
+      return false;
+    const int ret = gnutls_session_set_data(session.ptr(), cached->second.data(), cached->second.size());
+    if (ret < 0) {
+      DEBUG << "Can't apply cached TLS session for " << host << ": " << gnutls_strerror(ret);
+      _sessions.erase(cached);
+      return false;
+    }
+    return true;
+  }
+
+  void TLSSessionCache::store(const std::string& host, gnutls::session& session) {
+    gnutls_datum_t data {nullptr, 0};
+    if (gnutls_session_get_data2(session.ptr(), &data) < 0)
+      return;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _sessions[host].assign(data.data, data.data + data.size);
+    }
+    gnutls_free(data.data);
+  }
+
+  void TLSSessionCache::drop(const std::string& host) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _sessions.erase(host);
+  }
+
+  gnutls::certificate_credentials& shared_credentials() {
+    static gnutls::certificate_credentials credentials;
+    return credentials;
+  }
+
+  TLSConnection::TLSConnection(int tcp_fd, const std::string& host) :
+    credentials(shared_credentials()),
+    _host(host),
+    _cached(false)
+  {
     session.set_credentials(credentials);
     session.set_priority ("NORMAL", NULL);
     session.set_transport_ptr((gnutls_transport_ptr_t) (ptrdiff_t) tcp_fd);
+    if (!_host.empty()) {
+      /* SNI is needed for most of servers to issue a ticket for this name,
+         RFC 6066 doesn't allow addresses there */
+      const auto& servername = split_host(_host).first;
+      if (!is_ip_literal(servername))
+        session.set_server_name(GNUTLS_NAME_DNS, servername.c_str(), servername.length());
+      _cached = TLSSessionCache::get().load(_host, session);
+    }
   }
 
   TLSConnection::~TLSConnection() {
-    session.bye(GNUTLS_SHUT_RDWR);
+    /* TLS 1.3 tickets come after the handshake, so update the data once more */
+    if (!_host.empty())
+      TLSSessionCache::get().store(_host, session);
+    /* Result is ignored: socket may be non-blocking or already broken */
+    gnutls_bye(session.ptr(), GNUTLS_SHUT_WR);
   }
 
   int TLSConnection::handshake() {
-    return session.handshake();
+    int ret = gnutls_handshake(session.ptr());
+    if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED)
+      return GNUTLS_E_AGAIN;
+    if (_host.empty())
+      return ret;
+    if (ret < 0) {
+      if (_cached)
+        TLSSessionCache::get().drop(_host);
+      return ret;
+    }
+    if (session.is_resumed()) {
+      DEBUG << "TLS session to " << _host << " resumed";
+    } else {
+      TRACE << "Full TLS handshake with " << _host;
+      TLSSessionCache::get().store(_host, session);
+    }
+    return ret;
   }
 
   ssize_t TLSConnection::pending_bytes () {
@@ -122,8 +232,12 @@ namespace networking {
   }
 
   ssize_t TLSConnection::recv(void* buffer, size_t count) {
-    int ret = session.recv(buffer, count);
+    const ssize_t ret = gnutls_record_recv(session.ptr(), buffer, count);
 
+    if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED) {
+      errno = EAGAIN;
+      return -1;
+    }
     if (ret == 0)
       throw networking::tls_error(ret, "Peer has closed the TLS connection");
     if (ret < 0)
@@ -135,10 +249,44 @@ namespace networking {
     return session.send(buffer, count);
   }
 
+  ssize_t TLSConnection::queue(const struct iovec* iov, int count) {
+    gnutls_record_cork(session.ptr());
+    ssize_t total = 0;
+    for (int i = 0; i < count; i++) {
+      if (!iov[i].iov_len)
+        continue;
+      /* Corked data is only buffered, so it never waits for the socket */
+      const ssize_t ret = gnutls_record_send(session.ptr(), iov[i].iov_base, iov[i].iov_len);
+      if (ret < 0) {
+        gnutls_record_uncork(session.ptr(), 0);
+        throw networking::tls_error(ret, gnutls_strerror(ret));
+      }
+      total += ret;
+    }
+    return total;
+  }
+
+  bool TLSConnection::flush() {
+    const int ret = gnutls_record_uncork(session.ptr(), 0);
+    if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED)
+      return false;
+    if (ret < 0)
+      throw networking::tls_error(ret, gnutls_strerror(ret));
+    return true;
+  }
+
+  ssize_t TLSConnection::sendv(const struct iovec* iov, int count) {
+    const ssize_t total = queue(iov, count);
+    const int ret = gnutls_record_uncork(session.ptr(), GNUTLS_RECORD_WAIT);
+    if (ret < 0)
+      throw networking::tls_error(ret, gnutls_strerror(ret));
+    return total;
+  }
+
   std::unique_ptr<TLSConnection> tls_connect(const std::string& host) {
     TRACE << "Opening tls connect to " << host;
     int tcp_fd = tcp_connect(host);
-    auto connection = std::make_unique<TLSConnection>(tcp_fd);
+    auto connection = std::make_unique<TLSConnection>(tcp_fd, host);
 
     // Perform the TLS handshake
     int ret = connection->handshake();
@@ -1,6 +1,12 @@
 #pragma once
 #include <memory>
 #include <stdexcept>
+#include <map>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <utility>
+#include <sys/uio.h>
 #include "logging.hpp"
 
 #ifdef TLS_SUPPORT
@@ -40,26 +46,107 @@ namespace networking {
       code(_code)
     {};
   };
-  int tcp_connect(const std::string& host);
+
+  /**
+   * Split "host:port" line into host and port
+   *
+   * IPv6 addresses should be in brackets: "[::1]:443", the brackets are
+   * removed from the host.
+   *
+   * \throws network_error if there is no port
+   */
+  std::pair<std::string, std::string> split_host(const std::string& host);
+
+  /**
+   * Check whether \c host is a numeric IPv4 or IPv6 address
+   */
+  bool is_ip_literal(const std::string& host);
+
+  /**
+   * Open TCP connection to \c host
+   *
+   * \param host "host:port" line of the server
+   * \param nonblocking Put the socket into non-blocking mode before
+   *                    connecting. The connection may be still in progress
+   *                    when the function returns, wait for the socket to
+   *                    become writable and check \c SO_ERROR.
+   * \retval socket descriptor
+   */
+  int tcp_connect(const std::string& host, bool nonblocking = false);
 
 #ifdef TLS_SUPPORT
+  /**
+   * Process-wide storage for TLS session resumption data
+   *
+   * The data is keyed with "host:port" line. When a new connection to the
+   * same host is made the stored session is offered to the server, so the
+   * handshake may be abbreviated and skip the asymmetric crypto.
+   */
+  class TLSSessionCache {
+    std::mutex _mutex;                                              /**< Lock for \c _sessions */
+    std::map<std::string, std::vector<unsigned char> > _sessions;   /**< Serialized sessions */
+    TLSSessionCache() {};
+  public:
+    static TLSSessionCache& get();                                  /**< Access point to the singleton */
+
+    TLSSessionCache(TLSSessionCache const&) = delete;
+    TLSSessionCache& operator=(TLSSessionCache const&) = delete;
+
+    /**
+     * Set previously saved session data for \c host into \c session
+     *
+     * \retval true if the data was found and applied
+     */
+    bool load(const std::string& host, gnutls::session& session);
+
+    /**
+     * Save resumption data of established \c session for \c host
+     */
+    void store(const std::string& host, gnutls::session& session);
+
+    /**
+     * Forget the data for \c host (e.g. when it was rejected)
+     */
+    void drop(const std::string& host);
+  };
+
+  /**
+   * Credentials shared between all the TLS connections of the process
+   */
+  gnutls::certificate_credentials& shared_credentials();
+
   class TLSConnection {
     gnutls::client_session session;                /**< gnutls session */
-    gnutls::certificate_credentials credentials;   /**< gnutls credentials TODO: support customization */
+    gnutls::certificate_credentials& credentials;  /**< gnutls credentials TODO: support customization */
+    const std::string _host;                       /**< "host:port" used as session cache key */
+    bool _cached;                                  /**< Cached session was offered to the server */
   public:
     /**
      * Create a connection
      *
      * \param tcp_fd A file descriptor of socket to the server.
      *               \b MUST be opened. E.g. using \c tcp_connect()
+     * \param host "host:port" line of the server. Enables the session
+     *             resumption when not empty.
      */
-    TLSConnection(int tcp_fd);
+    TLSConnection(int tcp_fd, const std::string& host = "");
     ~TLSConnection();
     /**
      * Perform TLS handshake
+     *
+     * Tries to resume a cached session for the host first. On non-blocking
+     * socket returns \c GNUTLS_E_AGAIN until the handshake is complete, it
+     * should be called again when the socket is ready for \c direction().
      */
     int handshake();
 
+    /**
+     * Check what the interrupted operation waits for
+     *
+     * \retval true if the socket should become writable, false if readable
+     */
+    bool direction() const { return session.get_record_direction(); };
+
     /**
      * Number of TLS bytes in socket (may differ from tcp_fd socket bytes)
      */
@@ -70,6 +157,9 @@ namespace networking {
      *
      * \param buffer Allocated memory for data
      * \param count Size of \c buffer
+     * \retval number of bytes or -1 with \c errno set to \c EAGAIN if
+     *         non-blocking socket has no data
+     * \throws tls_error with code 0 when peer closed the connection
      */
     ssize_t recv(void* buffer, size_t count);
 
@@ -80,6 +170,34 @@ namespace networking {
      * \param count Size of \c buffer
      */
     ssize_t send(const void * const buffer, size_t count);
+
+    /**
+     * Send several buffers to TLS at once
+     *
+     * The records are corked, so the data is packed into as few TLS
+     * records and TCP segments as possible.
+     *
+     * \param iov Buffers to send
+     * \param count Number of items in \c iov
+     */
+    ssize_t sendv(const struct iovec* iov, int count);
+
+    /**
+     * Put several buffers into a corked record without sending
+     *
+     * Use \c flush() to send them. Intended for non-blocking sockets.
+     *
+     * \retval number of bytes queued
+     */
+    ssize_t queue(const struct iovec* iov, int count);
+
+    /**
+     * Send the data collected with \c queue()
+     *
+     * \retval true if everything is sent, false if the socket is full and
+     *         \c flush() should be called again when it's writable.
+     */
+    bool flush();
   };
   std::unique_ptr<TLSConnection> tls_connect(const std::string& host);
   std::unique_ptr<TLSConnection> tls_connect(int fd);
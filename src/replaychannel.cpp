@@ -0,0 +1,110 @@
+#include "replaychannel.hpp"
+#include "messages.hpp"
+#include "logging.hpp"
+
+#include <cstdlib>
+#include <climits>
+
+namespace replayChannel {
+  const channeling::ChannelCreatorImpl<ReplayChannel> ReplayChannel::creator("replay");
+
+  /**
+   * Parse speed option, "max" means no delays
+   *
+   * \retval -1 for malformed value
+   */
+  static double parseSpeed(const std::string& value) {
+    if (value == "max")
+      return 0;
+    char* end = nullptr;
+    const double speed = strtod(value.c_str(), &end);
+    return (end == value.c_str() || *end || speed <= 0) ? -1 : speed;
+  }
+
+  static std::int64_t parseTimestamp(const std::string& value, std::int64_t fallback) {
+    return value.empty() ? fallback : strtoll(value.c_str(), nullptr, 10);
+  }
+
+  ReplayChannel::ReplayChannel(Hub::Hub* hub, const std::string& config) :
+    channeling::Channel(hub, config),
+    _path(_config.get("path", "journal")),
+    _speed(parseSpeed(_config.get("speed", "1"))),
+    _from(parseTimestamp(_config.get("from", ""), 0)),
+    _to(parseTimestamp(_config.get("to", ""), LLONG_MAX)),
+    _stopping(false)
+  {}
+
+  ReplayChannel::~ReplayChannel() {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stopping = true;
+    }
+    _cv.notify_all();
+    if (_replay.joinable())
+      _replay.join();
+  }
+
+  std::future<void> ReplayChannel::activate() {
+    return std::async(std::launch::async, [this]() {
+      if (_direction != channeling::ChannelDirection::Input)
+        throw channeling::activate_error(_name, ERR_WRONG_DIR + ": replay is input only");
+      if (_speed < 0)
+        throw channeling::activate_error(_name, ERR_MALFORMED_VAL + ": speed");
+      if (_active)
+        return;
+      _replay = std::thread(&ReplayChannel::run, this);
+      _active = true;
+    });
+  }
+
+  void ReplayChannel::run() {
+    typedef std::chrono::steady_clock clock;
+    const auto started = clock::now();
+    std::int64_t first = -1;
+    std::int64_t last = 0;
+    size_t count = 0;
+    try {
+      const journal::JournalReader reader(_path);
+      reader.read(_from, _to, [this, started, &first, &last, &count](const journal::Record& record) {
+        if (first < 0)
+          first = record.timestamp;
+        if (_speed > 0) {
+          /* Keep the recorded intervals scaled by speed from the start */
+          const auto due = started + std::chrono::microseconds(static_cast<std::int64_t>((record.timestamp - first) * 1000 / _speed));
+          std::unique_lock<std::mutex> lock(_mutex);
+          if (_cv.wait_until(lock, due, [this]() { return _stopping.load(); }))
+            return false;
+        } else if (_stopping) {
+          return false;
+        }
+        last = record.timestamp;
+        auto user = std::make_shared<const messaging::User>(messaging::User(std::string(record.user, record.user_size)));
+        const std::string text(record.text, record.text_size);
+        if (static_cast<messaging::MessageType>(record.type) == messaging::MessageType::Action)
+          _hub->newMessage(std::make_shared<const messaging::ActionMessage>(_id, std::move(user), text));
+        else
+          _hub->newMessage(std::make_shared<const messaging::TextMessage>(_id, std::move(user), text));
+        ++count;
+        return true;
+      });
+    } catch (const journal::journal_error& e) {
+      ERROR << "Replay " << _name << " failed: " << e.what();
+    }
+
+    const double elapsed = std::chrono::duration<double>(clock::now() - started).count();
+    const double recorded = count > 1 ? (last - first) / 1000.0 : 0;
+    INFO << "Replay " << _name << " sent " << count << " messages in " << elapsed << " s: "
+         << (elapsed > 0 ? count / elapsed : 0) << " msg/s, "
+         << (elapsed > 0 ? recorded / elapsed : 0) << "x of recorded pace";
+  }
+
+  const messaging::message_ptr ReplayChannel::parse(const char* line) const {
+    return std::make_shared<const messaging::TextMessage>(_id,
+                                                          std::make_shared<const messaging::User>(messaging::User("replay:" + _name)),
+                                                          line);
+  }
+
+  void ReplayChannel::incoming(const messaging::message_ptr&& msg) {
+    throw std::logic_error("Can't write data to replay channel " + _name);
+  }
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include "channel.hpp"
+#include "journal.hpp"
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+
+namespace replayChannel {
+  /**
+   * Input channel which sends messages recorded in a journal to the hub
+   *
+   * Useful to backfill an output after outage or to load test with real
+   * traffic. Messages keep their user and type, the origin is this
+   * channel. When replay is over, the number of messages and the achieved
+   * rate are logged. Options:
+   *   - path: journal directory, see journal.hpp (journal)
+   *   - speed: multiplier of recorded pace or "max" to send as fast as
+   *     possible (1)
+   *   - from, to: replay records with from <= timestamp < to, milliseconds
+   *     since epoch (whole journal)
+   */
+  class ReplayChannel: public channeling::Channel {
+    const std::string _path;                        /**< Journal directory */
+    const double _speed;                            /**< Pace multiplier, 0 for no delays */
+    const std::int64_t _from;                       /**< First timestamp to replay */
+    const std::int64_t _to;                         /**< Timestamp to stop at */
+
+    std::mutex _mutex;                              /**< Lock for \c _stopping changes waited on \c _cv */
+    std::condition_variable _cv;                    /**< Wakes replay thread on stop */
+    std::atomic_bool _stopping;                     /**< Replay should be aborted, read without lock at full speed */
+    std::thread _replay;                            /**< Replay thread */
+
+    void run();                                     /**< Replay thread function */
+
+    std::future<void> activate() override;
+    const messaging::message_ptr parse(const char* line) const override;
+    static const channeling::ChannelCreatorImpl<ReplayChannel> creator;
+  public:
+    explicit ReplayChannel(Hub::Hub* hub, const std::string& config);
+    ~ReplayChannel();
+
+    std::string type() const override { return "replay"; };
+
+  protected:
+    void incoming(const messaging::message_ptr&& msg) override;
+  };
+}
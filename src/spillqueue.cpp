@@ -0,0 +1,161 @@
+#include "spillqueue.hpp"
+#include "logging.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace channeling {
+  constexpr char spill_magic[8] = {'C', 'S', 'S', 'P', 'I', 'L', 'L', '1'};
+  constexpr std::uint32_t wrap_mark = 0xFFFFFFFF;         /**< Rest of the ring is unused, continue from start */
+  constexpr size_t entry_fixed = 4 + 8 + 2 + 1 + 2;       /**< size, timestamp, origin, type, user size */
+
+  static inline void put(char* out, std::uint64_t value, size_t bytes) {
+    for (size_t i = 0; i < bytes; ++i)
+      out[i] = static_cast<char>((value >> (8 * i)) & 0xff);
+  }
+
+  static inline std::uint64_t get(const char* in, size_t bytes) {
+    std::uint64_t value = 0;
+    for (size_t i = 0; i < bytes; ++i)
+      value |= static_cast<std::uint64_t>(static_cast<unsigned char>(in[i])) << (8 * i);
+    return value;
+  }
+
+  SpillQueue::SpillQueue(const std::string& path, size_t capacity) :
+    _path(path),
+    _fd(open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600)),
+    _header(nullptr),
+    _ring(nullptr),
+    _dropped(0)
+  {
+    if (_fd < 0)
+      throw spill_error("Can't open spill file " + path + ": " + strerror(errno));
+    const size_t size = sizeof(Header) + capacity;
+    struct stat sb;
+    if (fstat(_fd, &sb) < 0 || (static_cast<size_t>(sb.st_size) != size && ftruncate(_fd, size) < 0)) {
+      close(_fd);
+      throw spill_error("Can't resize spill file " + path + ": " + strerror(errno));
+    }
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (data == MAP_FAILED) {
+      close(_fd);
+      throw spill_error("Can't map spill file " + path + ": " + strerror(errno));
+    }
+    _header = static_cast<Header *>(data);
+    _ring = static_cast<char *>(data) + sizeof(Header);
+    if (memcmp(_header->magic, spill_magic, sizeof(spill_magic)) != 0 || _header->capacity != capacity ||
+        _header->head >= capacity || _header->tail > capacity) {
+      if (sb.st_size > 0)
+        WARNING << "Spill file " << path << " has another format or size, dropping it";
+      memcpy(_header->magic, spill_magic, sizeof(spill_magic));
+      _header->capacity = capacity;
+      _header->head = 0;
+      _header->tail = 0;
+      _header->count = 0;
+    } else if (_header->count > 0) {
+      DEBUG << "Spill file " << path << " has " << _header->count << " messages";
+    }
+  }
+
+  SpillQueue::~SpillQueue() {
+    munmap(_header, sizeof(Header) + _header->capacity);
+    close(_fd);
+  }
+
+  void SpillQueue::skipWrap() {
+    if (_header->count > 0 &&
+        (_header->capacity - _header->head < 4 || get(_ring + _header->head, 4) == wrap_mark))
+      _header->head = 0;
+  }
+
+  void SpillQueue::dropOldest() {
+    skipWrap();
+    _header->head += get(_ring + _header->head, 4);
+    if (--_header->count == 0) {
+      _header->head = 0;
+      _header->tail = 0;
+    }
+  }
+
+  bool SpillQueue::fit(size_t size, std::uint64_t& offset) {
+    auto& header = *_header;
+    if (header.count == 0) {
+      header.head = 0;
+      header.tail = 0;
+      offset = 0;
+      return true;
+    }
+    if (header.tail > header.head) {
+      /* Used: [head, tail), free space at the end and before head */
+      if (header.capacity - header.tail >= size) {
+        offset = header.tail;
+        return true;
+      }
+      if (header.head >= size) {
+        if (header.capacity - header.tail >= 4)
+          put(_ring + header.tail, wrap_mark, 4);
+        offset = 0;
+        return true;
+      }
+      return false;
+    }
+    /* Wrapped, used: [head, wrap) and [0, tail) */
+    if (header.head - header.tail >= size) {
+      offset = header.tail;
+      return true;
+    }
+    return false;
+  }
+
+  bool SpillQueue::push(const Entry& entry) {
+    const size_t user_size = std::min<size_t>(entry.user.size(), UINT16_MAX);
+    const size_t size = entry_fixed + user_size + entry.text.size();
+    if (size > _header->capacity) {
+      ++_dropped;
+      return false;
+    }
+    std::uint64_t offset;
+    while (!fit(size, offset)) {
+      dropOldest();
+      ++_dropped;
+    }
+    char* out = _ring + offset;
+    put(out, size, 4);
+    put(out + 4, entry.timestamp, 8);
+    put(out + 12, entry.origin, 2);
+    put(out + 14, entry.type, 1);
+    put(out + 15, user_size, 2);
+    memcpy(out + entry_fixed, entry.user.data(), user_size);
+    memcpy(out + entry_fixed + user_size, entry.text.data(), entry.text.size());
+    /* Publish the entry only after it's written */
+    _header->tail = offset + size;
+    ++_header->count;
+    return true;
+  }
+
+  bool SpillQueue::front(Entry& entry) {
+    if (_header->count == 0)
+      return false;
+    skipWrap();
+    const char* in = _ring + _header->head;
+    const size_t size = get(in, 4);
+    const size_t user_size = get(in + 15, 2);
+    if (size < entry_fixed + user_size || _header->head + size > _header->capacity)
+      throw spill_error("Broken entry in spill file " + _path);
+    entry.timestamp = get(in + 4, 8);
+    entry.origin = get(in + 12, 2);
+    entry.type = get(in + 14, 1);
+    entry.user.assign(in + entry_fixed, user_size);
+    entry.text.assign(in + entry_fixed + user_size, size - entry_fixed - user_size);
+    return true;
+  }
+
+  void SpillQueue::pop() {
+    if (_header->count > 0)
+      dropOldest();
+  }
+}
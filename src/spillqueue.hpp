@@ -0,0 +1,100 @@
+#pragma once
+#include <string>
+#include <cstdint>
+#include <stdexcept>
+
+namespace channeling {
+  /**
+   * Spill queue error
+   */
+  class spill_error: public std::runtime_error {
+  public:
+    spill_error(std::string const& message) :
+      std::runtime_error(message)
+    {};
+  };
+
+  /**
+   * Durable FIFO of messages kept in a memory mapped ring file
+   *
+   * The file has a fixed size, so the queue never grows: when a new entry
+   * doesn't fit, the oldest ones are dropped. The contents survive the
+   * process restart and are picked up when the same file is opened again.
+   *
+   * The queue is not thread-safe.
+   */
+  class SpillQueue {
+  public:
+    /**
+     * Queued message
+     */
+    struct Entry {
+      std::int64_t timestamp;                             /**< Milliseconds since epoch when queued */
+      std::uint16_t origin;                               /**< Channel id the message came from */
+      std::uint8_t type;                                  /**< messaging::MessageType */
+      std::string user;                                   /**< User name */
+      std::string text;                                   /**< Message text */
+    };
+
+  private:
+    /**
+     * File header, lives at the start of the mapping
+     */
+    struct Header {
+      char magic[8];                                      /**< File format marker */
+      std::uint64_t capacity;                             /**< Size of ring area */
+      std::uint64_t head;                                 /**< Offset of the oldest entry */
+      std::uint64_t tail;                                 /**< Offset to write the next entry at */
+      std::uint64_t count;                                /**< Number of entries */
+    };
+
+    const std::string _path;                              /**< Ring file */
+    int _fd;                                              /**< Ring file descriptor */
+    Header* _header;                                      /**< Mapped header */
+    char* _ring;                                          /**< Mapped ring area after the header */
+    size_t _dropped;                                      /**< Entries dropped to free space */
+
+    void skipWrap();                                      /**< Move head to the start if it points to the wrap mark */
+    void dropOldest();                                    /**< Remove the entry at head */
+    bool fit(size_t size, std::uint64_t& offset);         /**< Find place for \c size bytes */
+  public:
+    /**
+     * Open or create the ring file
+     *
+     * \param capacity Ring size in bytes, the file is reset if it was
+     *                 created with another size
+     * \throws spill_error if the file can't be created or mapped
+     */
+    SpillQueue(const std::string& path, size_t capacity);
+    ~SpillQueue();
+    SpillQueue(const SpillQueue&) = delete;
+    SpillQueue& operator=(const SpillQueue&) = delete;
+
+    /**
+     * Add \c entry to the end, dropping the oldest entries if needed
+     *
+     * \retval false if \c entry is larger than the whole ring
+     */
+    bool push(const Entry& entry);
+
+    /**
+     * Get the oldest entry without removing it
+     *
+     * \retval false if the queue is empty
+     */
+    bool front(Entry& entry);
+
+    /**
+     * Remove the oldest entry
+     */
+    void pop();
+
+    size_t size() const { return _header->count; };
+    bool empty() const { return _header->count == 0; };
+
+    /**
+     * Number of entries dropped by \c push() since opening
+     */
+    size_t dropped() const { return _dropped; };
+  };
+}
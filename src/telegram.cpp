@@ -1,82 +1,578 @@
 #include "telegram.hpp"
 #include "http.hpp"
 #include "net.hpp"
+#include "rapidjson/reader.h"
+#include "fsutil.hpp"
+#include "messages.hpp"
+#include <cstring>
 
-#include <rapidjson/stringbuffer.h>
-#include <rapidjson/writer.h>
 
 namespace telegram {
   const channeling::ChannelCreatorImpl<TgChannel> TgChannel::creator("telegram");
 
+  constexpr std::chrono::seconds poll_retry(1);           /**< Wait after the first failed poll */
+  constexpr std::chrono::seconds poll_retry_max(60);      /**< Longest wait between failed polls */
+
   static const api::Message parseUpdate(const rapidjson::Value& update);
 
   TgChannel::TgChannel(Hub::Hub* hub, const std::string& config) :
     channeling::Channel(hub, config),
     _botid(_config["botid"]),
     _hash(_config["hash"]),
-    _server("https://" + telegram_api_srv + ":" + std::to_string(telegram_api_port)),
-    _endpoint("/" + _botid + ":" + _hash + "/"),
-    _chat(_config["chat"]),
-    _last_update_id(0)
-  {}
-
-  void TgChannel::pollThread() {
-    DEBUG << "Starting telegram thread";
-    while (_pipeRunning) {
-      rapidjson::StringBuffer s;
-      rapidjson::Writer<rapidjson::StringBuffer> writer(s);
-      writer.StartObject();
-      writer.Key("timeout");
-      writer.Int(60);
-      writer.Key("offset");
-      writer.Int(_last_update_id);
-      writer.EndObject();
-      const auto& body_line = std::string(s.GetString());
-      apiRequest("getUpdates", body_line);
-    }
+    /* Group ids don't fit into int */
+    _chat(std::stoll(static_cast<std::string>(_config["chat"]))),
+    _dispatcher(UpdateDispatcher::get(_botid, _hash, _config)),
+    _sender(MessageSender::get(_botid, _hash)),
+    /* Telegram allows 20 messages per minute to a group */
+    _rate(static_cast<int>(_config.get("rate", "20"))),
+    _coalesce(static_cast<int>(_config.get("coalesce", "500")))
+  {
+    if (direction() == channeling::ChannelDirection::Input ||
+        direction() == channeling::ChannelDirection::Bidirectional)
+      _dispatcher->expect(this);
   }
 
   std::future<void> TgChannel::activate() {
     return std::async(std::launch::async, [this]() {
       if (_active)
         return;
-      _pipeRunning = true;
-      _thread = std::make_unique<std::thread>(std::thread(&TgChannel::pollThread, this));
+      if (direction() == channeling::ChannelDirection::Input ||
+          direction() == channeling::ChannelDirection::Bidirectional)
+        _dispatcher->subscribe(_chat, this);
       _active = true;
     });
   }
 
   TgChannel::~TgChannel() {
-    if (_thread) {
-      _pipeRunning = false;
-      _thread->join();
+    _dispatcher->unsubscribe(this);
+  }
+
+  void TgChannel::deliver(const api::MessageRef& msg) {
+    if (messageMatch(msg.chat_id))
+      _hub->newMessage(buildTextMessage(msg));
+  }
+
+  std::shared_ptr<UpdateDispatcher> UpdateDispatcher::get(const std::string& botid, const std::string& hash,
+                                                          const config::ConfigParser& config) {
+    static std::mutex mutex;
+    static std::map<const std::string, std::weak_ptr<UpdateDispatcher> > dispatchers;
+    const std::string token = botid + ":" + hash;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto dispatcher = dispatchers[token].lock();
+    if (!dispatcher) {
+      dispatcher = std::make_shared<UpdateDispatcher>(token, config);
+      dispatchers[token] = dispatcher;
+    }
+    return dispatcher;
+  }
+
+  /**
+   * Get the file to keep the update offset in
+   *
+   * \retval empty string if the persistence is disabled with "none"
+   */
+  static std::string stateFile(const std::string& token, const config::ConfigParser& config) {
+    const std::string state = config.get("state", ("telegram_" + token.substr(0, token.find(':')) + ".offset").c_str());
+    return state == "none" ? "" : state;
+  }
+
+  UpdateDispatcher::UpdateDispatcher(const std::string& token, const config::ConfigParser& config) :
+    _server("https://" + telegram_api_srv + ":" + std::to_string(telegram_api_port)),
+    _endpoint("/" + token + "/"),
+    _generation(0),
+    _offset(0),
+    _state_file(stateFile(token, config)),
+    _webhook(static_cast<std::string>(config.get("mode", "poll")) == "webhook"),
+    _port(config.get("listen", "8443")),
+    _address(config.get("listen_address", "127.0.0.1")),
+    _secret(config.get("secret", "")),
+    _url(config.get("webhook_url", "")),
+    _running(false)
+  {}
+
+  void UpdateDispatcher::loadOffset() {
+    if (_state_file.empty())
+      return;
+    std::string data;
+    try {
+      if (!fsutil::readFile(_state_file, data))
+        return;
+      _offset = std::stoll(data);
+      DEBUG << "Telegram updates resume from " << _offset;
+    } catch (const std::exception& e) {
+      ERROR << "Can't load telegram offset from " << _state_file << ": " << e.what();
+    }
+  }
+
+  void UpdateDispatcher::saveOffset() {
+    if (_state_file.empty())
+      return;
+    try {
+      fsutil::atomicWrite(_state_file, std::to_string(_offset));
+    } catch (const fsutil::fs_error& e) {
+      ERROR << "Can't save telegram offset: " << e.what();
+    }
+  }
+
+  UpdateDispatcher::~UpdateDispatcher() {
+    std::lock_guard<std::mutex> control(_control);
+    stop();
+  }
+
+  void UpdateDispatcher::stop() {
+    std::unique_ptr<std::thread> thread;
+    std::unique_ptr<http::HTTPServer> listener;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _running = false;
+      thread = std::move(_thread);
+      listener = std::move(_listener);
+      if (_poll) {
+        std::lock_guard<std::mutex> poll(_poll->mutex);
+        _poll->stopped = true;
+        _poll->ready.notify_all();
+      }
+      _changed.notify_all();
     }
+    /* Both take _mutex to route the updates */
+    listener.reset();
+    if (thread)
+      thread->join();
+  }
+
+  void UpdateDispatcher::expect(TgChannel* channel) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _expected.insert(channel);
+  }
+
+  void UpdateDispatcher::subscribe(std::int64_t chat, TgChannel* channel) {
+    /* Anybody reaching the port could inject messages otherwise */
+    if (_webhook && _secret.empty())
+      throw channeling::activate_error(channel->name(), ERR_NO_OPTION + ": secret is required in webhook mode");
+    std::lock_guard<std::mutex> control(_control);
+    std::lock_guard<std::mutex> lock(_mutex);
+    _channels.emplace(chat, channel);
+    _expected.erase(channel);
+    ++_generation;
+    _changed.notify_all();
+    if (_webhook) {
+      if (!_listener)
+        startWebhook();
+    } else if (!_thread) {
+      loadOffset();
+      _running = true;
+      _thread = std::make_unique<std::thread>(std::thread(&UpdateDispatcher::pollThread, this));
+    }
+  }
+
+  void UpdateDispatcher::unsubscribe(TgChannel* channel) {
+    std::lock_guard<std::mutex> control(_control);
+    bool last = false;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _expected.erase(channel);
+      for (auto it = _channels.begin(); it != _channels.end(); )
+        if (it->second == channel)
+          it = _channels.erase(it);
+        else
+          ++it;
+      ++_generation;
+      _changed.notify_all();
+      last = _channels.empty();
+    }
+    if (last) {
+      DEBUG << "No telegram channels left, stopping updates of " << _endpoint;
+      stop();
+    }
+  }
+
+  /**
+   * Fill POST request to the API method with JSON body
+   */
+  static void fillRequest(http::HTTPRequest& req, const std::function<void(BodyWriter&)>& body) {
+    req.addHeader("content-type",   "application/json");
+    auto stream = req.bodyStream();
+    BodyWriter writer(stream);
+    body(writer);
+  }
+
+  void UpdateDispatcher::pollThread() {
+    DEBUG << "Starting telegram update dispatcher";
+    std::chrono::seconds retry(0);
+    while (_running) {
+      http::HTTPRequest req(http::HTTPRequestType::POST,
+                            telegram_api_srv,
+                            _endpoint + "getUpdates");
+      /* Telegram answers in 60 seconds if there are no updates */
+      req.setTimeout(std::chrono::seconds(90));
+      fillRequest(req, [this](BodyWriter& writer) {
+        writer.StartObject();
+        writer.Key("timeout");
+        writer.Int(60);
+        writer.Key("offset");
+        writer.Int64(_offset);
+        writer.EndObject();
+      });
+      bool held = false;
+      try {
+        const auto response = httpRequest(req);
+        if (!response)
+          continue;
+        const auto& data = response->mutableData();
+        if (data.second == 0)
+          throw telegram_error("Empty answer from Telegram");
+        held = dispatch(data.first);
+        retry = std::chrono::seconds(0);
+      } catch (const std::exception& e) {
+        /* Bad token, another poller or no network won't go away at once */
+        retry = std::min(std::max(retry * 2, poll_retry), poll_retry_max);
+        ERROR << "Telegram update poll failed, retrying in " << retry.count() << "s: " << e.what();
+        std::unique_lock<std::mutex> lock(_mutex);
+        _changed.wait_for(lock, retry, [this]() { return !_running; });
+        continue;
+      }
+      if (held) {
+        /* Telegram returns the held update at once, so poll again only when somebody subscribes */
+        std::unique_lock<std::mutex> lock(_mutex);
+        const size_t generation = _generation;
+        _changed.wait(lock, [this, generation]() { return !_running || _generation != generation; });
+      }
+    }
+  }
+
+  size_t UpdateDispatcher::route(char* line, bool single, bool& held) {
+    size_t count = 0;
+    held = false;
+    std::lock_guard<std::mutex> lock(_mutex);
+    const std::function<bool(const api::MessageRef&)> receiver = [this, &count, &held](const api::MessageRef& msg) {
+      if (msg.has_message) {
+        TRACE << msg.from << ":" << msg.text;
+        const auto& subscribers = _channels.equal_range(msg.chat_id);
+        if (subscribers.first == subscribers.second) {
+          if (!_expected.empty()) {
+            /* The channel of this chat may be just not activated yet */
+            DEBUG << "No channel for telegram chat " << msg.chat_id << " yet, holding updates from " << msg.update_id;
+            held = true;
+            return false;
+          }
+          DEBUG << "No channel for telegram chat " << msg.chat_id;
+        }
+        for (auto it = subscribers.first; it != subscribers.second; ++it)
+          it->second->deliver(msg);
+      }
+      ++count;
+      /* Confirm the update even if nobody is interested in it */
+      _offset = msg.update_id + 1;
+      TRACE << "Last update :" << _offset;
+      return true;
+    };
+    UpdateReader handler(receiver, single);
+    rapidjson::Reader reader;
+    rapidjson::InsituStringStream stream(line);
+    if (!reader.Parse<rapidjson::kParseInsituFlag>(stream, handler) && !held)
+      throw telegram_error("Can't parse answer from Telegram at offset " +
+                           std::to_string(reader.GetErrorOffset()));
+    if (!handler.ok())
+      throw telegram_error("Telegram reports an error " + std::to_string(handler.error()));
+    return count;
+  }
+
+  bool UpdateDispatcher::dispatch(char* line) {
+    bool held = false;
+    if (route(line, false, held) > 0)
+      saveOffset();
+    else if (!held)
+      DEBUG << "Empty array from Telegram. Apparently timeout triggered";
+    return held;
+  }
+
+  int UpdateDispatcher::webhook(http::RequestParser& request) {
+    if (request.method() != "POST")
+      return 404;
+    if (!_secret.empty()) {
+      const auto& token = request.header("X-Telegram-Bot-Api-Secret-Token");
+      if (!token.first || std::string(token.first, token.second) != _secret) {
+        WARNING << "Webhook call with wrong secret token";
+        return 403;
+      }
+    }
+    const auto& body = request.mutableBody();
+    if (body.second == 0)
+      return 400;
+    bool held = false;
+    try {
+      route(body.first, true, held);
+    } catch (const std::exception& e) {
+      ERROR << "Can't process webhook update: " << e.what();
+      return 400;
+    }
+    /* Telegram repeats the update later */
+    return held ? 503 : 200;
+  }
+
+  void UpdateDispatcher::startWebhook() {
+    _listener = std::make_unique<http::HTTPServer>(_port, [this](http::RequestParser& request) {
+        return webhook(request);
+      }, _address);
+    if (_url.empty())
+      return;
+    /* Register the hook, the request is kept alive by the handler */
+    auto req = std::make_shared<http::HTTPRequest>(http::HTTPRequestType::POST,
+                                                   telegram_api_srv,
+                                                   _endpoint + "setWebhook");
+    fillRequest(*req, [this](BodyWriter& writer) {
+      writer.StartObject();
+      writer.Key("url");
+      writer.String(_url.c_str(), _url.length());
+      if (!_secret.empty()) {
+        writer.Key("secret_token");
+        writer.String(_secret.c_str(), _secret.length());
+      }
+      writer.EndObject();
+    });
+    http::PerformHTTPRequest(_server, *req, [req](std::unique_ptr<http::HTTPResponse>&&, std::exception_ptr error) {
+        try {
+          if (error)
+            std::rethrow_exception(error);
+          DEBUG << "Telegram webhook is registered";
+        } catch (const std::exception& e) {
+          ERROR << "Can't register telegram webhook: " << e.what();
+        }
+      });
   }
 
   void TgChannel::incoming(const messaging::message_ptr&& msg) {
-    constexpr int tg_message_max = 4096;
-    const std::string uri = "sendMessage";
-    char message[tg_message_max];
     const auto textmsg = messaging::TextMessage::fromMessage(msg);
-    int msglen = snprintf(message, tg_message_max, "@%s: %s",
-                          textmsg->user()->name().c_str(),
-                          textmsg->data().c_str());
-    rapidjson::StringBuffer s;
-    rapidjson::Writer<rapidjson::StringBuffer> writer(s);
-    writer.StartObject();
-    writer.Key("chat_id");
-    writer.Int(_chat);
-    writer.Key("text");
-    writer.String(message, msglen);
-    writer.EndObject();
-    const auto& body_line = std::string(s.GetString());
-    apiRequest("sendMessage", body_line);
-  }
-
-  bool TgChannel::messageMatch(const api::Message& msg) const {
-    return
-      msg.chat.type == api::ChatType::Group &&
-      msg.chat.id == _chat;
+    const std::string message = "@" + textmsg->user()->name() + ": " + textmsg->data();
+    for (auto& part : splitText(message))
+      _sender->send(_chat, _rate, _coalesce, std::move(part));
+  }
+
+  /**
+   * Number of UTF-16 code units taken by character starting with byte \c c
+   *
+   * \retval 0 for continuation bytes
+   */
+  static inline size_t utf16Units(unsigned char c) {
+    if ((c & 0xC0) == 0x80)
+      return 0;
+    /* Characters out of BMP take a surrogate pair */
+    return (c & 0xF8) == 0xF0 ? 2 : 1;
+  }
+
+  size_t textLength(const std::string& text) {
+    size_t length = 0;
+    for (const unsigned char c : text)
+      length += utf16Units(c);
+    return length;
+  }
+
+  std::vector<std::string> splitText(const std::string& text, size_t limit) {
+    std::vector<std::string> parts;
+    size_t start = 0;
+    while (start < text.length()) {
+      size_t end = start;
+      size_t length = 0;
+      size_t newline = std::string::npos;
+      size_t space = std::string::npos;
+      /* Stop on the first character which doesn't fit, so end is never inside of one */
+      for (; end < text.length(); ++end) {
+        const size_t units = utf16Units(text[end]);
+        if (units && length > 0 && length + units > limit)
+          break;
+        length += units;
+        if (text[end] == '\n')
+          newline = end;
+        else if (text[end] == ' ')
+          space = end;
+      }
+      if (end < text.length()) {
+        const size_t half = start + (end - start) / 2;
+        const size_t cut = newline != std::string::npos && newline > half ? newline :
+                           space != std::string::npos && space > half ? space : std::string::npos;
+        if (cut != std::string::npos) {
+          /* The separator itself is dropped */
+          parts.emplace_back(text, start, cut - start);
+          start = cut + 1;
+          continue;
+        }
+      }
+      parts.emplace_back(text, start, end - start);
+      start = end;
+    }
+    return parts;
+  }
+
+  constexpr int MessageSender::retry_delay;
+  constexpr unsigned MessageSender::max_attempts;
+
+  std::shared_ptr<MessageSender> MessageSender::get(const std::string& botid, const std::string& hash) {
+    static std::mutex mutex;
+    static std::map<const std::string, std::weak_ptr<MessageSender> > senders;
+    const std::string token = botid + ":" + hash;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto sender = senders[token].lock();
+    if (!sender) {
+      sender = std::make_shared<MessageSender>(token);
+      senders[token] = sender;
+    }
+    return sender;
+  }
+
+  MessageSender::MessageSender(const std::string& token, size_t concurrency) :
+    _server("https://" + telegram_api_srv + ":" + std::to_string(telegram_api_port)),
+    _endpoint("/" + token + "/"),
+    _concurrency(concurrency),
+    _loop(eventloop::EventLoop::shared()),
+    _limit(global_rate, global_rate),
+    _in_flight(0),
+    _timer_set(false)
+  {}
+
+  void MessageSender::send(std::int64_t chat, double rate, std::chrono::milliseconds window, std::string&& text) {
+    auto self = shared_from_this();
+    /* std::function needs copyable closure, so the text is moved in via shared_ptr */
+    auto message = std::make_shared<std::string>(std::move(text));
+    _loop.post([self, chat, rate, window, message]() {
+      auto found = self->_chats.find(chat);
+      if (found == self->_chats.end())
+        found = self->_chats.emplace(chat, ChatQueue {{}, TokenBucket(rate / 60, 3), false, clock::time_point()}).first;
+      auto& messages = found->second.messages;
+      const auto now = clock::now();
+      /* Only the first message is in flight while the chat is busy */
+      const bool in_flight = found->second.busy && messages.size() == 1;
+      if (!messages.empty() && !in_flight && messages.back().open_until > now &&
+          textLength(messages.back().text) + 1 + textLength(*message) <= message_limit) {
+        messages.back().text += '\n';
+        messages.back().text += *message;
+      } else {
+        messages.push_back(Pending {std::move(*message), now + window, 0});
+      }
+      self->pump();
+    });
+  }
+
+  void MessageSender::pump() {
+    const auto now = clock::now();
+    clock::duration next = clock::duration::max();
+    for (auto item = _chats.begin(); item != _chats.end();) {
+      auto& queue = item->second;
+      if (!queue.busy && queue.messages.empty() && queue.blocked_until <= now && queue.limit.full(now))
+        item = _chats.erase(item);
+      else
+        ++item;
+    }
+    for (auto& item : _chats) {
+      if (_in_flight >= _concurrency)
+        return;
+      auto& queue = item.second;
+      if (queue.busy || queue.messages.empty())
+        continue;
+      if (queue.blocked_until > now) {
+        next = std::min(next, queue.blocked_until - now);
+        continue;
+      }
+      const auto chat_wait = queue.limit.wait(now);
+      const auto global_wait = _limit.wait(now);
+      if (chat_wait > clock::duration::zero() || global_wait > clock::duration::zero()) {
+        next = std::min(next, std::max(chat_wait, global_wait));
+        continue;
+      }
+      queue.limit.take(now);
+      _limit.take(now);
+      queue.busy = true;
+      ++_in_flight;
+
+      const std::int64_t chat = item.first;
+      auto req = std::make_shared<http::HTTPRequest>(http::HTTPRequestType::POST,
+                                                     telegram_api_srv,
+                                                     _endpoint + "sendMessage");
+      const auto& text = queue.messages.front().text;
+      fillRequest(*req, [chat, &text](BodyWriter& writer) {
+        writer.StartObject();
+        writer.Key("chat_id");
+        writer.Int64(chat);
+        writer.Key("text");
+        writer.String(text.data(), text.length());
+        writer.EndObject();
+      });
+      auto self = shared_from_this();
+      /* The request is captured to keep its body alive while it's sent */
+      request(req, [self, chat, req](std::unique_ptr<http::HTTPResponse>&& response, std::exception_ptr error) {
+        self->complete(chat, std::move(response), error);
+      });
+    }
+    if (next != clock::duration::max() && !_timer_set) {
+      _timer_set = true;
+      auto self = shared_from_this();
+      _loop.schedule(std::chrono::duration_cast<std::chrono::milliseconds>(next) + std::chrono::milliseconds(1),
+                     [self]() {
+                       self->_timer_set = false;
+                       self->pump();
+                     });
+    }
+  }
+
+  /**
+   * Get retry_after from the error answer of Telegram
+   *
+   * \retval seconds to wait or 0 if there is no such field
+   */
+  static int retryAfter(const std::string& answer) {
+    rapidjson::Document doc;
+    if (doc.Parse(answer.c_str()).HasParseError() || !doc.IsObject() || !doc.HasMember("parameters"))
+      return 0;
+    const auto& parameters = doc["parameters"];
+    if (!parameters.IsObject() || !parameters.HasMember("retry_after") || !parameters["retry_after"].IsInt())
+      return 0;
+    return parameters["retry_after"].GetInt();
+  }
+
+  void MessageSender::complete(std::int64_t chat, std::unique_ptr<http::HTTPResponse>&& response __attribute__((unused)),
+                               std::exception_ptr error) {
+    --_in_flight;
+    auto& queue = _chats.at(chat);
+    queue.busy = false;
+    try {
+      if (error)
+        std::rethrow_exception(error);
+      queue.messages.pop_front();
+    } catch (const http::http_error& e) {
+      const int retry_after = e.code == 429 ? retryAfter(e.body) : 0;
+      if (retry_after > 0) {
+        /* Keep the message in the queue to preserve order */
+        WARNING << "Telegram asked to wait " << retry_after << "s before sending to " << chat;
+        queue.blocked_until = clock::now() + std::chrono::seconds(retry_after);
+      } else if (e.code < 0 || e.code == 429 || e.code >= 500) {
+        /* No answer or server side problem */
+        retry(chat, queue, e.what());
+      } else {
+        ERROR << "Can't send message to telegram chat " << chat << ": " << e.what() << " " << e.body;
+        queue.messages.pop_front();
+      }
+    } catch (const networking::network_error& e) {
+      retry(chat, queue, e.what());
+    } catch (const std::exception& e) {
+      ERROR << "Can't send message to telegram chat " << chat << ": " << e.what();
+      queue.messages.pop_front();
+    }
+    pump();
+  }
+
+  void MessageSender::retry(std::int64_t chat, ChatQueue& queue, const char* reason) {
+    auto& pending = queue.messages.front();
+    if (++pending.attempts >= max_attempts) {
+      ERROR << "Giving up sending message to telegram chat " << chat << ": " << reason;
+      queue.messages.pop_front();
+      return;
+    }
+    const auto delay = std::chrono::milliseconds(retry_delay) * (1 << (pending.attempts - 1));
+    WARNING << "Can't send message to telegram chat " << chat << ", retrying in " << delay.count() << "ms: " << reason;
+    queue.blocked_until = clock::now() + delay;
+  }
+
+  bool TgChannel::messageMatch(std::int64_t chat) const {
+    return chat == _chat;
   }
 
   const messaging::message_ptr TgChannel::parse(const char* line) const
@@ -93,35 +589,10 @@ namespace telegram {
       throw telegram_error("Telegram reports an error " + std::to_string(err) + "\n" + std::string(line));
     }
 
-    if (doc["result"].IsArray()) {
-      const auto& updates = doc["result"].GetArray();
-      if (updates.Size() == 0)
-        throw parse_error(0, "Empty array");
-      if (updates.Size() > 1)
-        for (const auto& upd : updates) {
-          if (upd.HasMember("message")) {
-            const auto& msg = parseUpdate(upd);
-            const auto message = buildTextMessage(msg);
-            if (messageMatch(msg)) {
-              _last_update_id = upd["update_id"].GetInt() + 1;
-              TRACE << "Last update :" << _last_update_id;
-              _hub->newMessage(std::move(message));
-            }
-          }
-        }
-      const auto& last_update = updates[updates.Size() - 1];
-      const auto& item = parseUpdate(last_update);
-      _last_update_id = last_update["update_id"].GetInt() + 1;
-      TRACE << "Last update :" << _last_update_id;
-      return buildTextMessage(std::move(item));
-    } else {
-      const auto& update = doc["result"];
-      const auto& item = parseUpdate(doc["result"]);
-      _last_update_id = update["update_id"].GetInt() + 1;
-      TRACE << "Last update :" << _last_update_id;
-      return buildTextMessage(std::move(item));
-    }
-    throw telegram_error("Message without text:" + std::string(line));
+    /* Updates come through UpdateDispatcher, here are the answers to our requests */
+    if (!doc["result"].IsObject())
+      throw parse_error(0, "No message in the answer");
+    return buildTextMessage(parseUpdate(doc["result"]));
   }
 
   const messaging::message_ptr TgChannel::buildTextMessage(const api::Message& msg) const {
@@ -130,52 +601,58 @@ namespace telegram {
                                                           msg.text.c_str());
   }
 
+  const messaging::message_ptr TgChannel::buildTextMessage(const api::MessageRef& msg) const {
+    return std::make_shared<const messaging::TextMessage>(_id,
+                                                          std::make_shared<const messaging::User>( messaging::User(msg.from)),
+                                                          msg.text);
+  }
+
 #ifndef _UNIT_TEST_BUILD
-  std::unique_ptr<http::HTTPResponse>
-  TgChannel::httpRequest(const std::string& srv, const http::HTTPRequest& req) const {
-    auto hr = http::PerformHTTPRequest(srv, req);
-    hr.wait();
-    return hr.get();
+  void MessageSender::request(const std::shared_ptr<http::HTTPRequest>& req, http::ResponseHandler&& handler) {
+    http::PerformHTTPRequest(_server, *req, std::move(handler));
   }
-#endif
 
-  void TgChannel::apiRequest(const std::string& uri, const std::string& body) {
-    const auto body_size = body.length();
-    std::unique_ptr<char[]> req_body (new char[body_size]);
-    memcpy(req_body.get(), body.c_str(), body_size);
-    http::HTTPRequest req(http::HTTPRequestType::POST,
-                          telegram_api_srv,
-                          _endpoint + uri);
-    req.setBody(std::move(req_body), body_size);
-    req.addHeader("content-type",   "application/json");
-    req.addHeader("content-length", std::to_string(body_size));
-    const auto response = httpRequest(_server, req);
-    if (!response)
-      return;
-    std::cout << response->code();
-    const void* buffer;
-    size_t size;
-    std::tie(buffer, size) = response->data();
-    const char* charbuf = static_cast<const char *>(buffer);
-    try {
-      _hub->newMessage(parse(charbuf));
-    } catch (parse_error e) {
-      if (e.code == 0) {
-        DEBUG << "Empty array from Telegram. Apparently timeout triggered";
-      } else {
-        ERROR << "Wrong answer received from server:" << std::string(e.what());
-      }
+  std::unique_ptr<http::HTTPResponse>
+  UpdateDispatcher::httpRequest(const http::HTTPRequest& req) {
+    /* The handler may run after the dispatcher is gone, so it only touches the result */
+    const auto result = std::make_shared<PollResult>();
+    result->done = false;
+    result->stopped = false;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (!_running)
+        return nullptr;
+      _poll = result;
     }
+    http::PerformHTTPRequest(_server, req, [result](std::unique_ptr<http::HTTPResponse>&& response, std::exception_ptr error) {
+        std::lock_guard<std::mutex> lock(result->mutex);
+        result->response = std::move(response);
+        result->error = error;
+        result->done = true;
+        result->ready.notify_all();
+      });
+    std::unique_lock<std::mutex> lock(result->mutex);
+    result->ready.wait(lock, [&result]() { return result->done || result->stopped; });
+    if (!result->done)
+      return nullptr;
+    if (result->error)
+      std::rethrow_exception(result->error);
+    return std::move(result->response);
   }
+#endif
 
-  static inline api::ChatType parseChatType(const std::string& str) {
-    const static std::map<const std::string, api::ChatType> types = {
-      {"private", api::ChatType::Private},
-      {"group", api::ChatType::Group},
-      {"supergroup", api::ChatType::Supergroup},
-      {"channel", api::ChatType::Channel},
-    };
-    return types.at(str);
+  namespace api {
+    ChatType parseChatType(const std::string& str) {
+      const static std::map<const std::string, ChatType> types = {
+        {"private", ChatType::Private},
+        {"group", ChatType::Group},
+        {"supergroup", ChatType::Supergroup},
+        {"channel", ChatType::Channel},
+      };
+      const auto& found = types.find(str);
+      /* Telegram adds new types from time to time */
+      return found == types.end() ? ChatType::Unknown : found->second;
+    }
   }
 
 #define __TG_API_CHECK_OR_ADD_STR(obj, field) obj.HasMember(field) ? obj[field].GetString() : ""
@@ -198,8 +675,8 @@ namespace telegram {
     const auto& json_chat = json_msg["chat"];
     assert(json_chat.HasMember("type"));
     assert(json_chat.HasMember("id"));
-    const api::Chat chat {json_chat["id"].GetInt(),
-                          parseChatType(json_chat["type"].GetString()),
+    const api::Chat chat {json_chat["id"].GetInt64(),
+                          api::parseChatType(json_chat["type"].GetString()),
                           __TG_API_CHECK_OR_ADD_STR(json_chat, "title")};
     assert(json_msg.HasMember("message_id"));
     assert(json_msg.HasMember("date"));
@@ -2,19 +2,56 @@
 #include "channel.hpp"
 #include "http.hpp"
 #include "rapidjson/document.h"
+#include "rapidjson/reader.h"
+#include "rapidjson/writer.h"
+#include <map>
+#include <set>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <thread>
+#include <deque>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <cstring>
+#include "eventloop.hpp"
 
 namespace telegram {
   const static std::string telegram_api_srv = "api.telegram.org";
   constexpr int telegram_api_port = 443;
+  constexpr size_t message_limit = 4096;                  /**< Maximum text length of one message */
+
+  /**
+   * Length of UTF-8 \c text as Telegram counts it, in UTF-16 code units
+   */
+  size_t textLength(const std::string& text);
+
+  /**
+   * Split UTF-8 \c text into parts of at most \c limit characters
+   *
+   * Parts are cut at a line or word boundary if there is one in the second
+   * half of the part, and never in the middle of a character.
+   */
+  std::vector<std::string> splitText(const std::string& text, size_t limit = message_limit);
 
   namespace api {
     enum class ChatType {
       Private,
       Group,
       Supergroup,
-      Channel
+      Channel,
+      Unknown                                             /**< Type unknown to this version */
     };
 
+    /**
+     * Convert "type" field of the chat
+     *
+     * \retval ChatType::Unknown for types not listed in \c ChatType
+     */
+    ChatType parseChatType(const std::string& str);
+
     struct Chat {
       const std::int64_t id;
       const ChatType type {};
@@ -39,6 +76,21 @@ namespace telegram {
       const User from {};
       const Chat chat {};
     };
+
+    /**
+     * Fields of an update needed to pass the message to hub
+     *
+     * The strings point right into the parsed buffer and are only valid
+     * while it exists.
+     */
+    struct MessageRef {
+      std::int64_t update_id;
+      bool has_message;
+      std::int64_t chat_id;
+      ChatType chat_type;
+      const char* from;
+      const char* text;
+    };
   }
 
   struct telegram_error: std::runtime_error {
@@ -54,32 +106,464 @@ namespace telegram {
     {};
   };
 
+  /**
+   * SAX handler picking the message fields from getUpdates answer
+   *
+   * Only the fields needed for hub messages are taken, the rest of the
+   * answer is skipped without building any DOM. With in-situ parsing the
+   * strings stay in the response buffer, so nothing is copied.
+   *
+   * Reads either getUpdates answer with a batch of updates or a single
+   * update delivered by webhook.
+   */
+  class UpdateReader: public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, UpdateReader> {
+    static constexpr size_t max_depth = 16;
+
+    const std::function<bool(const api::MessageRef&)>& _receiver; /**< Gets every update parsed, false stops parsing */
+    const bool _single;                            /**< Root object is the update itself */
+    const size_t _base;                            /**< Depth of container holding updates */
+    const char* _path[max_depth];                  /**< Keys the open containers are stored under */
+    size_t _depth;                                 /**< Number of open containers */
+    const char* _key;                              /**< Key of the current value */
+    api::MessageRef _update;                       /**< Update being read */
+    bool _ok;                                      /**< "ok" field of the answer */
+    int _error;                                    /**< "error_code" field of the answer */
+
+    /**
+     * Check if current value is stored in container under \c name on
+     * level \c depth
+     */
+    bool inside(size_t depth, const char* name) const {
+      return _depth > depth && _path[depth] && !strcmp(_path[depth], name);
+    }
+
+    bool is(const char* key) const { return _key && !strcmp(_key, key); };
+
+    /*
+     * Answer is {"result": [{"update_id": 1, "message": {"chat": {...}}}]}
+     * and webhook gets just {"update_id": 1, "message": {"chat": {...}}}
+     */
+    bool inUpdates() const { return _single || inside(1, "result"); };
+    bool inUpdate() const { return _depth == _base + 1 && inUpdates(); };
+    bool inMessage() const { return _depth == _base + 2 && inUpdates() && inside(_base + 1, "message"); };
+    bool inMessage(const char* object) const {
+      return _depth == _base + 3 && inUpdates() && inside(_base + 1, "message") && inside(_base + 2, object);
+    };
+
+    bool number(std::int64_t value) {
+      if (!_single && _depth == 1 && is("error_code"))
+        _error = value;
+      else if (inUpdate() && is("update_id"))
+        _update.update_id = value;
+      else if (inMessage("chat") && is("id"))
+        _update.chat_id = value;
+      _key = nullptr;
+      return true;
+    }
+  public:
+    UpdateReader(const std::function<bool(const api::MessageRef&)>& receiver, bool single) :
+      _receiver(receiver),
+      _single(single),
+      _base(single ? 0 : 2),
+      _depth(0),
+      _key(nullptr),
+      _update(),
+      _ok(single),
+      _error(0)
+    {}
+
+    bool ok() const { return _ok; };
+    int error() const { return _error; };
+
+    bool Default() { _key = nullptr; return true; };
+    bool Bool(bool value) {
+      if (!_single && _depth == 1 && is("ok"))
+        _ok = value;
+      _key = nullptr;
+      return true;
+    }
+    bool Int(int value) { return number(value); };
+    bool Uint(unsigned value) { return number(value); };
+    bool Int64(std::int64_t value) { return number(value); };
+    bool Uint64(std::uint64_t value) { return number(value); };
+    bool String(const Ch* str, rapidjson::SizeType, bool) {
+      if (inMessage() && is("text"))
+        _update.text = str;
+      else if (inMessage("from") && is("first_name"))
+        _update.from = str;
+      else if (inMessage("chat") && is("type"))
+        _update.chat_type = api::parseChatType(str);
+      _key = nullptr;
+      return true;
+    }
+    bool Key(const Ch* str, rapidjson::SizeType, bool) {
+      _key = str;
+      return true;
+    }
+    bool StartObject() {
+      if (_depth >= max_depth)
+        return false;
+      _path[_depth++] = _key;
+      _key = nullptr;
+      if (inMessage())
+        _update.has_message = true;
+      if (inUpdate())
+        _update = api::MessageRef {0, false, 0, api::ChatType::Private, "", ""};
+      return true;
+    }
+    bool EndObject(rapidjson::SizeType) {
+      if (inUpdate() && !_receiver(_update))
+        return false;
+      --_depth;
+      return true;
+    }
+    bool StartArray() {
+      if (_depth >= max_depth)
+        return false;
+      _path[_depth++] = _key;
+      _key = nullptr;
+      return true;
+    }
+    bool EndArray(rapidjson::SizeType) {
+      --_depth;
+      return true;
+    }
+  };
+
+  /**
+   * JSON writer to fill the request body in place
+   */
+  typedef rapidjson::Writer<http::HTTPRequest::BodyStream> BodyWriter;
+
+  class TgChannel;
+
+  /**
+   * getUpdates long poll shared by all the channels of one bot
+   *
+   * Telegram keeps a single update queue per bot and every poll confirms
+   * the updates before its offset, so channels of the same bot must not
+   * poll on their own. The dispatcher runs one poll per bot token and
+   * routes each update to the channels subscribed to its chat.
+   *
+   * Updates for chats nobody is subscribed to are confirmed only when all
+   * the channels created for the bot have subscribed, so a channel which
+   * activates later doesn't lose its messages.
+   */
+  class UpdateDispatcher {
+    /**
+     * Result of the poll request being waited for
+     */
+    struct PollResult {
+      std::mutex mutex;                                   /**< Lock for the fields */
+      std::condition_variable ready;                      /**< Notified on result or stop */
+      bool done;                                          /**< Request is complete */
+      bool stopped;                                       /**< Poll is stopped, the result isn't needed */
+      std::unique_ptr<http::HTTPResponse> response;       /**< Response if there is one */
+      std::exception_ptr error;                           /**< Error of the request */
+    };
+
+    const std::string _server;                            /**< Server address to connect to */
+    const std::string _endpoint;                          /**< API endpoint of the bot */
+    std::mutex _control;                                  /**< Serializes starting and stopping of the poll */
+    std::mutex _mutex;                                    /**< Lock for the subscriptions and \c _poll */
+    std::condition_variable _changed;                     /**< Notified on subscription changes and stop */
+    std::multimap<std::int64_t, TgChannel*> _channels;    /**< Subscribed channels by chat id */
+    std::set<TgChannel*> _expected;                       /**< Channels created but not subscribed yet */
+    size_t _generation;                                   /**< Incremented on every subscription change */
+    std::shared_ptr<PollResult> _poll;                    /**< getUpdates request in flight */
+    std::int64_t _offset;                                 /**< Next update id to request */
+    const std::string _state_file;                        /**< File to keep \c _offset in, empty to disable */
+    const bool _webhook;                                  /**< Receive updates with webhook instead of polling */
+    const int _port;                                      /**< Port to listen for webhook calls */
+    const std::string _address;                           /**< Address to listen for webhook calls */
+    const std::string _secret;                            /**< Expected secret token of webhook calls */
+    const std::string _url;                               /**< Public URL to register as webhook */
+    std::atomic_bool _running;                            /**< Poll thread should continue */
+    std::unique_ptr<std::thread> _thread;                 /**< Poll thread */
+    std::unique_ptr<http::HTTPServer> _listener;          /**< Webhook server */
+
+    void pollThread();                                    /**< getUpdates loop running until \c stop() */
+    void stop();                                          /**< Stop the poll or webhook server and wait for it */
+    void loadOffset();                                    /**< Read \c _offset from \c _state_file */
+    void saveOffset();                                    /**< Write \c _offset to \c _state_file atomically */
+
+    /**
+     * Parse updates from \c line in-situ and pass the messages to the
+     * channels
+     *
+     * Stops at the first update for a chat without subscribers while some
+     * channels are still expected to subscribe, the update and the rest
+     * aren't confirmed then.
+     *
+     * \param single \c line is a single update, not getUpdates answer
+     * \param[out] held Routing stopped before the end of \c line
+     * \retval number of updates routed and confirmed
+     * \throws telegram_error if \c line is malformed
+     */
+    size_t route(char* line, bool single, bool& held);
+
+    /**
+     * Parse getUpdates answer and pass the messages to the channels
+     *
+     * The answer is parsed in-situ, so \c line is modified.
+     *
+     * \retval true if some updates are held until more channels subscribe
+     */
+    bool dispatch(char* line);
+
+    void startWebhook();                                  /**< Start server and register it in Telegram */
+
+    /**
+     * Process webhook call with an update
+     *
+     * \retval HTTP code to answer
+     */
+    int webhook(http::RequestParser& request);
+
+    /**
+     * Run the request and wait for the response
+     *
+     * \retval nullptr if the poll is stopped before the response came
+     */
+    std::unique_ptr<http::HTTPResponse>
+    httpRequest(const http::HTTPRequest& req);
+  public:
+    /**
+     * \param token "botid:hash" line
+     * \param config Channel config with dispatcher options:
+     *               - state: file to persist the update offset between
+     *                 restarts of polling, "telegram_<botid>.offset" by
+     *                 default, "none" keeps the offset in memory only
+     *               - mode: "poll" (default) or "webhook"
+     *               - listen, listen_address: where to receive webhook
+     *                 calls, 127.0.0.1 by default as Telegram only calls
+     *                 HTTPS and the listener is expected behind a TLS proxy
+     *               - secret: token Telegram sends with webhook calls,
+     *                 required in webhook mode
+     *               - webhook_url: public URL to register, the hook is
+     *                 expected to be set up externally if it's empty
+     */
+    UpdateDispatcher(const std::string& token, const config::ConfigParser& config);
+    ~UpdateDispatcher();
+    UpdateDispatcher(const UpdateDispatcher&) = delete;
+    UpdateDispatcher& operator=(const UpdateDispatcher&) = delete;
+
+    /**
+     * Get the dispatcher for the bot, creating it if there is none
+     *
+     * \c config is only used when the dispatcher is created.
+     */
+    static std::shared_ptr<UpdateDispatcher> get(const std::string& botid, const std::string& hash,
+                                                 const config::ConfigParser& config);
+
+    /**
+     * Register \c channel which will subscribe later
+     *
+     * Updates for unknown chats aren't confirmed until all the expected
+     * channels subscribe.
+     */
+    void expect(TgChannel* channel);
+
+    /**
+     * Start passing messages from \c chat to \c channel
+     *
+     * The poll is started with the first subscription from the offset
+     * saved in the state file. In webhook mode the server is started
+     * instead.
+     *
+     * \throws channeling::activate_error if webhook mode has no secret
+     */
+    void subscribe(std::int64_t chat, TgChannel* channel);
+
+    /**
+     * Stop passing messages to \c channel
+     *
+     * The poll or the webhook server stops with the last subscription.
+     */
+    void unsubscribe(TgChannel* channel);
+  };
+
+  /**
+   * Token bucket rate limiter
+   *
+   * Gets \c rate tokens per second up to \c burst, every sent message
+   * takes one token.
+   */
+  class TokenBucket {
+  public:
+    typedef std::chrono::steady_clock clock;
+  private:
+    double _rate;                                         /**< Tokens per second */
+    double _burst;                                        /**< Maximum number of tokens */
+    double _tokens;                                       /**< Tokens available */
+    clock::time_point _updated;                           /**< Time of last refill */
+
+    void refill(clock::time_point now) {
+      if (now <= _updated)
+        return;
+      const std::chrono::duration<double> passed = now - _updated;
+      _tokens = std::min(_burst, _tokens + passed.count() * _rate);
+      _updated = now;
+    }
+  public:
+    TokenBucket(double rate, double burst) :
+      _rate(rate),
+      _burst(burst),
+      _tokens(burst),
+      _updated(clock::now())
+    {};
+
+    /**
+     * Take a token if there is one
+     */
+    bool take(clock::time_point now) {
+      refill(now);
+      if (_tokens < 1)
+        return false;
+      _tokens -= 1;
+      return true;
+    }
+
+    /**
+     * Time left until a token is available
+     */
+    clock::duration wait(clock::time_point now) {
+      refill(now);
+      if (_tokens >= 1)
+        return clock::duration::zero();
+      return std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>((1 - _tokens) / _rate));
+    }
+
+    /**
+     * Check if the bucket is refilled up to \c burst
+     */
+    bool full(clock::time_point now) {
+      refill(now);
+      return _tokens >= _burst;
+    }
+  };
+
+  /**
+   * Outgoing messages queue shared by all the channels of one bot
+   *
+   * Keeps up to \c concurrency sendMessage requests in flight. Messages to
+   * one chat are sent one by one in order of arrival. Sending follows the
+   * bot-wide and per-chat limits of Telegram with token buckets and backs
+   * the chat off for \c retry_after seconds when server answers 429.
+   * Transient failures (no answer, 5xx) are retried with growing delay,
+   * the message is dropped after \c max_attempts or on other errors.
+   * Chats with nothing to send are forgotten once their limit is restored.
+   * A message to an idle chat is sent at once. Short messages arriving
+   * while the chat waits for its turn are merged into one sendMessage if
+   * they come within a window after the first of them.
+   *
+   * All the state is only touched on the event loop thread.
+   */
+  class MessageSender: public std::enable_shared_from_this<MessageSender> {
+    typedef TokenBucket::clock clock;
+
+    /**
+     * Text waiting to be sent
+     */
+    struct Pending {
+      std::string text;                                   /**< Text of one or more merged messages */
+      clock::time_point open_until;                       /**< Others may join the text until then */
+      unsigned attempts;                                  /**< Failed attempts to send it */
+    };
+
+    /**
+     * Messages waiting for one chat
+     */
+    struct ChatQueue {
+      std::deque<Pending> messages;                       /**< Texts to send, oldest first */
+      TokenBucket limit;                                  /**< Per-chat rate limit */
+      bool busy;                                          /**< A request is in flight */
+      clock::time_point blocked_until;                    /**< Server asked to wait until */
+    };
+
+    const std::string _server;                            /**< Server address to connect to */
+    const std::string _endpoint;                          /**< API endpoint of the bot */
+    const size_t _concurrency;                            /**< Maximum requests in flight */
+    eventloop::EventLoop& _loop;                          /**< Loop running the requests */
+    std::map<std::int64_t, ChatQueue> _chats;             /**< Queues by chat id */
+    TokenBucket _limit;                                   /**< Bot-wide rate limit */
+    size_t _in_flight;                                    /**< Requests being sent */
+    bool _timer_set;                                      /**< \c pump() is scheduled */
+
+    /**
+     * Start as many requests as the limits allow
+     */
+    void pump();
+
+    /**
+     * Handle the result of sendMessage to \c chat
+     */
+    void complete(std::int64_t chat, std::unique_ptr<http::HTTPResponse>&& response, std::exception_ptr error);
+
+    /**
+     * Hold the first message of \c queue for a retry or drop it if it failed too many times
+     */
+    void retry(std::int64_t chat, ChatQueue& queue, const char* reason);
+
+    /**
+     * Run the request passing the result to \c handler on the loop thread
+     */
+    void request(const std::shared_ptr<http::HTTPRequest>& req, http::ResponseHandler&& handler);
+  public:
+    static constexpr size_t default_concurrency = 8;      /**< Requests in flight */
+    static constexpr double global_rate = 30;             /**< Messages per second for the bot */
+    static constexpr int retry_delay = 500;               /**< Milliseconds before the first retry */
+    static constexpr unsigned max_attempts = 5;           /**< Attempts to send a message */
+
+    /**
+     * \param token "botid:hash" line
+     */
+    MessageSender(const std::string& token, size_t concurrency = default_concurrency);
+    MessageSender(const MessageSender&) = delete;
+    MessageSender& operator=(const MessageSender&) = delete;
+
+    /**
+     * Get the sender for the bot, creating it if there is none
+     */
+    static std::shared_ptr<MessageSender> get(const std::string& botid, const std::string& hash);
+
+    /**
+     * Queue \c text to be sent to \c chat
+     *
+     * \param rate Messages per minute allowed for the chat, applied when the
+     *             chat is seen for the first time
+     * \param window Time after \c text is queued for other messages to
+     *               merge with it, zero to send it as is
+     */
+    void send(std::int64_t chat, double rate, std::chrono::milliseconds window, std::string&& text);
+  };
+
   class TgChannel: public channeling::Channel {
     const std::string _botid;                             /**< Bot id */
     const std::string _hash;                              /**< Bot access hash */
-    const std::string _server;                            /**< Server address to connect to */
-    const std::string _endpoint;                          /**< API endpoint to compute URI from */
     const int64_t _chat;                                  /**< Chat id to use */
-    mutable std::uint64_t _last_update_id;                /**< Last processed update id */
+    const std::shared_ptr<UpdateDispatcher> _dispatcher;  /**< Source of updates shared with the other channels of the bot */
+    const std::shared_ptr<MessageSender> _sender;         /**< Outgoing queue shared with the other channels of the bot */
+    const double _rate;                                   /**< Messages per minute allowed for the chat */
+    const std::chrono::milliseconds _coalesce;            /**< Window to merge short queued messages in */
     std::future<void> activate() override;
     static const channeling::ChannelCreatorImpl<TgChannel> creator;
 
     const messaging::message_ptr parse(const char* line) const override; /**< This would be useful if telegram read something from socket */
-    void pollThread() override;                           /**< Thread for telegram infinite loop */
 
     /**
-     * Perform a POST request to \c url with \c body
+     * Pass the message routed by \c UpdateDispatcher to the hub
      */
-    void apiRequest(const std::string& uri, const std::string& body);
-    const messaging::message_ptr buildTextMessage(const api::Message& msg) const;
+    void deliver(const api::MessageRef& msg);
+    friend class UpdateDispatcher;
 
-    std::unique_ptr<http::HTTPResponse>
-    httpRequest(const std::string& srv, const http::HTTPRequest& req) const;
+    const messaging::message_ptr buildTextMessage(const api::Message& msg) const;
+    const messaging::message_ptr buildTextMessage(const api::MessageRef& msg) const;
 
     /**
      * Check if the message is from chat which should be processed
      */
-    bool messageMatch(const api::Message& msg) const;
+    bool messageMatch(std::int64_t chat) const;
   public:
     explicit TgChannel(Hub::Hub *, const std::string&);
     ~TgChannel();
@@ -1,6 +1,14 @@
 #include "toxchannel.hpp"
 #include "messages.hpp"
 #include "logging.hpp"
+#include "fsutil.hpp"
+#include "net.hpp"
+#include <array>
+#include <mutex>
+#include <limits>
+#include <sstream>
+#include <algorithm>
+#include <netdb.h>
 
 namespace linux {
 #include <sys/types.h>
@@ -107,112 +115,524 @@ namespace toxChannel {
     return retval;
   }
 
-  ToxChannel::ToxChannel(Hub::Hub* hub, const std::string& config) :
-    channeling::Channel(hub, config),
-    _tox(toxInit(_config)),
-    wasConnected(false)
-  {}
+  std::vector<BootstrapNode> parseBootstrapNodes(const std::string& list) {
+    std::vector<BootstrapNode> nodes;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+      if (item.empty())
+        continue;
+      /* Address may be IPv6, so split from the right */
+      const auto key_sep = item.rfind(':');
+      const auto port_sep = key_sep == std::string::npos || key_sep == 0 ? std::string::npos : item.rfind(':', key_sep - 1);
+      if (port_sep == std::string::npos || port_sep == 0)
+        throw config::option_error("Bootstrap node should be address:port:key, got " + item);
+      const auto& key = item.substr(key_sep + 1);
+      if (key.length() != TOX_PUBLIC_KEY_SIZE * 2)
+        throw config::option_error("Wrong bootstrap node key length in " + item);
+      int port;
+      try {
+        port = std::stoi(item.substr(port_sep + 1, key_sep - port_sep - 1));
+      } catch (const std::logic_error&) {
+        throw config::option_error("Wrong bootstrap node port in " + item);
+      }
+      if (port <= 0 || port > 65535)
+        throw config::option_error("Wrong bootstrap node port in " + item);
+      std::string address = item.substr(0, port_sep);
+      /* getaddrinfo() in Tox doesn't take IPv6 in brackets */
+      if (address.size() > 2 && address.front() == '[' && address.back() == ']')
+        address = address.substr(1, address.size() - 2);
+      nodes.push_back(BootstrapNode {address, static_cast<uint16_t>(port), key, 0, false});
+    }
+    return nodes;
+  }
 
-  std::future<void> ToxChannel::activate() {
-    return std::async(std::launch::async, [this]() {
-      if (_active)
+  void rankBootstrapNodes(std::vector<BootstrapNode>& nodes, const std::string& stats) {
+    std::stringstream ss(stats);
+    std::string key;
+    uint32_t connect_ms;
+    bool failed;
+    while (ss >> key >> connect_ms >> failed)
+      for (auto& node : nodes)
+        if (node.key == key) {
+          node.connect_ms = connect_ms;
+          node.failed = failed;
+        }
+    std::stable_sort(nodes.begin(), nodes.end(), [](const BootstrapNode& a, const BootstrapNode& b) {
+        if (a.failed != b.failed)
+          return b.failed;
+        /* Unknown nodes go after the known good ones */
+        if ((a.connect_ms == 0) != (b.connect_ms == 0))
+          return b.connect_ms == 0;
+        return a.connect_ms < b.connect_ms;
+      });
+  }
+
+  std::string formatBootstrapStats(const std::vector<BootstrapNode>& nodes) {
+    std::stringstream ss;
+    for (const auto& node : nodes)
+      if (node.connect_ms != 0 || node.failed)
+        ss << node.key << " " << node.connect_ms << " " << node.failed << "\n";
+    return ss.str();
+  }
+
+  std::shared_ptr<ToxInstance> ToxInstance::get(const config::ConfigParser& config) {
+    static std::mutex mutex;
+    static std::map<const std::string, std::weak_ptr<ToxInstance> > instances;
+    const std::string datafile = config.get("datafile", "");
+    std::lock_guard<std::mutex> lock(mutex);
+    /* Without datafile there is nothing to share the identity by */
+    if (datafile.empty())
+      return std::make_shared<ToxInstance>(config);
+    auto instance = instances[datafile].lock();
+    if (!instance) {
+      instance = std::make_shared<ToxInstance>(config);
+      instances[datafile] = instance;
+    }
+    return instance;
+  }
+
+  ToxInstance::ToxInstance(const config::ConfigParser& config) :
+    _tox(toxInit(config)),
+    _loop(eventloop::EventLoop::shared()),
+    _datafile(config.get("datafile", "")),
+    _nickname(config.get("nickname", defaultBotName)),
+    _status(config.get("status_message", defaultStatusMessage)),
+    _bootstrap_stats(config.get("bootstrap_stats", _datafile.empty() ? "" : (_datafile + ".nodes").c_str())),
+    _bootstrap_parallel(std::max(1, static_cast<int>(config.get("bootstrap_parallel", "4")))),
+    _bootstrap_timeout(static_cast<int>(config.get("bootstrap_timeout", "10"))),
+    _checkpoint(static_cast<int>(config.get("checkpoint", "60"))),
+    _queue_limit(static_cast<int>(config.get("queue", "100"))),
+    _timer(0),
+    _started(false),
+    _connected(false),
+    _next_node(0),
+    _bootstrap_timer(0),
+    _checkpoint_timer(0),
+    _alive(std::make_shared<bool>(true))
+  {
+    /* Single node options are kept for old configs */
+    const std::string single = std::string(config.get("bootstrap_address", defaultBootstrapAddress)) + ":" +
+                               std::string(config.get("bootstrap_port", defaultBootstrapPort)) + ":" +
+                               std::string(config.get("bootstrap_key", defaultBootstrapKey));
+    _nodes = parseBootstrapNodes(config.get("bootstrap_nodes", single.c_str()));
+    if (_nodes.empty())
+      throw config::option_error("No bootstrap nodes");
+    std::string stats;
+    try {
+      if (!_bootstrap_stats.empty() && fsutil::readFile(_bootstrap_stats, stats))
+        DEBUG << "Loaded bootstrap node statistics from " << _bootstrap_stats;
+    } catch (const fsutil::fs_error& e) {
+      WARNING << "Can't read bootstrap node statistics: " << e.what();
+    }
+    rankBootstrapNodes(_nodes, stats);
+  }
+
+  ToxInstance::~ToxInstance() {
+    if (_loop.inLoop()) {
+      stop();
+    } else {
+      /* Iteration and queued messages use the instance, so stop it on the loop after them */
+      std::promise<void> stopped;
+      _loop.post([this, &stopped]() {
+        stop();
+        stopped.set_value();
+      });
+      stopped.get_future().wait();
+    }
+    if (_writing.valid() && !_writing.get())
+      _saved.clear();
+    if (_stats_writing.valid())
+      _stats_writing.wait();
+    if (!_datafile.empty()) {
+      const auto& data = savedata();
+      if (data != _saved && write(data))
+        DEBUG << "#tox " << _datafile << " Successfully saved " << data.size() << " bytes of tox data";
+    }
+    tox_kill(_tox);
+  }
+
+  std::string ToxInstance::savedata() const {
+    std::string data(tox_get_savedata_size(_tox), '\0');
+    tox_get_savedata(_tox, reinterpret_cast<uint8_t *>(&data[0]));
+    return data;
+  }
+
+  bool ToxInstance::write(const std::string& data) const {
+    try {
+      fsutil::atomicWrite(_datafile, data);
+      return true;
+    } catch (const fsutil::fs_error& e) {
+      ERROR << "Can't save tox data: " << e.what();
+      return false;
+    }
+  }
+
+  void ToxInstance::checkpoint() {
+    _checkpoint_timer = _loop.schedule(_checkpoint, [this]() { checkpoint(); });
+    if (_writing.valid()) {
+      /* Don't pile the writes up if the disk is slow */
+      if (_writing.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
         return;
-      _pipeRunning = true;
-      toxStart();
-      _thread = std::make_unique<std::thread>(std::thread(&ToxChannel::pollThread, this));
-      _active = true;
+      /* Retry the failed write on the next checkpoint */
+      if (!_writing.get())
+        _saved.clear();
+    }
+    auto data = std::make_shared<std::string>(savedata());
+    if (*data == _saved)
+      return;
+    _saved = *data;
+    TRACE << "#tox " << _datafile << " checkpoint of " << data->size() << " bytes";
+    _writing = std::async(std::launch::async, [this, data]() { return write(*data); });
+  }
+
+  std::future<void> ToxInstance::subscribe(uint32_t conference, ToxChannel* channel) {
+    auto ready = std::make_shared<std::promise<void> >();
+    auto result = ready->get_future();
+    _loop.post([this, conference, channel, ready]() {
+      _channels.emplace(conference, channel);
+      try {
+        if (!_started)
+          start();
+      } catch (...) {
+        ready->set_exception(std::current_exception());
+        return;
+      }
+      if (_connected)
+        joinConferences();
+      ready->set_value();
     });
+    return result;
   }
 
-  void ToxChannel::incoming(const messaging::message_ptr&& msg) {
-    if (msg->type() == messaging::MessageType::Text) {
-      const auto textmsg = messaging::TextMessage::fromMessage(msg);
-      DEBUG << "#tox " << _name << " " << textmsg->data();
-      static uint8_t msg[TOX_MAX_MESSAGE_LENGTH];
-      const auto len = snprintf(reinterpret_cast<char *>(msg), TOX_MAX_MESSAGE_LENGTH,
-                                "[%s]: %s",
-                                textmsg->user()->name().c_str(), textmsg->data().c_str());
+  std::future<void> ToxInstance::connected() {
+    auto ready = std::make_shared<std::promise<void> >();
+    auto result = ready->get_future();
+    _loop.post([this, ready]() {
+      if (_connected)
+        ready->set_value();
+      else
+        _waiting.push_back(std::move(*ready));
+    });
+    return result;
+  }
+
+  void ToxInstance::unsubscribe(ToxChannel* channel) {
+    const auto remove = [this, channel]() {
+      for (auto it = _channels.begin(); it != _channels.end(); )
+        if (it->second == channel)
+          it = _channels.erase(it);
+        else
+          ++it;
+    };
+    if (_loop.inLoop()) {
+      remove();
+      return;
+    }
+    std::promise<void> removed;
+    _loop.post([&remove, &removed]() {
+      remove();
+      removed.set_value();
+    });
+    removed.get_future().wait();
+  }
+
+  void ToxInstance::send(uint32_t conference, TOX_MESSAGE_TYPE type, std::string&& text) {
+    if (text.length() > TOX_MAX_MESSAGE_LENGTH)
+      text.resize(TOX_MAX_MESSAGE_LENGTH);
+    /* std::function needs copyable closure, so the text is moved in via shared_ptr */
+    auto message = std::make_shared<std::string>(std::move(text));
+    _loop.post([this, conference, type, message]() {
+      if (_connected) {
+        sendNow(conference, type, *message);
+        return;
+      }
+      if (_queue_limit == 0)
+        return;
+      if (_outgoing.size() >= _queue_limit) {
+        WARNING << "#tox " << _datafile << " is not connected, dropping the oldest queued message";
+        _outgoing.pop_front();
+      }
+      _outgoing.push_back(Outgoing {conference, type, std::move(*message)});
+    });
+  }
+
+  void ToxInstance::sendNow(uint32_t conference, TOX_MESSAGE_TYPE type, const std::string& text) {
+    const auto data = reinterpret_cast<const uint8_t *>(text.data());
 #ifdef CTOXCORE
-      tox_conference_send_message(_tox, 0, TOX_MESSAGE_TYPE_NORMAL, msg, len, NULL);
+    tox_conference_send_message(_tox, conference, type, data, text.length(), NULL);
 #else
-      tox_group_message_send(_tox, 0, msg, len);
+    if (type == TOX_MESSAGE_TYPE_ACTION)
+      tox_group_action_send(_tox, conference, data, text.length());
+    else
+      tox_group_message_send(_tox, conference, data, text.length());
 #endif
-    } else if (msg->type() == messaging::MessageType::Action) {
-      const auto actionmsg = messaging::ActionMessage::fromMessage(msg);
+  }
 
-      DEBUG << "#tox " << _name << " performs action " << actionmsg->data();
-      static uint8_t msg[TOX_MAX_MESSAGE_LENGTH];
-      const auto len = snprintf(reinterpret_cast<char *>(msg), TOX_MAX_MESSAGE_LENGTH,
-                                "[%s]: %s",
-                                actionmsg->user()->name().c_str(), actionmsg->data().c_str());
+  void ToxInstance::joinConferences() {
+    if (_channels.empty())
+      return;
+    /* Conference numbers are given in order of creation */
+    const uint32_t last = _channels.rbegin()->first;
 #ifdef CTOXCORE
-      tox_conference_send_message(_tox, 0, TOX_MESSAGE_TYPE_ACTION, msg, len, NULL);
+    while (tox_conference_get_chatlist_size(_tox) <= last)
+      tox_conference_new(_tox, NULL);
 #else
-      tox_group_action_send(_tox, 0, msg, len);
+    while (tox_count_chatlist(_tox) <= last)
+      tox_add_groupchat(_tox);
 #endif
+  }
 
-    } else {
-      throw std::runtime_error("Unknown message type");
+  size_t ToxInstance::bootstrap() {
+    if (_bootstrap_timer)
+      _loop.cancel(_bootstrap_timer);
+    _round.clear();
+    _round_started = std::chrono::steady_clock::now();
+    size_t accepted = 0;
+    /* Forget the finished lookups */
+    _resolving.erase(std::remove_if(_resolving.begin(), _resolving.end(), [](const std::future<void>& lookup) {
+          return lookup.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        }), _resolving.end());
+    for (size_t i = 0; i < _bootstrap_parallel && i < _nodes.size(); ++i) {
+      const auto number = (_next_node + i) % _nodes.size();
+      if (networking::is_ip_literal(_nodes[number].address)) {
+        if (!bootstrapNode(number, _nodes[number].address))
+          continue;
+      } else {
+        resolveNode(number);
+      }
+      _round.push_back(number);
+      ++accepted;
+    }
+    _next_node = (_next_node + _bootstrap_parallel) % _nodes.size();
+    if (_nodes.size() <= _bootstrap_parallel)
+      _next_node = 0;
+    _bootstrap_timer = _loop.schedule(_bootstrap_timeout, [this]() {
+        _bootstrap_timer = 0;
+        if (_connected)
+          return;
+        for (const auto number : _round)
+          _nodes[number].failed = true;
+        WARNING << "Tox is not connected in " << _bootstrap_timeout.count() << "s, trying next nodes";
+        bootstrap();
+      });
+    return accepted;
+  }
+
+  bool ToxInstance::bootstrapNode(size_t number, const std::string& address) {
+    auto& node = _nodes[number];
+    TOX_ERR_BOOTSTRAP result;
+    tox_bootstrap(_tox, address.c_str(), node.port,
+                  reinterpret_cast<const uint8_t *>(util::hex2bin(node.key).c_str()),
+                  &result);
+    if (result) {
+      WARNING << "Can't bootstrap from " << node.address << ":" << node.port << ", error " << result;
+      node.failed = true;
+      return false;
     }
+    DEBUG << "Bootstrapping from " << node.address << ":" << node.port;
+    return true;
   }
 
-  void ToxChannel::pollThread() {
-    DEBUG << "Starting tox thread";
-    while (_pipeRunning) {
+  /**
+   * Get numeric address of \c host, IPv4 one if there is
+   *
+   * \retval empty string if the name isn't resolved
+   */
+  static std::string resolveHost(const std::string& host) {
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    struct addrinfo* found = nullptr;
+    if (getaddrinfo(host.c_str(), nullptr, &hints, &found) != 0)
+      return "";
+    const struct addrinfo* best = found;
+    for (auto item = found; item; item = item->ai_next)
+      if (item->ai_family == AF_INET) {
+        best = item;
+        break;
+      }
+    char address[NI_MAXHOST];
+    const bool ok = best && getnameinfo(best->ai_addr, best->ai_addrlen, address, sizeof(address), nullptr, 0, NI_NUMERICHOST) == 0;
+    freeaddrinfo(found);
+    return ok ? address : "";
+  }
+
+  void ToxInstance::resolveNode(size_t number) {
+    const auto host = _nodes[number].address;
+    const auto alive = _alive;
+    const auto loop = &_loop;
+    /* The lookup only touches the instance on the loop and if it's not stopped */
+    _resolving.push_back(std::async(std::launch::async, [this, number, host, alive, loop]() {
+          const auto address = resolveHost(host);
+          loop->post([this, number, host, alive, address]() {
+              if (!*alive)
+                return;
+              if (address.empty()) {
+                WARNING << "Can't resolve tox bootstrap node " << host;
+                _nodes[number].failed = true;
+                return;
+              }
+              bootstrapNode(number, address);
+            });
+        }));
+  }
+
+  void ToxInstance::bootstrapDone() {
+    if (_bootstrap_timer)
+      _loop.cancel(_bootstrap_timer);
+    _bootstrap_timer = 0;
+    if (_round.empty())
+      return;
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>
+                           (std::chrono::steady_clock::now() - _round_started).count();
+    /* Tox doesn't tell which node let it in, so the whole round gets the time */
+    for (const auto number : _round) {
+      _nodes[number].connect_ms = std::max<uint32_t>(1, elapsed);
+      _nodes[number].failed = false;
+    }
+    _round.clear();
+    DEBUG << "Tox is connected in " << elapsed << "ms";
+    if (_bootstrap_stats.empty())
+      return;
+    /* Connections are rare, the next one saves the stats if the disk is that slow */
+    if (_stats_writing.valid() && _stats_writing.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+      return;
+    const std::string path = _bootstrap_stats;
+    _stats_writing = std::async(std::launch::async, [path, stats = formatBootstrapStats(_nodes)]() {
+        try {
+          fsutil::atomicWrite(path, stats);
+        } catch (const fsutil::fs_error& e) {
+          WARNING << "Can't save bootstrap node statistics: " << e.what();
+        }
+      });
+  }
+
+  void ToxInstance::iterate() {
+    const auto started = std::chrono::steady_clock::now();
 #ifdef CTOXCORE
-      tox_iterate(_tox, this);
+    tox_iterate(_tox, this);
 #else
-      tox_iterate(_tox);
+    tox_iterate(_tox);
 #endif
-      auto wait = tox_iteration_interval(_tox);
-      std::this_thread::sleep_for( std::chrono::milliseconds (wait));
+    if (!_connected && (TOX_CONNECTION_NONE != tox_self_get_connection_status(_tox))) {
+      std::array<uint8_t, TOX_ADDRESS_SIZE> address;
+      tox_self_get_address (_tox, address.data ());
+      DEBUG << "Tox is connected with id " << util::ToxId2HR (address);
+      _connected = true;
+      bootstrapDone();
+      joinConferences();
+      if (!_outgoing.empty())
+        DEBUG << "#tox " << _datafile << " sending " << _outgoing.size() << " messages queued before connection";
+      for (const auto& message : _outgoing)
+        sendNow(message.conference, message.type, message.text);
+      _outgoing.clear();
+      for (auto& waiting : _waiting)
+        waiting.set_value();
+      _waiting.clear();
     }
+    /* Count the interval from the start of this iteration to keep the pace */
+    const auto left = std::chrono::duration_cast<std::chrono::milliseconds>
+                        (started + std::chrono::milliseconds(tox_iteration_interval(_tox)) - std::chrono::steady_clock::now());
+    _timer = _loop.schedule(std::max(left, std::chrono::milliseconds(0)), [this]() { iterate(); });
   }
 
-  ToxChannel::~ToxChannel() {
-    if (_thread) {
-      _pipeRunning = false;
-      _thread->join();
-    }
-    try {
-      const auto dataFileName = std::string(_config["datafile"]).c_str();
-      const size_t filesize = tox_get_savedata_size(_tox);
-      const auto toxData = std::make_unique<uint8_t[]>(filesize);
-      tox_get_savedata(_tox, toxData.get());
-      const int toxfd = linux::open(dataFileName, O_WRONLY | O_CREAT, 0644);
-      int result = linux::write(toxfd, toxData.get(), filesize);
-      if (result < 0)
-        throw config::option_error("Error writing file");
-      DEBUG << "#tox " << _name << " Successfully saved " << result << " bytes of tox data";
-      result = linux::close(toxfd);
-      if (result < 0)
-        throw config::option_error("Error closing file");
-    } catch (config::option_error e) {
-      DEBUG << "Can't save tox data: " << e.what();
-    }
-    tox_kill(_tox);
+  void ToxInstance::stop() {
+    *_alive = false;
+    if (_timer)
+      _loop.cancel(_timer);
+    _timer = 0;
+    if (_checkpoint_timer)
+      _loop.cancel(_checkpoint_timer);
+    _checkpoint_timer = 0;
+    if (_bootstrap_timer)
+      _loop.cancel(_bootstrap_timer);
+    _bootstrap_timer = 0;
+    for (auto& waiting : _waiting)
+      waiting.set_exception(std::make_exception_ptr(channeling::activate_error(_datafile, ERR_TOX_INIT + ": stopped before connection")));
+    _waiting.clear();
+  }
+
+  void ToxInstance::route(uint32_t conference, TOX_MESSAGE_TYPE type, const std::shared_ptr<const messaging::User>& user,
+                          const std::string& text) {
+    DEBUG << "tox Group msg " << user->name() << "> " << text;
+    const auto& subscribers = _channels.equal_range(conference);
+    if (subscribers.first == subscribers.second)
+      DEBUG << "No channel for tox conference " << conference;
+    for (auto it = subscribers.first; it != subscribers.second; ++it)
+      it->second->deliver(type, user, text);
+  }
+
+  std::string ToxInstance::peerName(uint32_t conference, uint32_t number) const {
+#ifdef CTOXCORE
+    TOX_ERR_CONFERENCE_PEER_QUERY error;
+    const auto nameLen = tox_conference_peer_get_name_size(_tox, conference, number, &error);
+    if (error != TOX_ERR_CONFERENCE_PEER_QUERY_OK)
+      return "";
+    std::string name(nameLen, '\0');
+    tox_conference_peer_get_name(_tox, conference, number, reinterpret_cast<uint8_t *>(&name[0]), NULL);
+    return name;
+#else
+    uint8_t nameBuffer[TOX_MAX_NAME_LENGTH];
+    const auto nameLen = tox_group_peername(_tox, conference, number, nameBuffer);
+    return std::string(reinterpret_cast<const char *>(nameBuffer), nameLen < 0 ? 0 : nameLen);
+#endif
   }
 
-  void ToxChannel::friendRequestCallback(Tox* tox, const uint8_t* public_key, const uint8_t* data, size_t length, void* userdata) {
+  void ToxInstance::setPeer(uint32_t conference, uint32_t number, std::string&& name) {
+    auto& peers = _peers[conference];
+    if (number >= peers.size())
+      peers.resize(number + 1);
+    const bool self = name == _nickname;
+    peers[number] = Peer {std::make_shared<const messaging::User>(messaging::User(std::move(name))), self};
+  }
+
+  void ToxInstance::refreshPeers(uint32_t conference) {
+#ifdef CTOXCORE
+    const uint32_t count = tox_conference_peer_count(_tox, conference, NULL);
+#else
+    const int peers_count = tox_group_number_peers(_tox, conference);
+    const uint32_t count = peers_count < 0 ? 0 : peers_count;
+#endif
+    auto& peers = _peers[conference];
+    peers.clear();
+    for (uint32_t number = 0; number < count; ++number)
+      setPeer(conference, number, peerName(conference, number));
+  }
+
+  const ToxInstance::Peer& ToxInstance::peer(uint32_t conference, uint32_t number) {
+    auto& peers = _peers[conference];
+    if (number >= peers.size() || !peers[number].user)
+      setPeer(conference, number, peerName(conference, number));
+    return peers[number];
+  }
+
+  void ToxInstance::friendRequestCallback(Tox* tox, const uint8_t* public_key, const uint8_t* data, size_t length, void* userdata) {
     TOX_ERR_FRIEND_ADD friend_error;
-    const auto channel = static_cast<ToxChannel *>(userdata);
     const auto friendNum = tox_friend_add_norequest(tox, public_key, &friend_error);     /** @todo check friend_error */
     DEBUG << "tox id with data" << data << " of " << length << " bytes " << util::ToxId2HR<TOX_ADDRESS_SIZE>(public_key) << " wants to be your friend. Added with #" << friendNum;
   }
 
-  void ToxChannel::messageCallback(Tox* tox, uint32_t friendnumber, TOX_MESSAGE_TYPE type, const uint8_t* message, size_t length, void* userdata) {
-    const auto channel = static_cast<ToxChannel *>(userdata);
+  void ToxInstance::messageCallback(Tox* tox, uint32_t friendnumber, TOX_MESSAGE_TYPE type, const uint8_t* message, size_t length, void* userdata) {
+    const auto instance = static_cast<ToxInstance *>(userdata);
     const auto buffer = std::unique_ptr<char[]>(new char[length + 1]);
     snprintf(buffer.get(), length + 1, "%s", message);
     switch (type) {
     case TOX_MESSAGE_TYPE_NORMAL:
       DEBUG << "Message from friend #" << friendnumber << "> " << buffer.get();
       if (util::strncmp(cmd_invite, buffer.get(), length) == 0) {
+        /* Invite to all the conferences bridged by this instance */
+        uint32_t last = std::numeric_limits<uint32_t>::max();
+        for (const auto& item : instance->_channels) {
+          if (item.first == last)
+            continue;
+          last = item.first;
 #ifdef CTOXCORE
-        tox_conference_invite(tox, friendnumber, 0, NULL);
+          tox_conference_invite(tox, friendnumber, item.first, NULL);
 #else
-        tox_invite_friend(tox, friendnumber, 0);
+          tox_invite_friend(tox, friendnumber, item.first);
 #endif
+        }
       }
       break;
     case TOX_MESSAGE_TYPE_ACTION:
@@ -224,87 +644,38 @@ namespace toxChannel {
   }
 
 #ifdef CTOXCORE
-  void ToxChannel::groupMessageCallback (Tox* tox, uint32_t conference_number, uint32_t peer_number, TOX_MESSAGE_TYPE type, const uint8_t* message, size_t length, void* user_data) {
-    const auto channel = static_cast<ToxChannel *>(user_data);
-
-    const auto nameLen = tox_conference_peer_get_name_size(tox, conference_number, peer_number, NULL);
-    const auto nameBuffer = std::unique_ptr<uint8_t[]>(new uint8_t[nameLen + 1]);
-    tox_conference_peer_get_name(tox, conference_number, peer_number, nameBuffer.get(), NULL);
-    const auto name = std::unique_ptr<char[]>(new char[nameLen + 3]);
-    snprintf(name.get(), nameLen + 1, "%.*s", static_cast<int>(nameLen), nameBuffer.get());
-
-    const auto msg = std::unique_ptr<char[]>(new char[length + 2]);
-    snprintf(msg.get(),	 length + 1,  "%s",   message);
-
-    std::shared_ptr<messaging::Message> newMessage;
-    if (std::string(name.get()) != std::string(channel->_config.get("nickname", defaultBotName))) {
-      switch (type) {
-      case TOX_MESSAGE_TYPE_NORMAL:
-        newMessage = std::make_shared<messaging::TextMessage>
-                       (channel->_id,
-                       std::make_shared<const messaging::User>(messaging::User(name.get())),
-                       msg.get());
-        break;
-      case TOX_MESSAGE_TYPE_ACTION:
-        newMessage = std::make_shared<messaging::ActionMessage>
-                       (channel->_id,
-                       std::make_shared<const messaging::User>(messaging::User(name.get())),
-                       msg.get());
-        break;
-      default:
-        throw std::runtime_error("Unknown tox message type");
-      }
+  void ToxInstance::groupMessageCallback (Tox* tox, uint32_t conference_number, uint32_t peer_number, TOX_MESSAGE_TYPE type, const uint8_t* message, size_t length, void* user_data) {
+    const auto instance = static_cast<ToxInstance *>(user_data);
+    const auto& peer = instance->peer(conference_number, peer_number);
+    if (!peer.self)
+      instance->route(conference_number, type, peer.user, std::string(reinterpret_cast<const char *>(message), length));
+  }
 
-      {
-        DEBUG << "tox Group msg ";
-        const auto tmsg = std::dynamic_pointer_cast<messaging::TextMessage>(newMessage);
-        const auto amsg = std::dynamic_pointer_cast<messaging::ActionMessage>(newMessage);
-        if (tmsg) {
-          ERROR << tmsg->user()->name() << "> " << tmsg->data();
-        } else if (amsg) {
-          ERROR << amsg->user()->name() << "> " << amsg->data();
-        }
-      }
+  void ToxInstance::peerNameCallback(Tox* tox, uint32_t conference_number, uint32_t peer_number, const uint8_t* name, size_t length, void* user_data) {
+    const auto instance = static_cast<ToxInstance *>(user_data);
+    instance->setPeer(conference_number, peer_number, std::string(reinterpret_cast<const char *>(name), length));
+  }
 
-      channel->_hub->newMessage(std::move(newMessage));
-    }
+  void ToxInstance::peerListCallback(Tox* tox, uint32_t conference_number, void* user_data) {
+    /* Peer numbers are shifted when somebody leaves, so reread the whole list */
+    static_cast<ToxInstance *>(user_data)->refreshPeers(conference_number);
   }
 #else
-  template <typename MsgType>
-  void ToxChannel::groupMessageCallback(Tox* tox, int32_t groupnumber, int32_t peernumber, const uint8_t* message, uint16_t length, void* userdata) {
-    const auto channel = static_cast<ToxChannel *>(userdata);
-
-    const auto nameBuffer = std::unique_ptr<uint8_t[]>(new uint8_t[TOX_MAX_NAME_LENGTH]);
-    const auto nameLen = tox_group_peername(tox, groupnumber, peernumber, nameBuffer.get());
-    const auto name = std::unique_ptr<char[]>(new char[nameLen + 2]);
-    snprintf(name.get(), nameLen + 1, "%.*s", static_cast<int>(nameLen), nameBuffer.get());
-
-    const auto msg = std::unique_ptr<char[]>(new char[length + 2]);
-    snprintf(msg.get(),	 length + 1,  "%s",   message);
-
-    if (std::string(name.get()) != std::string(channel->_config.get("nickname", defaultBotName))) {
-      const auto newMessage = std::make_shared<MsgType>(channel->_id,
-                                                        std::make_shared<const messaging::User>(messaging::User(name.get())),
-                                                        msg.get());
-      DEBUG << "tox Group msg " << newMessage->user()->name() << "> " << newMessage->data();
-      channel->_hub->newMessage(std::move(newMessage));
-    }
+  template <TOX_MESSAGE_TYPE type>
+  void ToxInstance::groupMessageCallback(Tox* tox, int32_t groupnumber, int32_t peernumber, const uint8_t* message, uint16_t length, void* userdata) {
+    const auto instance = static_cast<ToxInstance *>(userdata);
+    const auto& peer = instance->peer(groupnumber, peernumber);
+    if (!peer.self)
+      instance->route(groupnumber, type, peer.user, std::string(reinterpret_cast<const char *>(message), length));
   }
-#endif
 
-  const messaging::message_ptr ToxChannel::parse(const char* line) const
-  {
-    const std::string s(line);
-    const auto name = s.substr(0, s.find(":"));
-    const auto text = s.substr(s.find(":"), s.length());
-
-    const auto msg = std::make_shared<const messaging::TextMessage>(_id,
-                                                                    std::make_shared<const messaging::User>(messaging::User(name.c_str())),
-                                                                    text.c_str());
-    return msg;
+  void ToxInstance::namelistCallback(Tox* tox, int groupnumber, int peernumber, uint8_t change, void* userdata) {
+    /* Peer numbers are shifted when somebody leaves, so reread the whole list */
+    static_cast<ToxInstance *>(userdata)->refreshPeers(groupnumber);
   }
+#endif
 
-  int ToxChannel::toxStart() {
+  void ToxInstance::start() {
     TOX_ERR_SET_INFO result;
 
     //std::unique_ptr<uint8_t[]> pubKey(new uint8_t[TOX_CLIENT_ID_SIZE]);
@@ -312,66 +683,106 @@ namespace toxChannel {
     tox_callback_friend_request(_tox, friendRequestCallback);
     tox_callback_friend_message(_tox, messageCallback);
     tox_callback_conference_message(_tox, groupMessageCallback);
+    tox_callback_conference_peer_name(_tox, peerNameCallback);
+    tox_callback_conference_peer_list_changed(_tox, peerListCallback);
 #else
     tox_callback_friend_request(_tox, friendRequestCallback, this);
     tox_callback_friend_message(_tox, messageCallback, this);
-    tox_callback_group_message(_tox, groupMessageCallback<const messaging::TextMessage>, this);
-    tox_callback_group_action(_tox, groupMessageCallback<const messaging::ActionMessage>, this);
+    tox_callback_group_message(_tox, groupMessageCallback<TOX_MESSAGE_TYPE_NORMAL>, this);
+    tox_callback_group_action(_tox, groupMessageCallback<TOX_MESSAGE_TYPE_ACTION>, this);
+    tox_callback_group_namelist_change(_tox, namelistCallback, this);
 #endif
 
-    const std::string nick = _config.get("nickname", defaultBotName);
-    const uint8_t* nickData = reinterpret_cast<const uint8_t *>(nick.c_str());
-    tox_self_set_name(_tox, nickData, nick.length(), &result);
+    const uint8_t* nickData = reinterpret_cast<const uint8_t *>(_nickname.c_str());
+    tox_self_set_name(_tox, nickData, _nickname.length(), &result);
     if (result)
-      throw channeling::activate_error(_name, ERR_TOX_INIT + "(tox_set_name)");
+      throw channeling::activate_error(_datafile, ERR_TOX_INIT + "(tox_set_name)");
 
-    const std::string statusMsg = _config.get("status_message", defaultStatusMessage);
-    const uint8_t* statusData = reinterpret_cast<const uint8_t *>(statusMsg.c_str());
+    const uint8_t* statusData = reinterpret_cast<const uint8_t *>(_status.c_str());
 
-    tox_self_set_status_message(_tox, statusData, statusMsg.length(), &result);
+    tox_self_set_status_message(_tox, statusData, _status.length(), &result);
     if (result)
-      throw channeling::activate_error(_name, ERR_TOX_INIT + "(tox_set_status_message)");
+      throw channeling::activate_error(_datafile, ERR_TOX_INIT + "(tox_set_status_message)");
 
     tox_self_set_status(_tox, defaultBotStatus);
 
     if (tox_self_get_connection_status(_tox) == TOX_CONNECTION_NONE) {
-      TOX_ERR_BOOTSTRAP bootstrap_result;
-      const std::string bsAddr = _config.get("bootstrap_address", defaultBootstrapAddress);
-      const uint32_t bsPort = _config.get("bootstrap_port", defaultBootstrapPort);
-      const std::string bsKey = _config.get("bootstrap_key", defaultBootstrapKey);
-      tox_bootstrap(_tox, bsAddr.c_str(), bsPort,
-                    reinterpret_cast<const uint8_t *>(util::hex2bin(bsKey).c_str()),
-                    &bootstrap_result);
-
-      if (bootstrap_result)
-        throw channeling::activate_error(_name, ERR_TOX_INIT + ": Can't decode bootstrapping ip");
+      size_t accepted = 0;
+      /* Go through the list until some node is accepted */
+      for (size_t tried = 0; accepted == 0 && tried < _nodes.size(); tried += _bootstrap_parallel)
+        accepted = bootstrap();
+      if (accepted == 0)
+        throw channeling::activate_error(_datafile, ERR_TOX_INIT + ": Can't decode bootstrapping ip");
     }
 
     DEBUG << "Bootstrapping";
+    _started = true;
     /* @todo Make timeout exception handling */
+    iterate();
+    if (!_datafile.empty() && _checkpoint.count() > 0)
+      _checkpoint_timer = _loop.schedule(_checkpoint, [this]() { checkpoint(); });
+  }
 
-    while (!wasConnected) {
-#ifdef CTOXCORE
-      tox_iterate(_tox, this);
-#else
-      tox_iterate(_tox);
-#endif
-      auto wait = tox_iteration_interval(_tox);
-      if (!wasConnected && (TOX_CONNECTION_NONE != tox_self_get_connection_status(_tox))) {
-        std::array<uint8_t, TOX_ADDRESS_SIZE> address;
-        tox_self_get_address (_tox, address.data ());
-        DEBUG << "Tox is connected with id " << util::ToxId2HR (address);
-        wasConnected = true;
+  ToxChannel::ToxChannel(Hub::Hub* hub, const std::string& config) :
+    channeling::Channel(hub, config),
+    _conference(static_cast<int>(_config.get("conference", "0"))),
+    _instance(ToxInstance::get(_config)),
+    _connect_timeout(static_cast<int>(_config.get("connect_timeout", "0")))
+  {}
+
+  ToxChannel::~ToxChannel() {
+    _instance->unsubscribe(this);
+  }
+
+  std::future<void> ToxChannel::activate() {
+    return std::async(std::launch::async, [this]() {
+      if (_active)
+        return;
+      _instance->subscribe(_conference, this).get();
+      /* Unreachable network shouldn't hold the whole hub, messages wait in the instance */
+      if (_connect_timeout.count() > 0) {
+        auto connected = _instance->connected();
+        if (connected.wait_for(_connect_timeout) == std::future_status::ready)
+          connected.get();
+        else
+          WARNING << "#tox " << _name << " is not connected in " << _connect_timeout.count() << "s, going on without it";
       }
-      std::this_thread::sleep_for( std::chrono::milliseconds (wait));
+      _active = true;
+    });
+  }
+
+  void ToxChannel::incoming(const messaging::message_ptr&& msg) {
+    if (msg->type() == messaging::MessageType::Text) {
+      const auto textmsg = messaging::TextMessage::fromMessage(msg);
+      DEBUG << "#tox " << _name << " " << textmsg->data();
+      _instance->send(_conference, TOX_MESSAGE_TYPE_NORMAL, "[" + textmsg->user()->name() + "]: " + textmsg->data());
+    } else if (msg->type() == messaging::MessageType::Action) {
+      const auto actionmsg = messaging::ActionMessage::fromMessage(msg);
+      DEBUG << "#tox " << _name << " performs action " << actionmsg->data();
+      _instance->send(_conference, TOX_MESSAGE_TYPE_ACTION, "[" + actionmsg->user()->name() + "]: " + actionmsg->data());
+    } else {
+      throw std::runtime_error("Unknown message type");
     }
+  }
 
-#ifdef CTOXCORE
-    tox_conference_new(_tox, NULL);
-#else
-    tox_add_groupchat (_tox);
-#endif
+  void ToxChannel::deliver(TOX_MESSAGE_TYPE type, const std::shared_ptr<const messaging::User>& user, const std::string& text) {
+    messaging::message_ptr message;
+    if (type == TOX_MESSAGE_TYPE_ACTION)
+      message = std::make_shared<const messaging::ActionMessage>(_id, std::shared_ptr<const messaging::User>(user), text);
+    else
+      message = std::make_shared<const messaging::TextMessage>(_id, std::shared_ptr<const messaging::User>(user), text);
+    _hub->newMessage(std::move(message));
+  }
 
-    return 0;
+  const messaging::message_ptr ToxChannel::parse(const char* line) const
+  {
+    const std::string s(line);
+    const auto name = s.substr(0, s.find(":"));
+    const auto text = s.substr(s.find(":"), s.length());
+
+    const auto msg = std::make_shared<const messaging::TextMessage>(_id,
+                                                                    std::make_shared<const messaging::User>(messaging::User(name.c_str())),
+                                                                    text.c_str());
+    return msg;
   }
 }
@@ -1,6 +1,11 @@
 #pragma once
 #include "channel.hpp"
+#include "eventloop.hpp"
 #include <tox/tox.h>
+#include <map>
+#include <deque>
+#include <vector>
+#include <unordered_map>
 
 namespace toxChannel {
 
@@ -16,27 +21,227 @@ namespace toxChannel {
   constexpr auto defaultBotName = "chatsyncbot";   /**< Default bot nickname */
   constexpr auto defaultStatusMessage = "Online";   /**< Default tox status message */
   constexpr auto defaultBotStatus = TOX_USER_STATUS_NONE;   /**< Default bot name */
+
   /**
-   * Tox channel
+   * Tox node to bootstrap from
    */
-  class ToxChannel: public channeling::Channel {
-    Tox * const _tox;        /**< Main tox structure */
-    int toxStart();
-    std::future<void> activate() override;
-    bool wasConnected;
+  struct BootstrapNode {
+    std::string address;                                  /**< Host name or IP, IPv6 without brackets */
+    uint16_t port;                                        /**< UDP port */
+    std::string key;                                      /**< Public key in hex */
+    uint32_t connect_ms;                                  /**< Time to connect when used last time, 0 if unknown */
+    bool failed;                                          /**< Connection didn't happen when used last time */
+  };
+
+  /**
+   * Parse comma-separated list of "address:port:key" nodes, IPv6
+   * address may be in brackets
+   *
+   * \throws config::option_error if some node is malformed
+   */
+  std::vector<BootstrapNode> parseBootstrapNodes(const std::string& list);
+
+  /**
+   * Apply statistics saved by \c formatBootstrapStats() to \c nodes and
+   * sort them so that nodes connected faster go first, then unknown ones
+   * and the failed ones last
+   */
+  void rankBootstrapNodes(std::vector<BootstrapNode>& nodes, const std::string& stats);
+
+  /**
+   * Format connect times of \c nodes to persist between restarts
+   */
+  std::string formatBootstrapStats(const std::vector<BootstrapNode>& nodes);
+
+  class ToxChannel;
+
+  /**
+   * Tox instance shared by all the channels using the same datafile
+   *
+   * One instance keeps one DHT presence and joins all the conferences the
+   * channels are mapped to, so additional channels don't pay for
+   * bootstrapping. Tox isn't thread-safe, so all the calls to it,
+   * including iterations and outgoing messages, are made on the shared
+   * event loop thread.
+   *
+   * Tox state is checkpointed to the datafile periodically while it
+   * changes, so an unclean exit doesn't lose DHT nodes and friends.
+   *
+   * The instance works as soon as it's started. Messages sent before the
+   * first DHT connection are kept in memory, up to \c queue of them, and
+   * sent when it connects.
+   */
+  class ToxInstance {
+    /**
+     * Conference peer known by the instance
+     */
+    struct Peer {
+      std::shared_ptr<const messaging::User> user;        /**< User to attach to messages */
+      bool self;                                          /**< The peer is this bot */
+    };
+
+    /**
+     * Message waiting for the connection
+     */
+    struct Outgoing {
+      uint32_t conference;                                /**< Conference to send to */
+      TOX_MESSAGE_TYPE type;                              /**< Normal message or action */
+      std::string text;                                   /**< Text to send */
+    };
+
+    Tox * const _tox;                                     /**< Main tox structure */
+    eventloop::EventLoop& _loop;                          /**< Loop running all the Tox calls */
+    const std::string _datafile;                          /**< File to keep Tox state in */
+    const std::string _nickname;                          /**< Bot nickname */
+    const std::string _status;                            /**< Bot status message */
+    const std::string _bootstrap_stats;                   /**< File to keep node connect times in */
+    const size_t _bootstrap_parallel;                     /**< Nodes to bootstrap from at once */
+    const std::chrono::seconds _bootstrap_timeout;        /**< Time to wait before trying next nodes */
+    const std::chrono::seconds _checkpoint;               /**< Interval between savedata checkpoints, 0 to disable */
+    const size_t _queue_limit;                            /**< Messages to keep until connected */
+
+    /* Everything below is only touched on the loop */
+    eventloop::TimerId _timer;                            /**< Next iteration, 0 if not scheduled */
+    bool _started;                                        /**< Callbacks are set and bootstrap is started */
+    bool _connected;                                      /**< Tox has connected at least once */
+    std::multimap<uint32_t, ToxChannel*> _channels;       /**< Channels by conference number */
+    std::vector<std::promise<void> > _waiting;            /**< Activations waiting for connection */
+    std::deque<Outgoing> _outgoing;                       /**< Messages sent before connection */
+    std::vector<BootstrapNode> _nodes;                    /**< Bootstrap nodes, best first */
+    size_t _next_node;                                    /**< First node of the next bootstrap round */
+    std::vector<size_t> _round;                           /**< Nodes used in the current round */
+    std::chrono::steady_clock::time_point _round_started; /**< Start of the current round */
+    eventloop::TimerId _bootstrap_timer;                  /**< Next round, 0 if not scheduled */
+    std::unordered_map<uint32_t, std::vector<Peer> > _peers; /**< Peer cache by conference and peer number */
+    eventloop::TimerId _checkpoint_timer;                 /**< Next checkpoint, 0 if not scheduled */
+    std::string _saved;                                   /**< Savedata written by the last checkpoint */
+    std::future<bool> _writing;                           /**< Checkpoint being written in background */
+    std::vector<std::future<void> > _resolving;           /**< Host names of nodes being resolved */
+    std::future<void> _stats_writing;                     /**< Node statistics being written in background */
+    const std::shared_ptr<bool> _alive;                   /**< Cleared on stop, resolved nodes are ignored then */
+
+    void start();                                         /**< Set up the callbacks and bootstrap */
+    void iterate();                                       /**< Run tox_iterate() and schedule the next iteration */
+    void stop();                                          /**< Stop the iterations */
+    void joinConferences();                               /**< Create conferences up to the largest subscribed number */
+    void sendNow(uint32_t conference, TOX_MESSAGE_TYPE type, const std::string& text); /**< Pass the message to Tox */
+
+    /**
+     * Bootstrap from the next \c _bootstrap_parallel nodes and schedule the
+     * next round in case the connection doesn't happen in time
+     *
+     * \retval number of nodes accepted by Tox
+     */
+    size_t bootstrap();
+
+    /**
+     * Pass node \c number with numeric \c address to Tox
+     *
+     * \retval false if Tox didn't accept the node
+     */
+    bool bootstrapNode(size_t number, const std::string& address);
+
+    /**
+     * Resolve host name of node \c number in background and bootstrap from
+     * it on the loop, so slow DNS doesn't stall the loop
+     */
+    void resolveNode(size_t number);
+    void bootstrapDone();                                 /**< Remember connect time of the current round */
+    std::string savedata() const;                         /**< Get current Tox state */
+    bool write(const std::string& data) const;            /**< Atomically replace \c _datafile with \c data */
+
+    /**
+     * Write Tox state in background if it changed since the last
+     * checkpoint and schedule the next one
+     */
+    void checkpoint();
+
+    /**
+     * Pass conference message to the channels mapped to \c conference
+     */
+    void route(uint32_t conference, TOX_MESSAGE_TYPE type, const std::shared_ptr<const messaging::User>& user,
+               const std::string& text);
+
+    std::string peerName(uint32_t conference, uint32_t number) const; /**< Ask Tox for the peer name */
+    void setPeer(uint32_t conference, uint32_t number, std::string&& name); /**< Update cached peer */
+    void refreshPeers(uint32_t conference);               /**< Reread all the peers of \c conference */
+
+    /**
+     * Get peer from the cache, asking Tox only if it's not known yet
+     */
+    const Peer& peer(uint32_t conference, uint32_t number);
 
     static void friendRequestCallback(Tox* tox, const uint8_t* public_key, const uint8_t* data, size_t length, void* userdata);
     static void messageCallback(Tox* tox, uint32_t friendnumber, TOX_MESSAGE_TYPE type, const uint8_t* message, size_t length, void* userdata);
 #ifdef CTOXCORE
     static void groupMessageCallback(Tox* tox, uint32_t conference_number, uint32_t peer_number, TOX_MESSAGE_TYPE type, const uint8_t* message, size_t length, void* user_data);
+    static void peerNameCallback(Tox* tox, uint32_t conference_number, uint32_t peer_number, const uint8_t* name, size_t length, void* user_data);
+    static void peerListCallback(Tox* tox, uint32_t conference_number, void* user_data);
 #else
-    template <typename MsgType>
+    template <TOX_MESSAGE_TYPE type>
     static void groupMessageCallback(Tox* tox, int32_t groupnumber, int32_t peernumber, const uint8_t* message, uint16_t length, void* userdata);
+    static void namelistCallback(Tox* tox, int groupnumber, int peernumber, uint8_t change, void* userdata);
 #endif
+  public:
+    /**
+     * \param config Config of the first channel, Tox options are taken from it
+     */
+    explicit ToxInstance(const config::ConfigParser& config);
+    ~ToxInstance();
+    ToxInstance(const ToxInstance&) = delete;
+    ToxInstance& operator=(const ToxInstance&) = delete;
+
+    /**
+     * Get the instance for the datafile from \c config, creating it if
+     * there is none
+     */
+    static std::shared_ptr<ToxInstance> get(const config::ConfigParser& config);
+
+    /**
+     * Start passing messages of \c conference to \c channel
+     *
+     * Tox is started with the first subscription.
+     *
+     * \retval future ready when Tox is started, it may be not connected yet
+     */
+    std::future<void> subscribe(uint32_t conference, ToxChannel* channel);
+
+    /**
+     * Get future ready when Tox is connected and the conferences exist
+     */
+    std::future<void> connected();
+
+    /**
+     * Stop passing messages to \c channel, returns when the loop won't
+     * touch it anymore
+     */
+    void unsubscribe(ToxChannel* channel);
+
+    /**
+     * Queue \c text to be sent to \c conference, it's held until Tox
+     * is connected
+     */
+    void send(uint32_t conference, TOX_MESSAGE_TYPE type, std::string&& text);
+  };
+
+  /**
+   * Tox channel mapped to one conference of the shared \c ToxInstance
+   */
+  class ToxChannel: public channeling::Channel {
+    const uint32_t _conference;                           /**< Conference number */
+    const std::shared_ptr<ToxInstance> _instance;         /**< Tox shared with the other channels on the same datafile */
+    const std::chrono::seconds _connect_timeout;          /**< Time activation waits for connection, 0 not to wait */
+    std::future<void> activate() override;
+
     static const channeling::ChannelCreatorImpl<ToxChannel> creator;
 
     const messaging::message_ptr parse(const char* line) const override; /**< This would be useful if Tox read something from socket */
-    void pollThread() override;     /**< Thread for tox infinite loop */
+
+    /**
+     * Pass the conference message routed by \c ToxInstance to the hub
+     */
+    void deliver(TOX_MESSAGE_TYPE type, const std::shared_ptr<const messaging::User>& user, const std::string& text);
+    friend class ToxInstance;
   public:
     explicit ToxChannel(Hub::Hub* hub, const std::string& config);
     ~ToxChannel();
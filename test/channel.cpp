@@ -1,4 +1,7 @@
 #include "../src/channel.hpp"
+#include "../src/filewriter.hpp"
+#include "../src/filetail.hpp"
+#include "../src/journal.hpp"
 #include <gtest/gtest.h>
 #include <chrono>
 #include <sys/types.h>
@@ -65,6 +68,148 @@ TEST(FileChannel, files)
   delete[] buffer;
 }
 
+static std::string readAll(const char* path) {
+  char buffer[256];
+  std::string result;
+  const int fd = open(path, O_RDONLY);
+  ssize_t count;
+  while ((count = read(fd, buffer, sizeof(buffer))) > 0)
+    result.append(buffer, count);
+  close(fd);
+  return result;
+}
+
+TEST(FileWriter, GroupCommit)
+{
+  unlink("grouped");
+  {
+    fileChannel::FileWriter writer("grouped", 2, std::chrono::milliseconds(100), fileChannel::SyncPolicy::Commit);
+    writer.write("one\n");
+    std::this_thread::sleep_for( std::chrono::milliseconds (20) );
+    // Neither the count nor the delay is reached
+    ASSERT_EQ(readAll("grouped"), "");
+    writer.write("two\n");
+    std::this_thread::sleep_for( std::chrono::milliseconds (20) );
+    ASSERT_EQ(readAll("grouped"), "one\ntwo\n");
+    writer.write("three\n");
+    std::this_thread::sleep_for( std::chrono::milliseconds (200) );
+    ASSERT_EQ(readAll("grouped"), "one\ntwo\nthree\n");
+    writer.write("four\n");
+  }
+  // Everything is written on close
+  ASSERT_EQ(readAll("grouped"), "one\ntwo\nthree\nfour\n");
+  ASSERT_THROW(fileChannel::parseSyncPolicy("sometimes"), std::invalid_argument);
+}
+
+TEST(FileTail, Follow)
+{
+  unlink("tailed");
+  unlink("tailed.1");
+  unlink("tailed.state");
+  std::mutex mutex;
+  std::vector<std::string> lines;
+  const auto receiver = [&mutex, &lines](const std::string& line) {
+    std::lock_guard<std::mutex> lock(mutex);
+    lines.push_back(line);
+  };
+  const auto received = [&mutex, &lines]() {
+    std::this_thread::sleep_for( std::chrono::milliseconds (100) );
+    std::lock_guard<std::mutex> lock(mutex);
+    auto result = lines;
+    lines.clear();
+    return result;
+  };
+  const auto append = [](const char* path, const std::string& data) {
+    const int fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    ASSERT_EQ(write(fd, data.data(), data.size()), data.size());
+    close(fd);
+  };
+
+  append("tailed", "old\n");
+  {
+    // Existing contents are skipped when starting from the end
+    fileChannel::FileTail tail("tailed", "tailed.state", true, 16, receiver);
+    append("tailed", "one\r\ntw");
+    ASSERT_EQ(received(), std::vector<std::string>({"one"}));
+    append("tailed", "o\nthree");
+    ASSERT_EQ(received(), std::vector<std::string>({"two"}));
+    // Incomplete line of the rotated file is sent when the new file appears
+    rename("tailed", "tailed.1");
+    append("tailed.1", "!\n");
+    append("tailed", "four\n");
+    ASSERT_EQ(received(), std::vector<std::string>({"three!", "four"}));
+    // Truncation restarts reading, long line comes in parts
+    truncate("tailed", 0);
+    ASSERT_EQ(received(), std::vector<std::string>());
+    append("tailed", "five\n");
+    ASSERT_EQ(received(), std::vector<std::string>({"five"}));
+    // Truncated and rewritten up to the same size before we look
+    truncate("tailed", 0);
+    append("tailed", "FIVE\n");
+    ASSERT_EQ(received(), std::vector<std::string>({"FIVE"}));
+    append("tailed", "0123456789abcdefXYZ\nsix");
+    ASSERT_EQ(received(), std::vector<std::string>({"0123456789abcdef", "XYZ"}));
+  }
+  // Position is saved before the incomplete line
+  append("tailed", "\nseven\n");
+  {
+    fileChannel::FileTail tail("tailed", "tailed.state", true, 16, receiver);
+    ASSERT_EQ(received(), std::vector<std::string>({"six", "seven"}));
+  }
+  unlink("tailed");
+  unlink("tailed.1");
+  unlink("tailed.state");
+}
+
+TEST(FileChannel, Spill)
+{
+  unlink("spilled");
+  unlink("spill_channel");
+  const auto hub = new Hub::Hub ("Hub");
+  const auto och = channeling::ChannelFactory::create("file", hub,
+                                                      "data://direction=output\nname=outfile\npath=spilled\nspill=spill_channel");
+  const auto message = [](const std::string& user, const std::string& text) {
+    return std::make_shared<const messaging::TextMessage>(0, std::make_shared<const messaging::User>(messaging::User(std::string(user))), text);
+  };
+
+  // Channel is not active yet, messages wait in the spill queue
+  message("a", "one") >> *och;
+  message("a", "two") >> *och;
+  hub->activate();
+  message("b", "three") >> *och;
+  hub->deactivate();
+  std::this_thread::sleep_for( std::chrono::milliseconds (50) );
+  delete hub;
+
+  ASSERT_EQ(readAll("spilled").find("a: one\na: two\nb: three\n"), 0);
+  unlink("spill_channel");
+}
+
+TEST(ReplayChannel, Replay)
+{
+  unlink("replayed");
+  system("rm -rf replay_journal");
+  {
+    journal::WriterOptions options;
+    journal::JournalWriter writer("replay_journal", options);
+    for (int i = 0; i < 5; ++i)
+      writer.append(1000 + i * 100, 7, i == 4, "user" + std::to_string(i), "message " + std::to_string(i));
+  }
+  const auto hub = new Hub::Hub ("Hub");
+  channeling::ChannelFactory::create("replay", hub, "data://direction=input\nname=replay\npath=replay_journal\nspeed=4\nfrom=1100");
+  channeling::ChannelFactory::create("file", hub, "data://direction=output\nname=outfile\npath=replayed");
+  hub->activate();
+  // Three intervals of 100 ms at four times the pace and the file flush
+  std::this_thread::sleep_for( std::chrono::milliseconds (350) );
+  hub->deactivate();
+  std::this_thread::sleep_for( std::chrono::milliseconds (50) );
+  delete hub;
+
+  ASSERT_EQ(readAll("replayed").find("user1: message 1\nuser2: message 2\nuser3: message 3\nuser4[ACTION]: message 4\n"), 0);
+  unlink("replayed");
+  system("rm -rf replay_journal");
+}
+
 void sockListen(const std::string& ircTestLine, int& sockfd, int& newsockfd) {
   int portno;
   socklen_t clilen;
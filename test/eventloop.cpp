@@ -0,0 +1,53 @@
+#include "../src/eventloop.hpp"
+#include <gtest/gtest.h>
+#include <future>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+
+TEST(EventLoop, Post)
+{
+  eventloop::EventLoop loop;
+  std::promise<bool> in_loop;
+  auto result = in_loop.get_future();
+  loop.post([&loop, &in_loop]() { in_loop.set_value(loop.inLoop()); });
+  ASSERT_EQ(result.wait_for(std::chrono::seconds(1)), std::future_status::ready);
+  ASSERT_TRUE(result.get());
+  ASSERT_FALSE(loop.inLoop());
+}
+
+TEST(EventLoop, Schedule)
+{
+  eventloop::EventLoop loop;
+  std::promise<int> fired;
+  auto result = fired.get_future();
+  const auto start = std::chrono::steady_clock::now();
+  const auto cancelled = loop.schedule(std::chrono::milliseconds(20), [&fired]() { fired.set_value(1); });
+  loop.schedule(std::chrono::milliseconds(50), [&fired]() { fired.set_value(2); });
+  loop.cancel(cancelled);
+  ASSERT_EQ(result.wait_for(std::chrono::seconds(1)), std::future_status::ready);
+  ASSERT_EQ(result.get(), 2);
+  ASSERT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(50));
+}
+
+TEST(EventLoop, Watch)
+{
+  eventloop::EventLoop loop;
+  int fds[2];
+  ASSERT_EQ(pipe2(fds, O_NONBLOCK), 0);
+
+  std::promise<std::string> received;
+  auto result = received.get_future();
+  loop.watch(fds[0], EPOLLIN, [&loop, &received, fds](uint32_t events) {
+      char buf[16] = {};
+      if ((events & EPOLLIN) && read(fds[0], buf, sizeof(buf) - 1) > 0) {
+        loop.unwatch(fds[0]);
+        received.set_value(buf);
+      }
+    });
+  ASSERT_EQ(write(fds[1], "ping", 4), 4);
+  ASSERT_EQ(result.wait_for(std::chrono::seconds(1)), std::future_status::ready);
+  ASSERT_EQ(result.get(), "ping");
+  close(fds[0]);
+  close(fds[1]);
+}
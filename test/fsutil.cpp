@@ -0,0 +1,26 @@
+#include "../src/fsutil.hpp"
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+TEST(FSUtil, AtomicWrite)
+{
+  const std::string path = "fsutil_test.state";
+  unlink(path.c_str());
+  std::string data;
+  ASSERT_FALSE(fsutil::readFile(path, data));
+
+  fsutil::atomicWrite(path, "first");
+  ASSERT_TRUE(fsutil::readFile(path, data));
+  ASSERT_EQ(data, "first");
+
+  fsutil::atomicWrite(path, "2");
+  ASSERT_TRUE(fsutil::readFile(path, data));
+  ASSERT_EQ(data, "2");
+  ASSERT_NE(access((path + ".tmp").c_str(), F_OK), 0);
+  unlink(path.c_str());
+}
+
+TEST(FSUtil, AtomicWriteFailure)
+{
+  EXPECT_THROW(fsutil::atomicWrite("no/such/dir/state", "data"), fsutil::fs_error);
+}
@@ -1,5 +1,6 @@
 #include "../src/http.hpp"
 #include "../src/logging.hpp"
+#include "../src/net.hpp"
 #include <gtest/gtest.h>
 #include <gtest/gtest-spi.h>
 #include <cstdio>
@@ -65,6 +66,27 @@ namespace http {
     ssize_t pending() override {return 0;};
   };
 
+  /**
+   * Returns the predefined parts one by one and then reports closed connection
+   */
+  struct PartialConnection: public ConnectionManager {
+    PartialConnection(std::vector<std::string>&& parts) : _parts(parts) {};
+    ~PartialConnection() {};
+    ssize_t recv(void* buffer, size_t count) override {
+      if (_parts.empty())
+        return 0;
+      const auto part = _parts.front();
+      _parts.erase(_parts.begin());
+      memcpy(buffer, part.c_str(), std::min(part.length(), count));
+      return std::min(part.length(), count);
+    }
+    ssize_t send(const void * const buffer __attribute__((unused)),
+                 size_t		    count __attribute__((unused))) override { return 0; }
+    ssize_t pending() override {return _parts.empty() ? 0 : _parts.front().length();};
+  private:
+    std::vector<std::string> _parts;
+  };
+
   TEST(HTTPRequest, Creation)
   {
     HTTPRequest r(HTTPRequestType::GET, "test");
@@ -87,6 +109,27 @@ Accept: */*\r\nTest-Header: Test value\r\n\r\n");
     ASSERT_STREQ(static_cast<const char *>(ptr), "test line");
   }
 
+  TEST(HTTPRequest, BodyStream)
+  {
+    HTTPRequest r(HTTPRequestType::POST, "test", "/api");
+    auto stream = r.bodyStream();
+    const std::string json = "{\"key\":\"" + std::string(300, 'v') + "\"}";
+    for (const auto c : json)
+      stream.Put(c);
+    stream.Flush();
+    const void* ptr;
+    size_t len;
+    std::tie(ptr, len) = r.body();
+    ASSERT_EQ(len, json.length());
+    ASSERT_EQ(std::string(static_cast<const char *>(ptr), len), json);
+    ASSERT_EQ(r.getHTTPLine(),
+              "POST /api HTTP/1.1\r\nHost: test\r\nAccept: */*\r\nContent-Length: " +
+              std::to_string(json.length()) + "\r\n\r\n");
+    r.addHeader("content-length", "1");
+    ASSERT_EQ(r.getHTTPLine(),
+              "POST /api HTTP/1.1\r\nHost: test\r\nAccept: */*\r\nContent-Length: 1\r\n\r\n");
+  }
+
   TEST(HTTPRequest, ProtoDetection)
   {
     DEFAULT_LOGGING;
@@ -97,13 +140,29 @@ Accept: */*\r\nTest-Header: Test value\r\n\r\n");
                  }, http_error);
   }
 
+  TEST(Networking, SplitHost)
+  {
+    using networking::split_host;
+    ASSERT_EQ(split_host("example.com:443"), std::make_pair(std::string("example.com"), std::string("443")));
+    ASSERT_EQ(split_host("127.0.0.1:80"), std::make_pair(std::string("127.0.0.1"), std::string("80")));
+    ASSERT_EQ(split_host("[::1]:8443"), std::make_pair(std::string("::1"), std::string("8443")));
+    EXPECT_THROW(split_host("example.com"), networking::network_error);
+    EXPECT_THROW(split_host("[::1"), networking::network_error);
+    EXPECT_THROW(split_host("[::1]"), networking::network_error);
+    ASSERT_TRUE(networking::is_ip_literal("127.0.0.1"));
+    ASSERT_TRUE(networking::is_ip_literal("::1"));
+    ASSERT_FALSE(networking::is_ip_literal("example.com"));
+  }
+
   TEST(PerformHTTPRequest, local)
   {
     int sfd, nfd;
     int port = 8080;
     const std::string& answer = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok";
     const auto server = std::make_unique<std::thread>(std::thread(&sockListen, std::ref(answer), std::ref(port), std::ref(sfd), std::ref(nfd)));
-    HTTPRequest req(HTTPRequestType::HEAD, "localhost", "/");
+    HTTPRequest req(HTTPRequestType::GET, "localhost", "/");
+    /* Let the server start listening */
+    std::this_thread::sleep_for(std::chrono::milliseconds (50));
     auto hr = PerformHTTPRequest("http://localhost:8080/", req);
     hr.wait();
     auto result = hr.get();
@@ -115,6 +174,226 @@ Accept: */*\r\nTest-Header: Test value\r\n\r\n");
     server->join();
   }
 
+  TEST(HTTPResponse, Chunked)
+  {
+    auto conn = std::make_unique<PartialConnection>(std::vector<std::string> {
+      "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n4\r\nWi",
+      "ki\r\n5;ext=1\r",
+      "\npedia\r\n0\r\nX-Trailer: yes\r\n",
+      "\r\n"
+    });
+    HTTPResponse result(std::move(conn));
+    ASSERT_EQ(result.code(), 200);
+    const auto data = result.data();
+    ASSERT_EQ(data.second, 9);
+    ASSERT_STREQ(static_cast<const char *>(data.first), "Wikipedia");
+  }
+
+  TEST(HTTPResponse, ChunkedTruncated)
+  {
+    auto conn = std::make_unique<PartialConnection>(std::vector<std::string> {
+      "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n10\r\nshort"
+    });
+    EXPECT_THROW({ HTTPResponse result(std::move(conn));
+                 }, http_error);
+  }
+
+  TEST(HTTPResponse, UntilClose)
+  {
+    auto conn = std::make_unique<PartialConnection>(std::vector<std::string> {
+      "HTTP/1.1 200 OK\r\nConnection: close\r\n\r\nfirst ",
+      "second"
+    });
+    HTTPResponse result(std::move(conn));
+    const auto data = result.data();
+    ASSERT_EQ(data.second, 12);
+    ASSERT_STREQ(static_cast<const char *>(data.first), "first second");
+  }
+
+  TEST(ResponseParser, ByteByByte)
+  {
+    const std::string response = "HTTP/1.1 200 OK\r\nContent-Type:  application/json \r\n"
+                                 "Transfer-Encoding: chunked\r\n\r\n3\r\n{\"a\r\n2\r\n\":\r\n2\r\n1}\r\n0\r\n\r\n";
+    ResponseParser parser;
+    for (size_t i = 0; i < response.length() - 1; i++)
+      ASSERT_FALSE(parser.feed(response.c_str() + i, 1));
+    ASSERT_TRUE(parser.feed(response.c_str() + response.length() - 1, 1));
+    ASSERT_EQ(parser.code(), 200);
+    const auto type = parser.header("content-TYPE");
+    ASSERT_EQ(std::string(type.first, type.second), "application/json");
+    ASSERT_EQ(parser.header("Content-Length").first, nullptr);
+    ASSERT_STREQ(static_cast<const char *>(parser.body().first), "{\"a\":1}");
+  }
+
+  TEST(ResponseParser, ContentLength)
+  {
+    const char head[] = "HTTP/1.0 301 Moved\nLocation: /x\nContent-Length: 4\n\nab";
+    ResponseParser parser;
+    ASSERT_FALSE(parser.feed(head, sizeof(head) - 1));
+    ASSERT_TRUE(parser.headersDone());
+    ASSERT_EQ(parser.state(), ResponseParser::State::Body);
+    ASSERT_TRUE(parser.feed("cd", 2));
+    ASSERT_EQ(parser.code(), 301);
+    ASSERT_EQ(parser.body().second, 4);
+    ASSERT_STREQ(static_cast<const char *>(parser.body().first), "abcd");
+  }
+
+  TEST(ResponseParser, Head)
+  {
+    const char head[] = "HTTP/1.1 200 OK\r\nContent-Length: 1024\r\n\r\n";
+    ResponseParser parser(HTTPRequestType::HEAD);
+    ASSERT_TRUE(parser.feed(head, sizeof(head) - 1));
+    ASSERT_EQ(parser.code(), 200);
+    ASSERT_EQ(parser.body().second, 0);
+    const auto length = parser.header("Content-Length");
+    ASSERT_EQ(std::string(length.first, length.second), "1024");
+  }
+
+  TEST(ResponseParser, Interim)
+  {
+    const char response[] = "HTTP/1.1 100 Continue\r\n\r\n"
+      "HTTP/1.1 103 Early Hints\r\nLink: </style.css>\r\n\r\n"
+      "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok";
+    ResponseParser parser;
+    ASSERT_TRUE(parser.feed(response, sizeof(response) - 1));
+    ASSERT_EQ(parser.code(), 200);
+    ASSERT_EQ(parser.header("Link").first, nullptr);
+    ASSERT_STREQ(static_cast<const char *>(parser.body().first), "ok");
+  }
+
+  TEST(ResponseParser, Malformed)
+  {
+    ResponseParser parser;
+    EXPECT_THROW({ parser.feed("SPDY/3 200 OK\r\n", 15);
+                 }, http_error);
+    ResponseParser unfinished;
+    const char head[] = "HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\n";
+    unfinished.feed(head, sizeof(head) - 1);
+    EXPECT_THROW({ unfinished.finish();
+                 }, http_error);
+  }
+
+  TEST(ResponseParser, Streaming)
+  {
+    std::vector<std::string> pieces;
+    ResponseParser parser([&pieces](const void * const data, size_t size) {
+      pieces.push_back(std::string(static_cast<const char *>(data), size));
+    });
+    const char head[] = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nfirst\r\n";
+    ASSERT_FALSE(parser.feed(head, sizeof(head) - 1));
+    ASSERT_EQ(pieces.size(), 1);
+    const char tail[] = "6\r\nsecond\r\n0\r\n\r\n";
+    ASSERT_TRUE(parser.feed(tail, sizeof(tail) - 1));
+    ASSERT_EQ(pieces.size(), 2);
+    ASSERT_EQ(pieces[0], "first");
+    ASSERT_EQ(pieces[1], "second");
+    ASSERT_EQ(parser.body().second, 0);
+    const auto encoding = parser.header("transfer-encoding");
+    ASSERT_EQ(std::string(encoding.first, encoding.second), "chunked");
+  }
+
+  TEST(PerformHTTPRequest, Streaming)
+  {
+    int sfd, nfd;
+    int port = 8081;
+    const std::string& answer = "HTTP/1.1 200 OK\r\nContent-Length: 8\r\n\r\nstreamed";
+    const auto server = std::make_unique<std::thread>(std::thread(&sockListen, std::ref(answer), std::ref(port), std::ref(sfd), std::ref(nfd)));
+    std::this_thread::sleep_for(std::chrono::milliseconds (50));
+    HTTPRequest req(HTTPRequestType::GET, "localhost", "/");
+    std::string received;
+    auto hr = PerformHTTPRequest("http://localhost:8081/", req,
+                                 [&received](const void * const data, size_t size) {
+      received.append(static_cast<const char *>(data), size);
+    });
+    hr.wait();
+    auto result = hr.get();
+    ASSERT_EQ(result->code(), 200);
+    ASSERT_EQ(received, "streamed");
+    ASSERT_EQ(result->data().second, 0);
+    server->join();
+    close(nfd);
+    close(sfd);
+  }
+
+  TEST(PerformHTTPRequest, Handler)
+  {
+    int sfd, nfd;
+    int port = 8082;
+    const std::string& answer = "HTTP/1.1 429 Too Many Requests\r\nContent-Length: 11\r\n\r\nretry later";
+    const auto server = std::make_unique<std::thread>(std::thread(&sockListen, std::ref(answer), std::ref(port), std::ref(sfd), std::ref(nfd)));
+    std::this_thread::sleep_for(std::chrono::milliseconds (50));
+    HTTPRequest req(HTTPRequestType::GET, "localhost", "/");
+    std::promise<std::pair<int, std::string> > error;
+    auto result = error.get_future();
+    ResponseHandler handler = [&error](std::unique_ptr<HTTPResponse>&& response, std::exception_ptr e) {
+      try {
+        if (e)
+          std::rethrow_exception(e);
+        error.set_value(std::make_pair(response->code(), std::string()));
+      } catch (const http_error& he) {
+        error.set_value(std::make_pair(he.code, he.body));
+      }
+    };
+    PerformHTTPRequest("http://localhost:8082/", req, std::move(handler));
+    ASSERT_EQ(result.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+    const auto& got = result.get();
+    ASSERT_EQ(got.first, 429);
+    ASSERT_EQ(got.second, "retry later");
+    server->join();
+    close(nfd);
+    close(sfd);
+  }
+
+  TEST(PerformHTTPRequest, Timeout)
+  {
+    int sfd, nfd;
+    int port = 8084;
+    /* Server accepts the connection and never answers */
+    const std::string& answer = "";
+    const auto server = std::make_unique<std::thread>(std::thread(&sockListen, std::ref(answer), std::ref(port), std::ref(sfd), std::ref(nfd)));
+    std::this_thread::sleep_for(std::chrono::milliseconds (50));
+    HTTPRequest req(HTTPRequestType::GET, "localhost", "/");
+    req.setTimeout(std::chrono::milliseconds(200));
+    auto hr = PerformHTTPRequest("http://localhost:8084/", req);
+    ASSERT_EQ(hr.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+    EXPECT_THROW(hr.get(), http_error);
+    server->join();
+    close(nfd);
+    close(sfd);
+  }
+
+  TEST(HTTPServer, Request)
+  {
+    std::string method, uri, body;
+    HTTPServer server(0, [&method, &uri, &body](RequestParser& request) {
+        method = request.method();
+        uri = request.uri();
+        const auto& data = request.body();
+        body.assign(static_cast<const char *>(data.first), data.second);
+        return uri == "/hook" ? 200 : 404;
+      }, "127.0.0.1");
+    const std::string url = "http://127.0.0.1:" + std::to_string(server.port());
+
+    HTTPRequest req(HTTPRequestType::POST, "127.0.0.1", "/hook");
+    const std::string json = "{\"update_id\":1}";
+    auto stream = req.bodyStream();
+    for (const char c : json)
+      stream.Put(c);
+    auto hr = PerformHTTPRequest(url + "/hook", req);
+    ASSERT_EQ(hr.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+    ASSERT_EQ(hr.get()->code(), 200);
+    ASSERT_EQ(method, "POST");
+    ASSERT_EQ(uri, "/hook");
+    ASSERT_EQ(body, json);
+
+    HTTPRequest wrong(HTTPRequestType::GET, "127.0.0.1", "/wrong");
+    auto error = PerformHTTPRequest(url + "/wrong", wrong);
+    ASSERT_EQ(error.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+    EXPECT_THROW(error.get(), http_error);
+    ASSERT_EQ(method, "GET");
+    ASSERT_TRUE(body.empty());
+  }
+
   TEST(PerformHTTPRequest, Yandex)
   {
     HTTPRequest req(HTTPRequestType::HEAD, "ya.ru", "/");
@@ -0,0 +1,123 @@
+#include "../src/journal.hpp"
+#include <gtest/gtest.h>
+#include <vector>
+#include <dirent.h>
+#include <unistd.h>
+
+static void cleanJournal(const std::string& path) {
+  DIR* dir = opendir(path.c_str());
+  if (!dir)
+    return;
+  while (const auto entry = readdir(dir))
+    if (entry->d_name[0] != '.')
+      unlink((path + "/" + entry->d_name).c_str());
+  closedir(dir);
+  rmdir(path.c_str());
+}
+
+static size_t countSegments(const std::string& path) {
+  size_t count = 0;
+  DIR* dir = opendir(path.c_str());
+  while (const auto entry = readdir(dir))
+    if (std::string(entry->d_name).find(".seg") != std::string::npos)
+      ++count;
+  closedir(dir);
+  return count;
+}
+
+TEST(Journal, WriteRead)
+{
+  const std::string path = "journal_test";
+  cleanJournal(path);
+  journal::WriterOptions options;
+  options.segment_size = 1024;
+  options.index_bytes = 128;
+  {
+    journal::JournalWriter writer(path, options);
+    for (int i = 0; i < 100; ++i)
+      writer.append(1000 + i * 10, 3, i % 2, "user" + std::to_string(i), "message " + std::to_string(i));
+    // Out of order timestamp is moved forward
+    writer.append(5, 3, 0, "late", "late message");
+  }
+  ASSERT_GT(countSegments(path), 1);
+
+  journal::JournalReader reader(path);
+  std::vector<std::string> texts;
+  const auto collect = [&texts](const journal::Record& record) {
+    texts.emplace_back(record.text, record.text_size);
+    return true;
+  };
+  ASSERT_EQ(reader.read(0, INT64_MAX, collect), 101);
+  ASSERT_EQ(texts.front(), "message 0");
+  ASSERT_EQ(texts.back(), "late message");
+
+  texts.clear();
+  ASSERT_EQ(reader.read(1500, 1550, collect), 5);
+  ASSERT_EQ(texts, std::vector<std::string>({"message 50", "message 51", "message 52", "message 53", "message 54"}));
+
+  reader.read(1110, 1111, [](const journal::Record& record) {
+      EXPECT_EQ(record.timestamp, 1110);
+      EXPECT_EQ(record.origin, 3);
+      EXPECT_EQ(record.type, 1);
+      EXPECT_EQ(std::string(record.user, record.user_size), "user11");
+      return true;
+    });
+  ASSERT_EQ(reader.read(0, 1000, collect), 0);
+
+  // Receiver stops the reading
+  texts.clear();
+  ASSERT_EQ(reader.read(0, INT64_MAX, [&texts](const journal::Record& record) {
+        texts.emplace_back(record.text, record.text_size);
+        return texts.size() < 3;
+      }), 3);
+  ASSERT_EQ(texts, std::vector<std::string>({"message 0", "message 1", "message 2"}));
+  cleanJournal(path);
+}
+
+TEST(Journal, SameMillisecond)
+{
+  const std::string path = "journal_burst";
+  cleanJournal(path);
+  journal::WriterOptions options;
+  options.segment_size = 64;
+  {
+    journal::JournalWriter writer(path, options);
+    for (int i = 0; i < 10; ++i)
+      writer.append(1000, 1, 0, "user", "burst " + std::to_string(i));
+    writer.append(1001, 1, 0, "user", "next");
+  }
+  // The burst overfills its segment instead of starting one named after a later time
+  ASSERT_EQ(countSegments(path), 2);
+  journal::JournalReader reader(path);
+  const auto count = [](const journal::Record&) { return true; };
+  ASSERT_EQ(reader.read(1000, 1001, count), 10);
+  ASSERT_EQ(reader.read(0, 1001, count), 10);
+  ASSERT_EQ(reader.read(1001, 1002, count), 1);
+  cleanJournal(path);
+}
+
+TEST(Journal, TruncatedTail)
+{
+  const std::string path = "journal_tail";
+  cleanJournal(path);
+  {
+    journal::JournalWriter writer(path, journal::WriterOptions());
+    writer.append(1000, 1, 0, "user", "first");
+    writer.append(1001, 1, 0, "user", "second");
+  }
+  DIR* dir = opendir(path.c_str());
+  std::string segment;
+  while (const auto entry = readdir(dir))
+    if (std::string(entry->d_name).find(".seg") != std::string::npos)
+      segment = path + "/" + entry->d_name;
+  closedir(dir);
+  // Cut the last record as a crash in the middle of write would do
+  ASSERT_EQ(truncate(segment.c_str(), 8 + 4 + 13 + 4 + 5 + 10), 0);
+
+  journal::JournalReader reader(path);
+  ASSERT_EQ(reader.read(0, INT64_MAX, [](const journal::Record& record) {
+        EXPECT_EQ(std::string(record.text, record.text_size), "first");
+        return true;
+      }), 1);
+  cleanJournal(path);
+}
@@ -1,6 +1,8 @@
 #include "../src/logging.hpp"
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
+#include <fstream>
+#include <unistd.h>
 
 TEST(Logging, log)
 {
@@ -26,3 +28,130 @@ TEST(Logging, log)
   ASSERT_THAT(output, testing::HasSubstr("ERROR"));
   ASSERT_THAT(output, testing::HasSubstr("FATAL"));
 }
+
+/**
+ * Slow sink counting the messages starting with prefix
+ */
+class CountingSink: public logging::LogSink {
+  const std::string _prefix;
+public:
+  std::atomic<size_t> counted;
+  std::atomic<size_t> dropped_reports;
+  explicit CountingSink(const std::string& prefix) : _prefix(prefix), counted(0), dropped_reports(0) {};
+  void write(const logging::LogMessage&& msg) override {
+    std::this_thread::sleep_for(std::chrono::milliseconds (1));
+    if (msg._message.compare(0, _prefix.size(), _prefix) == 0)
+      ++counted;
+    else if (msg._message.find("log messages dropped") != std::string::npos)
+      ++dropped_reports;
+  }
+};
+
+TEST(Logging, Overflow)
+{
+  auto& logger = logging::LoggerImpl::get();
+  const auto sink = std::make_shared<CountingSink>("overflow");
+  logger.setOutput(std::static_pointer_cast<logging::LogSink>(sink));
+  // Rings of the new threads are small, the sink can't keep up
+  logger.setRingSize(4);
+
+  logger.setOverflow(logging::Overflow::Drop);
+  const size_t dropped = logger.dropped();
+  std::thread([]() {
+    for (int i = 0; i < 100; ++i)
+      DEBUG << "overflow " << i;
+  }).join();
+  std::this_thread::sleep_for(std::chrono::milliseconds (200));
+  ASSERT_GT(logger.dropped(), dropped);
+  ASSERT_EQ(sink->counted + logger.dropped() - dropped, 100);
+  ASSERT_GT(sink->dropped_reports, 0);
+
+  logger.setOverflow(logging::Overflow::Block);
+  sink->counted = 0;
+  std::thread([]() {
+    for (int i = 0; i < 100; ++i)
+      DEBUG << "overflow " << i;
+  }).join();
+  std::this_thread::sleep_for(std::chrono::milliseconds (200));
+  ASSERT_EQ(sink->counted, 100);
+
+  logger.setOverflow(logging::Overflow::Drop);
+  logger.setRingSize(1024);
+}
+
+TEST(Logging, RingReuse)
+{
+  auto& logger = logging::LoggerImpl::get();
+  const auto sink = std::make_shared<CountingSink>("reuse");
+  logger.setOutput(std::static_pointer_cast<logging::LogSink>(sink));
+  const size_t allocated = logger.allocated();
+  // Short threads, like the ones delivering messages, pass their rings on
+  for (int i = 0; i < 50; ++i) {
+    std::thread([i]() { DEBUG << "reuse " << i; }).join();
+    std::this_thread::sleep_for(std::chrono::milliseconds (5));
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds (200));
+  ASSERT_EQ(sink->counted, 50);
+  ASSERT_LT(logger.allocated() - allocated, 10);
+}
+
+TEST(Logging, Disabled)
+{
+  int evaluated = 0;
+  const auto count = [&evaluated]() { return ++evaluated; };
+  const auto old = logging::LoggerImpl::get().setSeverity(logging::Severity::info);
+  // Arguments of disabled levels are not evaluated at all
+  DEBUG << count();
+  TRACE << count();
+  INFO << count();
+  if (evaluated)
+    WARNING << count();
+  else
+    ERROR << count();
+  logging::LoggerImpl::get().setSeverity(old);
+  ASSERT_EQ(evaluated, 2);
+}
+
+TEST(Logging, Binary)
+{
+  auto& logger = logging::LoggerImpl::get();
+  const std::string path = "binary_log";
+  unlink(path.c_str());
+  auto sink = std::make_shared<logging::LogSinkBinary>(path);
+  logger.setOutput(std::static_pointer_cast<logging::LogSink>(sink));
+  ASSERT_TRUE(logger.binary());
+  const std::string str = "str";
+  INFO << "value " << 42 << " " << 1.5 << " " << str << " " << true << 'c' << -7 << std::chrono::seconds(3).count();
+  // Types without raw encoding are formatted by producer
+  WARNING << "pointer " << static_cast<const void*>(nullptr);
+  // Trace site isn't recorded as arguments, but it's printed
+  const std::string trace_site = std::string(__FILE__) + ":" + std::to_string(__LINE__ + 1) + " ";
+  TRACE << "traced";
+  std::this_thread::sleep_for(std::chrono::milliseconds (100));
+  auto printer = std::make_shared<logging::LogSinkPrinter>();
+  logger.setOutput(std::static_pointer_cast<logging::LogSink>(printer));
+  sink.reset();
+  ASSERT_FALSE(logger.binary());
+
+  std::ifstream file(path);
+  const std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  std::ostringstream pointer;
+  pointer << static_cast<const void*>(nullptr);
+  std::ostringstream text;
+  // Messages left by the previous tests without sink go there too
+  const size_t count = logging::decodeBinaryLog(data, text, false);
+  ASSERT_GE(count, 2);
+  ASSERT_NE(text.str().find("[INFO] value 42 1.5 str 1c-73\n"), std::string::npos);
+  ASSERT_NE(text.str().find("[WARNING] pointer " + pointer.str() + "\n"), std::string::npos);
+  ASSERT_NE(text.str().find("[TRACE] " + trace_site + "traced\n"), std::string::npos);
+
+  // Sites are described, a cut record at the end is ignored
+  std::ostringstream sites;
+  ASSERT_EQ(logging::decodeBinaryLog(data.substr(0, data.size() - 1), sites, true), count - 1);
+  ASSERT_NE(sites.str().find("logging.cpp:"), std::string::npos);
+  // Trace site is printed once
+  std::ostringstream traced;
+  logging::decodeBinaryLog(data, traced, true);
+  ASSERT_NE(traced.str().find("[TRACE] " + trace_site + "traced\n"), std::string::npos);
+  unlink(path.c_str());
+}
@@ -0,0 +1,61 @@
+#include "../src/spillqueue.hpp"
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+static channeling::SpillQueue::Entry makeEntry(int i) {
+  return {1000 + i, 2, 0, "user" + std::to_string(i), "message " + std::to_string(i)};
+}
+
+TEST(SpillQueue, Order)
+{
+  const std::string path = "spill_test";
+  unlink(path.c_str());
+  {
+    channeling::SpillQueue queue(path, 4096);
+    ASSERT_TRUE(queue.empty());
+    for (int i = 0; i < 10; ++i)
+      ASSERT_TRUE(queue.push(makeEntry(i)));
+    ASSERT_EQ(queue.size(), 10);
+  }
+  // Contents survive reopening
+  channeling::SpillQueue queue(path, 4096);
+  channeling::SpillQueue::Entry entry;
+  for (int i = 0; i < 10; ++i) {
+    ASSERT_TRUE(queue.front(entry));
+    ASSERT_EQ(entry.timestamp, 1000 + i);
+    ASSERT_EQ(entry.origin, 2);
+    ASSERT_EQ(entry.user, "user" + std::to_string(i));
+    ASSERT_EQ(entry.text, "message " + std::to_string(i));
+    queue.pop();
+  }
+  ASSERT_FALSE(queue.front(entry));
+  unlink(path.c_str());
+}
+
+TEST(SpillQueue, Overflow)
+{
+  const std::string path = "spill_test";
+  unlink(path.c_str());
+  channeling::SpillQueue queue(path, 256);
+  ASSERT_FALSE(queue.push({0, 0, 0, "user", std::string(300, 'x')}));
+
+  // Wrap around the ring many times, only the newest entries stay
+  for (int i = 0; i < 100; ++i)
+    ASSERT_TRUE(queue.push(makeEntry(i)));
+  ASSERT_GT(queue.dropped(), 0);
+  ASSERT_EQ(queue.size() + queue.dropped(), 101);
+
+  channeling::SpillQueue::Entry entry;
+  int expected = 100 - queue.size();
+  while (queue.front(entry)) {
+    ASSERT_EQ(entry.text, "message " + std::to_string(expected++));
+    queue.pop();
+  }
+  ASSERT_EQ(expected, 100);
+
+  // Size change resets the file
+  ASSERT_TRUE(queue.push(makeEntry(0)));
+  channeling::SpillQueue resized(path, 512);
+  ASSERT_TRUE(resized.empty());
+  unlink(path.c_str());
+}
@@ -1,6 +1,8 @@
 #include "../src/telegram.hpp"
 #include "../src/channel.hpp"
 #include "../src/http.hpp"
+#include "../src/fsutil.hpp"
+#include "../src/net.hpp"
 #include <rapidjson/stringbuffer.h>
 #include <rapidjson/writer.h>
 #include <gtest/gtest.h>
@@ -36,9 +38,7 @@ namespace telegram {
 
   static std::string response_contents;
 
-  std::unique_ptr<http::HTTPResponse>
-  TgChannel::httpRequest(const std::string	& srv __attribute__((unused)),
-                         const http::HTTPRequest& req __attribute__((unused))) const {
+  static std::unique_ptr<http::HTTPResponse> mockedResponse() {
     if (_read) {
       return nullptr;
     }
@@ -51,11 +51,296 @@ namespace telegram {
     return res;
   }
 
+  /**
+   * sendMessage seen by the mocked sender
+   */
+  struct SentMessage {
+    std::int64_t chat;
+    std::string text;
+    std::chrono::steady_clock::time_point time;
+  };
+
+  static std::mutex sender_mutex;
+  static std::vector<SentMessage> sent;                   /**< Requests started by the sender */
+  static std::deque<std::exception_ptr> answers;          /**< Errors for the next requests, success when empty */
+  static bool hold_answers = false;                       /**< Keep handlers in \c held instead of answering */
+  static std::deque<http::ResponseHandler> held;          /**< Requests waiting for the answer */
+
+  void MessageSender::request(const std::shared_ptr<http::HTTPRequest>& req,
+                              http::ResponseHandler&& handler) {
+    const auto body = req->body();
+    rapidjson::Document doc;
+    doc.Parse(std::string(static_cast<const char*>(body.first), body.second).c_str());
+    std::lock_guard<std::mutex> lock(sender_mutex);
+    sent.push_back(SentMessage {doc["chat_id"].GetInt64(), doc["text"].GetString(), std::chrono::steady_clock::now()});
+    if (hold_answers) {
+      held.push_back(std::move(handler));
+      return;
+    }
+    std::exception_ptr error;
+    if (!answers.empty()) {
+      error = answers.front();
+      answers.pop_front();
+    }
+    auto done = std::make_shared<http::ResponseHandler>(std::move(handler));
+    _loop.post([done, error]() { (*done)(nullptr, error); });
+  }
+
+  /**
+   * Wait up to a few seconds until \c count requests are sent
+   */
+  static bool waitSent(size_t count, std::chrono::milliseconds timeout = std::chrono::seconds(5)) {
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (std::chrono::steady_clock::now() < deadline) {
+      {
+        std::lock_guard<std::mutex> lock(sender_mutex);
+        if (sent.size() >= count)
+          return true;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    return false;
+  }
+
+  /**
+   * Answer the oldest held request successfully
+   */
+  static void answerHeld() {
+    std::lock_guard<std::mutex> lock(sender_mutex);
+    auto done = std::make_shared<http::ResponseHandler>(std::move(held.front()));
+    held.pop_front();
+    eventloop::EventLoop::shared().post([done]() { (*done)(nullptr, nullptr); });
+  }
+
+  static void resetSender() {
+    std::lock_guard<std::mutex> lock(sender_mutex);
+    sent.clear();
+    answers.clear();
+    held.clear();
+    hold_answers = false;
+  }
+
+  static std::int64_t polled_offset = -1;                 /**< Offset of the poll that got \c response_contents */
+  static std::atomic_bool poll_fails(false);              /**< Polls fail as with revoked token */
+  static std::atomic<int> failed_polls(0);                /**< Polls failed since set */
+
+  std::unique_ptr<http::HTTPResponse>
+  UpdateDispatcher::httpRequest(const http::HTTPRequest& req) {
+    if (poll_fails) {
+      ++failed_polls;
+      throw http::http_error("Server return HTTP error 401", 401, "{\"ok\":false,\"error_code\":401}");
+    }
+    if (!_read) {
+      const auto body = req.body();
+      rapidjson::Document doc;
+      doc.Parse(std::string(static_cast<const char*>(body.first), body.second).c_str());
+      polled_offset = doc["offset"].GetInt64();
+    }
+    return mockedResponse();
+  }
+
+  TEST(Telegram, TokenBucket)
+  {
+    TokenBucket bucket(2, 2);
+    const auto start = TokenBucket::clock::now();
+    ASSERT_TRUE(bucket.take(start));
+    ASSERT_TRUE(bucket.take(start));
+    ASSERT_FALSE(bucket.take(start));
+    ASSERT_EQ(std::chrono::duration_cast<std::chrono::milliseconds>(bucket.wait(start)).count(), 500);
+    ASSERT_TRUE(bucket.take(start + std::chrono::milliseconds(500)));
+    // Burst doesn't grow above the limit
+    ASSERT_TRUE(bucket.take(start + std::chrono::seconds(10)));
+    ASSERT_TRUE(bucket.take(start + std::chrono::seconds(10)));
+    ASSERT_FALSE(bucket.take(start + std::chrono::seconds(10)));
+  }
+
+  TEST(Telegram, UpdateReader)
+  {
+    struct Update {
+      std::int64_t id;
+      bool has_message;
+      std::int64_t chat;
+      api::ChatType type;
+      std::string from;
+      std::string text;
+    };
+    std::vector<Update> updates;
+    const std::function<bool(const api::MessageRef&)> receiver = [&updates](const api::MessageRef& msg) {
+      updates.push_back(Update {msg.update_id, msg.has_message, msg.chat_id, msg.chat_type, msg.from, msg.text});
+      return true;
+    };
+    std::string answer = "{\"ok\":true,\"result\":["
+      "{\"update_id\":10,\"message\":{\"from\":{\"first_name\":\"a\"},\"chat\":{\"id\":1,\"type\":\"private\"},\"text\":\"one\"}},"
+      "{\"update_id\":11,\"edited_message\":{\"from\":{\"first_name\":\"a\"},\"chat\":{\"id\":1,\"type\":\"private\"},\"text\":\"edit\"}},"
+      "{\"update_id\":12,\"message\":{\"from\":{\"first_name\":\"b\"},\"chat\":{\"id\":-100,\"type\":\"forum\"},\"text\":\"two\"}},"
+      "{\"update_id\":13,\"message\":{\"from\":{\"first_name\":\"c\"},\"chat\":{\"id\":2,\"type\":\"supergroup\"},\"text\":\"three\"}}]}";
+    UpdateReader handler(receiver, false);
+    rapidjson::Reader reader;
+    rapidjson::InsituStringStream stream(&answer[0]);
+    ASSERT_FALSE(reader.Parse<rapidjson::kParseInsituFlag>(stream, handler).IsError());
+    ASSERT_TRUE(handler.ok());
+    ASSERT_EQ(updates.size(), 4);
+    ASSERT_EQ(updates[0].id, 10);
+    ASSERT_TRUE(updates[0].has_message);
+    ASSERT_EQ(updates[0].type, api::ChatType::Private);
+    ASSERT_EQ(updates[0].from, "a");
+    ASSERT_EQ(updates[0].text, "one");
+    // Other kinds of updates are only confirmed
+    ASSERT_EQ(updates[1].id, 11);
+    ASSERT_FALSE(updates[1].has_message);
+    // Unknown chat type doesn't break the batch
+    ASSERT_EQ(updates[2].type, api::ChatType::Unknown);
+    ASSERT_EQ(updates[2].chat, -100);
+    ASSERT_EQ(updates[2].text, "two");
+    ASSERT_EQ(updates[3].type, api::ChatType::Supergroup);
+    ASSERT_EQ(updates[3].text, "three");
+
+    updates.clear();
+    std::string error = "{\"ok\":false,\"error_code\":409,\"description\":\"Conflict\"}";
+    UpdateReader failed(receiver, false);
+    rapidjson::InsituStringStream error_stream(&error[0]);
+    ASSERT_FALSE(reader.Parse<rapidjson::kParseInsituFlag>(error_stream, failed).IsError());
+    ASSERT_FALSE(failed.ok());
+    ASSERT_EQ(failed.error(), 409);
+    ASSERT_TRUE(updates.empty());
+  }
+
+  TEST(Telegram, SenderOrder)
+  {
+    DEFAULT_LOGGING;
+    resetSender();
+    hold_answers = true;
+    const auto sender = std::make_shared<MessageSender>("order:b", 2);
+    const double rate = 6000;
+    sender->send(1, rate, std::chrono::milliseconds(0), "a");
+    sender->send(1, rate, std::chrono::milliseconds(0), "b");
+    sender->send(2, rate, std::chrono::milliseconds(0), "c");
+    sender->send(3, rate, std::chrono::milliseconds(0), "d");
+    ASSERT_TRUE(waitSent(2));
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    {
+      // Only two requests in flight, one per chat
+      std::lock_guard<std::mutex> lock(sender_mutex);
+      ASSERT_EQ(sent.size(), 2);
+      ASSERT_EQ(sent[0].text, "a");
+      ASSERT_EQ(sent[1].text, "c");
+    }
+    // Chat 1 is free again, its next message goes first
+    answerHeld();
+    ASSERT_TRUE(waitSent(3));
+    {
+      std::lock_guard<std::mutex> lock(sender_mutex);
+      ASSERT_EQ(sent[2].text, "b");
+      ASSERT_EQ(held.size(), 2);
+    }
+    answerHeld();
+    ASSERT_TRUE(waitSent(4));
+    {
+      std::lock_guard<std::mutex> lock(sender_mutex);
+      ASSERT_EQ(sent[3].text, "d");
+      ASSERT_EQ(sent[3].chat, 3);
+    }
+    answerHeld();
+    answerHeld();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    resetSender();
+  }
+
+  TEST(Telegram, SenderMerge)
+  {
+    DEFAULT_LOGGING;
+    resetSender();
+    hold_answers = true;
+    const auto sender = std::make_shared<MessageSender>("merge:b");
+    const double rate = 6000;
+    const std::chrono::milliseconds window(100);
+    const auto start = std::chrono::steady_clock::now();
+    sender->send(7, rate, window, "a");
+    // Idle chat doesn't wait for the window
+    ASSERT_TRUE(waitSent(1));
+    {
+      std::lock_guard<std::mutex> lock(sender_mutex);
+      ASSERT_LT(sent[0].time - start, window);
+    }
+    // These wait for "a", so they are merged
+    sender->send(7, rate, window, "b");
+    sender->send(7, rate, window, "c");
+    std::this_thread::sleep_for(window * 2);
+    // The window of "b" is over
+    sender->send(7, rate, window, "d");
+    answerHeld();
+    ASSERT_TRUE(waitSent(2));
+    answerHeld();
+    ASSERT_TRUE(waitSent(3));
+    answerHeld();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    std::lock_guard<std::mutex> lock(sender_mutex);
+    ASSERT_EQ(sent.size(), 3);
+    ASSERT_EQ(sent[1].text, "b\nc");
+    ASSERT_EQ(sent[2].text, "d");
+    sent.clear();
+  }
+
+  TEST(Telegram, SenderRetry)
+  {
+    DEFAULT_LOGGING;
+    resetSender();
+    answers.push_back(std::make_exception_ptr(http::http_error("Too Many Requests", 429,
+      "{\"ok\":false,\"error_code\":429,\"parameters\":{\"retry_after\":1}}")));
+    answers.push_back(std::make_exception_ptr(http::http_error("Request timed out")));
+    answers.push_back(std::make_exception_ptr(http::http_error("Bad Gateway", 502)));
+    answers.push_back(nullptr);
+    answers.push_back(std::make_exception_ptr(http::http_error("Bad Request", 400)));
+    const auto sender = std::make_shared<MessageSender>("retry:b");
+    const double rate = 6000;
+    sender->send(5, rate, std::chrono::milliseconds(0), "x");
+    sender->send(5, rate, std::chrono::milliseconds(0), "y");
+    sender->send(5, rate, std::chrono::milliseconds(0), "z");
+    ASSERT_TRUE(waitSent(6, std::chrono::seconds(10)));
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    std::lock_guard<std::mutex> lock(sender_mutex);
+    ASSERT_EQ(sent.size(), 6);
+    // 429 holds the chat for retry_after, the message keeps its place
+    ASSERT_EQ(sent[1].text, "x");
+    ASSERT_GE(sent[1].time - sent[0].time, std::chrono::seconds(1));
+    // Transient errors are retried with growing delay
+    ASSERT_EQ(sent[2].text, "x");
+    ASSERT_GE(sent[2].time - sent[1].time, std::chrono::milliseconds(MessageSender::retry_delay));
+    ASSERT_EQ(sent[3].text, "x");
+    ASSERT_GE(sent[3].time - sent[2].time, std::chrono::milliseconds(MessageSender::retry_delay * 2));
+    // Client error drops the message
+    ASSERT_EQ(sent[4].text, "y");
+    ASSERT_EQ(sent[5].text, "z");
+    sent.clear();
+  }
+
+  TEST(Telegram, Split)
+  {
+    ASSERT_EQ(textLength("Тест"), 4);
+    ASSERT_EQ(textLength("\xF0\x9F\x98\x80"), 2);
+    ASSERT_EQ(splitText("").size(), 0);
+    ASSERT_EQ(splitText("short"), std::vector<std::string>({"short"}));
+    // Cut at word boundary, separator is dropped
+    ASSERT_EQ(splitText("one two three", 9), std::vector<std::string>({"one two", "three"}));
+    // Line boundary is preferred over word one
+    ASSERT_EQ(splitText("one two three\nfour five", 20), std::vector<std::string>({"one two three", "four five"}));
+    // Multibyte characters are never cut
+    const auto& parts = splitText("ТестТестТ", 4);
+    ASSERT_EQ(parts, std::vector<std::string>({"Тест", "Тест", "Т"}));
+    ASSERT_EQ(splitText("a\xF0\x9F\x98\x80", 2), std::vector<std::string>({"a", "\xF0\x9F\x98\x80"}));
+
+    const std::string long_line(message_limit * 2 + 10, 'x');
+    const auto& long_parts = splitText(long_line);
+    ASSERT_EQ(long_parts.size(), 3);
+    ASSERT_EQ(long_parts[0].length(), message_limit);
+    ASSERT_EQ(long_parts[2].length(), 10);
+  }
+
   TEST(Telegram, Name)
   {
     DEFAULT_LOGGING;
     const auto hub = new Hub::Hub ("Hub");
-    const auto ich = channeling::ChannelFactory::create("telegram", hub, "data://direction=inout\nname=tg\nbotid=a\nhash=b\nchat=c");
+    const auto ich = channeling::ChannelFactory::create("telegram", hub, "data://direction=inout\nname=tg\nbotid=a\nhash=b\nchat=336435018\nstate=none");
     // Check that at least constructor works
     ASSERT_EQ(ich->name(),	"tg");
     ASSERT_EQ(ich->direction(), channeling::ChannelDirection::Bidirectional);
@@ -77,7 +362,7 @@ namespace telegram {
     response_contents = s.GetString();
     const auto hub = new Hub::Hub ("Hub");
     //    const auto ich = channeling::ChannelFactory::create("telegram", hub, "data://direction=inout\nname=tg\nbotid=" + botid + "\nhash=" + hash + "\nchat=" + chat);
-    const auto ich = channeling::ChannelFactory::create("telegram", hub, "data://direction=inout\nname=tg\nbotid=a\nhash=b\nchat=c");
+    const auto ich = channeling::ChannelFactory::create("telegram", hub, "data://direction=inout\nname=tg\nbotid=a\nhash=b\nchat=336435018\nstate=none");
     channeling::ChannelFactory::create("file", hub, "data://direction=output\nname=outfile");
     auto msg = std::make_shared<const messaging::TextMessage>(0,
                                                               std::make_shared<const messaging::User>( messaging::User("R")), "test");
@@ -99,7 +384,7 @@ namespace telegram {
       response_contents = "{\"ok\":true,\"result\":[{\"update_id\":544181644, \"message\":{\"message_id\":173,\"from\":{\"id\":336435018,\"first_name\":\"tester\",\"language_code\":\"en-RU\"},\"chat\":{\"id\":336435018,\"first_name\":\"ray\",\"type\":\"private\"},\"date\":1498543700,\"text\":\"\u0422\u0435\u0441\u0442\"}}]}";
     const auto hub = new Hub::Hub ("Hub");
     //    const auto ich = channeling::ChannelFactory::create("telegram", hub, "data://direction=inout\nname=tg\nbotid=" + botid + "\nhash=" + hash + "\nchat=" + chat);
-    const auto ich = channeling::ChannelFactory::create("telegram", hub, "data://direction=inout\nname=tg\nbotid=a\nhash=b\nchat=c");
+    const auto ich = channeling::ChannelFactory::create("telegram", hub, "data://direction=inout\nname=tg\nbotid=a\nhash=b\nchat=336435018\nstate=none");
     channeling::ChannelFactory::create("file", hub, "data://direction=output\nname=outfile");
 
     _read = false;
@@ -124,6 +409,168 @@ namespace telegram {
     delete[] buffer;
   }
 
+  TEST(Telegram, webhook)
+  {
+    DEFAULT_LOGGING
+    const auto hub = new Hub::Hub ("Hub");
+    channeling::ChannelFactory::create("telegram", hub, "data://direction=inout\nname=tg\nbotid=w\nhash=b\nchat=336435018\nstate=none\nmode=webhook\nlisten=8083\nlisten_address=127.0.0.1\nsecret=s");
+    channeling::ChannelFactory::create("file", hub, "data://direction=output\nname=outfile");
+    hub->activate();
 
+    const std::string update = "{\"update_id\":544181645, \"message\":{\"message_id\":174,\"from\":{\"id\":336435018,\"first_name\":\"hook\"},\"chat\":{\"id\":336435018,\"type\":\"private\"},\"text\":\"webhook\"}}";
+    http::HTTPRequest wrong(http::HTTPRequestType::POST, "127.0.0.1", "/");
+    wrong.bodyStream().Put('{');
+    wrong.bodyStream().Put('}');
+    ASSERT_THROW(http::PerformHTTPRequest("http://127.0.0.1:8083", wrong).get(), http::http_error);
 
+    http::HTTPRequest req(http::HTTPRequestType::POST, "127.0.0.1", "/");
+    req.addHeader("X-Telegram-Bot-Api-Secret-Token", "s");
+    req.addHeader("Content-Type", "application/json");
+    for (const auto c : update)
+      req.bodyStream().Put(c);
+    ASSERT_EQ(http::PerformHTTPRequest("http://127.0.0.1:8083", req).get()->code(), 200);
+    std::this_thread::sleep_for( std::chrono::milliseconds (10) );
+    hub->deactivate();
+    delete hub;
+
+    const std::string valid_line = "hook: webhook";
+    const int buffer_size = valid_line.length() + 1;
+    const auto buffer = new char[buffer_size];
+    int fd = open("output", O_RDONLY | O_SYNC);
+    ASSERT_NE(fd, -1);
+    bzero(buffer, buffer_size);
+    int err = read(fd, buffer, buffer_size - 1);
+    ASSERT_EQ(err, buffer_size - 1);
+    close(fd);
+    ASSERT_STREQ(buffer, valid_line.c_str());
+    delete[] buffer;
+  }
+}
+
+namespace telegram {
+  /**
+   * Pass \c update to the webhook listening on \c port
+   *
+   * \retval HTTP code of the answer
+   */
+  static int postUpdate(int port, const std::string& update) {
+    http::HTTPRequest req(http::HTTPRequestType::POST, "127.0.0.1", "/");
+    req.addHeader("X-Telegram-Bot-Api-Secret-Token", "s");
+    for (const auto c : update)
+      req.bodyStream().Put(c);
+    try {
+      return http::PerformHTTPRequest("http://127.0.0.1:" + std::to_string(port), req).get()->code();
+    } catch (const http::http_error& e) {
+      return e.code;
+    } catch (const networking::network_error&) {
+      return 0;
+    }
+  }
+
+  static std::string chatUpdate(int id, int chat, const std::string& text) {
+    return "{\"update_id\":" + std::to_string(id) + ", \"message\":{\"message_id\":1,\"from\":{\"id\":1,\"first_name\":\"u\"},"
+      "\"chat\":{\"id\":" + std::to_string(chat) + ",\"type\":\"private\"},\"text\":\"" + text + "\"}}";
+  }
+
+  TEST(Telegram, WebhookNeedsSecret)
+  {
+    DEFAULT_LOGGING
+    const auto hub = new Hub::Hub ("Hub");
+    channeling::ChannelFactory::create("telegram", hub, "data://direction=input\nname=tg\nbotid=open\nhash=b\nchat=1\nstate=none\nmode=webhook\nlisten=8086");
+    channeling::ChannelFactory::create("file", hub, "data://direction=output\nname=out\npath=open_output");
+    ASSERT_THROW(hub->activate(), channeling::activate_error);
+    hub->deactivate();
+    delete hub;
+    unlink("open_output");
+  }
+
+  TEST(Telegram, HoldUntilSubscribed)
+  {
+    DEFAULT_LOGGING
+    const std::string config = "data://direction=input\nbotid=hold\nhash=b\nmode=webhook\nlisten=8085\nsecret=s\nstate=hold.offset\n";
+    unlink("hold_first");
+    unlink("hold_second");
+    const auto first = new Hub::Hub ("First");
+    channeling::ChannelFactory::create("telegram", first, config + "name=first\nchat=1");
+    channeling::ChannelFactory::create("file", first, "data://direction=output\nname=out\npath=hold_first");
+    const auto second = new Hub::Hub ("Second");
+    channeling::ChannelFactory::create("telegram", second, config + "name=second\nchat=2");
+    channeling::ChannelFactory::create("file", second, "data://direction=output\nname=out\npath=hold_second");
+
+    first->activate();
+    // Second channel of the bot is not active yet, its update isn't confirmed
+    ASSERT_EQ(postUpdate(8085, chatUpdate(1, 2, "early")), 503);
+    ASSERT_EQ(postUpdate(8085, chatUpdate(2, 1, "one")), 200);
+    second->activate();
+    ASSERT_EQ(postUpdate(8085, chatUpdate(1, 2, "early")), 200);
+    // All the channels are here, nobody waits for this chat
+    ASSERT_EQ(postUpdate(8085, chatUpdate(3, 3, "unknown")), 200);
+
+    first->deactivate();
+    second->deactivate();
+    delete first;
+    delete second;
+    // Webhook is stopped with the last channel
+    ASSERT_EQ(postUpdate(8085, chatUpdate(4, 1, "late")), 0);
+
+    std::string data;
+    ASSERT_TRUE(fsutil::readFile("hold_first", data));
+    ASSERT_NE(data.find("u: one"), std::string::npos);
+    ASSERT_TRUE(fsutil::readFile("hold_second", data));
+    ASSERT_NE(data.find("u: early"), std::string::npos);
+    unlink("hold_first");
+    unlink("hold_second");
+    unlink("hold.offset");
+  }
+
+  TEST(Telegram, Offset)
+  {
+    DEFAULT_LOGGING
+    const std::string state = "offset_test.offset";
+    fsutil::atomicWrite(state, "41");
+    response_contents = "{\"ok\":true,\"result\":[" + chatUpdate(41, 336435018, "resumed") + "]}";
+    const auto hub = new Hub::Hub ("Hub");
+    channeling::ChannelFactory::create("telegram", hub, "data://direction=input\nname=tg\nbotid=offset\nhash=b\nchat=336435018\nstate=" + state);
+    channeling::ChannelFactory::create("file", hub, "data://direction=output\nname=outfile\npath=offset_output");
+
+    polled_offset = -1;
+    _read = false;
+    _keep_connected = true;
+    hub->activate();
+    std::string data;
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+    while (std::chrono::steady_clock::now() < deadline && (!fsutil::readFile(state, data) || data != "42"))
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    hub->deactivate();
+    _keep_connected = false;
+    delete hub;
+
+    // Poll resumes from the saved offset and confirms the received update
+    ASSERT_EQ(polled_offset, 41);
+    ASSERT_TRUE(fsutil::readFile(state, data));
+    ASSERT_EQ(data, "42");
+    unlink(state.c_str());
+    unlink("offset_output");
+  }
+
+  TEST(Telegram, PollBackoff)
+  {
+    DEFAULT_LOGGING
+    const auto hub = new Hub::Hub ("Hub");
+    channeling::ChannelFactory::create("telegram", hub, "data://direction=input\nname=tg\nbotid=backoff\nhash=b\nchat=1\nstate=none");
+    channeling::ChannelFactory::create("file", hub, "data://direction=output\nname=out\npath=backoff_output");
+    failed_polls = 0;
+    poll_fails = true;
+    hub->activate();
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    // Failed poll isn't repeated at once
+    ASSERT_EQ(failed_polls, 1);
+    const auto stopping = std::chrono::steady_clock::now();
+    hub->deactivate();
+    delete hub;
+    poll_fails = false;
+    unlink("backoff_output");
+    // Waiting for the retry doesn't hold the shutdown
+    ASSERT_LT(std::chrono::steady_clock::now() - stopping, std::chrono::milliseconds(500));
+  }
 }
@@ -1,4 +1,5 @@
 #include "../src/channel.hpp"
+#include "../src/toxchannel.hpp"
 #include <gtest/gtest.h>
 #include <tox/tox.h>
 
@@ -36,6 +37,42 @@ TEST(ToxChannel, name)
   delete hub;
 }
 
+TEST(ToxUtil, bootstrapNodes)
+{
+  const std::string key1 = "A09162D68618E742FFBCA1C2C70385E6679604B2D80EA6E84AD0996A1AC8A074";
+  const std::string key2 = "F404ABAA1C99A9D37D61AB54898F56793E1DEF8BD46B1038B9D822E8460FAB67";
+  const std::string key3 = "8E7D0B859922EF569298B4D261A8CCB5FEA14FB91ED412A7603A585A25698832";
+  auto nodes = toxChannel::parseBootstrapNodes("1.2.3.4:33445:" + key1 + ",[2001:db8::1]:443:" + key2 + ",host:1:" + key3);
+  ASSERT_EQ(nodes.size(), 3);
+  ASSERT_EQ(nodes[1].address, "2001:db8::1");
+  ASSERT_EQ(nodes[1].port, 443);
+  ASSERT_EQ(nodes[1].key, key2);
+  ASSERT_THROW(toxChannel::parseBootstrapNodes("1.2.3.4:" + key1), config::option_error);
+  ASSERT_THROW(toxChannel::parseBootstrapNodes("1.2.3.4:99999:" + key1), config::option_error);
+
+  // Fast nodes go first, unknown ones then and the failed ones last
+  toxChannel::rankBootstrapNodes(nodes, key1 + " 0 1\n" + key3 + " 1500 0\n");
+  ASSERT_EQ(nodes[0].key, key3);
+  ASSERT_EQ(nodes[1].key, key2);
+  ASSERT_EQ(nodes[2].key, key1);
+
+  auto saved = toxChannel::parseBootstrapNodes("1.2.3.4:33445:" + key1 + ",host:1:" + key3);
+  toxChannel::rankBootstrapNodes(saved, toxChannel::formatBootstrapStats(nodes));
+  ASSERT_EQ(saved[0].key, key3);
+  ASSERT_EQ(saved[0].connect_ms, 1500);
+  ASSERT_TRUE(saved[1].failed);
+}
+
+TEST(ToxChannel, shared)
+{
+  const auto first = toxChannel::ToxInstance::get(config::ConfigParser("data://datafile=/tmp/toxdata\n"));
+  const auto second = toxChannel::ToxInstance::get(config::ConfigParser("data://datafile=/tmp/toxdata\nconference=1\n"));
+  const auto other = toxChannel::ToxInstance::get(config::ConfigParser("data://datafile=/tmp/toxdata2\n"));
+  // Channels on one datafile share the Tox instance
+  ASSERT_EQ(first, second);
+  ASSERT_NE(first, other);
+}
+
 #if !defined(TRAVIS_BUILD)
 TEST(ToxChannel, running)
 {